@@ -41,6 +41,8 @@
 extern jm_log_level_enu_t fmigo_loglevel ;
 //whether to ignore fmi2_cs_providesDirectionalDerivatives in Server.cpp
 extern bool alwaysComputeNumericalDirectionalDerivatives;
+//number of extra FMU instances Server.cpp uses to compute numerical directional derivatives in parallel
+extern int numPerturbationClones;
 
 void info(const char* fmt, ...);
 void error(const char* fmt, ...);
@@ -0,0 +1,37 @@
+#ifndef FMIGO_EVENTLOCATOR_H
+#define FMIGO_EVENTLOCATOR_H
+
+#include <vector>
+#include <functional>
+#include <stddef.h>
+
+namespace fmigo {
+  /// Finds the first zero crossing of a set of event indicators within one integrator step,
+  /// with the Illinois variant of regula falsi. The indicators are probed at states taken from
+  /// a cubic Hermite interpolant over the step, so no probe costs a re-integration.
+  /// Used by the master for ME FMUs and by fmigo-server for the ME FMUs it hosts.
+  class EventLocator {
+    double m_t0;
+    //states, derivatives and event indicators at both ends of the bracket and the probe
+    std::vector<double> m_x0, m_f0, m_x1, m_f1, m_xm, m_fm;
+    std::vector<double> m_ga, m_gb, m_gm;
+
+  public:
+    /// Sets time t and states x, and gets the derivatives into dxdt and the event indicators into g
+    typedef std::function<void(double t, const double *x, double *dxdt, std::vector<double>& g)> evaluator;
+
+    /// Evaluates the n states x0 at the start of the step, t0. x0 is copied, so the caller can integrate it afterwards
+    void start(const evaluator& f, size_t n, double t0, const double *x0);
+
+    /**
+     * Evaluates the states x1 at the end of the step, t1, and narrows down the first event in between.
+     * Returns false if no event indicator has changed sign over the step, which can happen when
+     * only some intermediate stage of the integrator saw the event.
+     * Otherwise ta and tb are before and after the event, at most tol apart.
+     * The last evaluation is at some probe time, so the caller has to put the states back.
+     */
+    bool locate(const evaluator& f, double t1, const double *x1, double tol, double& ta, double& tb);
+  };
+}
+
+#endif //FMIGO_EVENTLOCATOR_H
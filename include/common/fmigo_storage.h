@@ -27,40 +27,46 @@ typedef vector<Bounds> BoundsVector;
      nominals = 1 << 4,
      bounds_i = states | derivatives | nominals
  };
+/// Number of STORAGE types, and their index into the per-type arrays of FmigoStorage
+#define FMIGO_STORAGE_TYPES 4
+#define FMIGO_STORAGE_SLOT(type) ((type) == STORAGE::nominals ? 3 : (type) >> 2)
+
+/// Range checks on the indexed accessors. They sit on the hot path of every
+/// RHS evaluation, so release builds skip them
+#ifdef NDEBUG
+#define FMIGO_STORAGE_CHECK(cond, what) do {} while (0)
+#else
+#define FMIGO_STORAGE_CHECK(cond, what)                                 \
+    do {                                                                \
+        if(!(cond)){                                                    \
+            fprintf(stderr, "Error: FmigoStorage::%s out of range\n", what); \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+#endif
+
 class FmigoStorage {
 #define CREATE_DATA_HPP(name)                                           \
-    private:                                                            \
-        Storage m_##name;   /* to store the data */                     \
  public:                                                                \
-    inline Data & get_current_##name() { return m_##name.first ;}       \
-    inline Data & get_backup_##name()  { return m_##name.second;}       \
+    inline Data & get_current_##name() { return get_current(STORAGE::name);} \
+    inline Data & get_backup_##name()  { return get_backup(STORAGE::name);}  \
     inline double get_current_##name(size_t id, size_t index){          \
-        if(index > get_end(id,STORAGE::name)){                          \
-            fprintf(stderr,"Error: out of range for Data::iterator get_"#name""); \
-            exit(1);                                                    \
-        }                                                               \
-        return *(get_current_##name().begin()+get_offset(id,STORAGE::name)+index); \
+        FMIGO_STORAGE_CHECK(index < get_size(id,STORAGE::name), "get_current_"#name); \
+        return get_current_##name()[get_offset(id,STORAGE::name)+index]; \
     }                                                                   \
     inline double get_backup_##name(size_t id, size_t index){           \
-        if(index > get_end(id,STORAGE::name)){                          \
-            fprintf(stderr,"Error: out of range for Data::iterator get_backup_"#name""); \
-            exit(1);                                                    \
-        }                                                               \
-        return *(get_backup_##name().begin()+get_offset(id,STORAGE::name)+index); \
+        FMIGO_STORAGE_CHECK(index < get_size(id,STORAGE::name), "get_backup_"#name); \
+        return get_backup_##name()[get_offset(id,STORAGE::name)+index]; \
     }                                                                   \
     inline void get_current_##name(double *ret, size_t id) {            \
         /*need do extract the correct dataset belonging to client*/     \
         size_t o = get_offset( id, STORAGE::name );                     \
-        size_t e = get_end( id, STORAGE::name );                        \
-        copy(get_current_##name().begin() + o,                          \
-             get_current_##name().begin() + e,                          \
-             ret + o);                                                  \
+        memcpy(ret + o, get_current_##name().data() + o,                \
+               get_size(id, STORAGE::name) * sizeof(double));           \
     }                                                                   \
     inline void get_current_##name(double *ret) {                       \
-        /*need do extract the correct dataset belonging to client*/     \
-        copy(get_current_##name().begin(),                              \
-             get_current_##name().end(),                                \
-             ret);                                                      \
+        memcpy(ret, get_current_##name().data(),                        \
+               get_current_##name().size() * sizeof(double));           \
     }
 
     CREATE_DATA_HPP(states);
@@ -68,46 +74,30 @@ class FmigoStorage {
     CREATE_DATA_HPP(derivatives);
     CREATE_DATA_HPP(nominals);
 
-#define CURRENT_BACKUP(name)                                            \
-    inline Data& get_##name(enum STORAGE type){                         \
-        switch (type) {                                                 \
-        case STORAGE::states: return get_##name##_states();             \
-        case STORAGE::derivatives: return get_##name##_derivatives();   \
-        case STORAGE::indicators: return get_##name##_indicators();     \
-        case STORAGE::nominals: return get_##name##_nominals();         \
-        default:                                                        \
-            /*gcc isn't quite smart enough to catch that this should never happen*/ \
-            fprintf(stderr, "get_"#name"(): Unknown STORAGE: %d\n",type); \
-            exit(1);                                                    \
-        }                                                               \
-    }
-
-    CURRENT_BACKUP(current);
-    CURRENT_BACKUP(backup);
-
  private:
-    BoundsVector m_bounds;
-    BoundsVector m_bounds_i;
-    inline BoundsVector & get_bounds(enum STORAGE type) {
-        switch(type){
-        case STORAGE::indicators:
-            return m_bounds_i;
-        case STORAGE::states:
-        case STORAGE::derivatives:
-        case STORAGE::nominals:
-            return m_bounds;
-        default:
-            /*gcc isn't quite smart enough to catch that this should never happen*/
-            fprintf(stderr, "get_bounds(): Unknown STORAGE: %d\n", type);
-            exit(1);
-        }
-
+    /// One contiguous array per type, current in .first and backup in .second.
+    /// Each client owns the range [m_offsets[type][id], m_offsets[type][id+1])
+    Storage m_data[FMIGO_STORAGE_TYPES];
+    vector<size_t> m_offsets[FMIGO_STORAGE_TYPES];
+
+    inline size_t slot(enum STORAGE type) {
+        FMIGO_STORAGE_CHECK(type == STORAGE::states || type == STORAGE::indicators ||
+                            type == STORAGE::derivatives || type == STORAGE::nominals, "slot");
+        return FMIGO_STORAGE_SLOT(type);
+    }
+    inline size_t get_end(const size_t id, enum STORAGE type){
+        FMIGO_STORAGE_CHECK(id + 1 < m_offsets[slot(type)].size(), "get_end");
+        return m_offsets[slot(type)][id + 1];
     }
-
-    inline size_t & get_end(const size_t id, enum STORAGE type){return get_bounds(type).at(id).second;}
 
  public:
-    inline size_t & get_offset(const size_t id, enum STORAGE type){return get_bounds(type).at(id).first;}
+    inline Data& get_current(enum STORAGE type){ return m_data[slot(type)].first; }
+    inline Data& get_backup(enum STORAGE type) { return m_data[slot(type)].second; }
+
+    inline size_t get_offset(const size_t id, enum STORAGE type){
+        FMIGO_STORAGE_CHECK(id + 1 < m_offsets[slot(type)].size(), "get_offset");
+        return m_offsets[slot(type)][id];
+    }
     inline size_t get_size(const size_t id, enum STORAGE type) {return get_end(id,type) - get_offset(id,type);}
 
     void allocate_storage_states(const vector<size_t> &size_vec,enum STORAGE type);
@@ -149,17 +139,38 @@ class FmigoStorage {
 
     /** cycle(): maybe reset?
       * Toggles the working dataset with a backup copy from last call of sync()
-      * swap only makes shallow copies
+      * swap only flips the buffer pointers, nothing is copied
       */
     void cycle();
 
 
     /** sync():
-     *  Makes a deep copy of the current dataset to a backup dataset
+     *  Makes a deep copy of the current dataset to a backup dataset.
+     *  Both buffers must hold the same values afterwards, so this is one
+     *  memcpy per type rather than a flip
      */
     void sync();
 
 
+    /** restore():
+     *  Makes the backup dataset current again, leaving both equal.
+     *  Same result as cycle() followed by sync(), with a single copy
+     */
+    void restore();
+
+
+    /** sync():
+     *  Like sync(), but only for the data belonging to client_id
+     */
+    void sync(size_t client_id);
+
+
+    /** restore():
+     *  Like restore(), but only for the data belonging to client_id
+     */
+    void restore(size_t client_id);
+
+
     /** test_function():
      *  test the functionality of the class
      */
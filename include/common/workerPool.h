@@ -0,0 +1,44 @@
+#ifndef FMIGO_WORKERPOOL_H
+#define FMIGO_WORKERPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stddef.h>
+
+namespace fmigo {
+  /// Threads that are started once and then run the same job over and over, fn(0) .. fn(size()-1).
+  /// Worker 0 is whoever calls run(), so a pool of size 1 has no threads at all
+  class WorkerPool {
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    const std::function<void(size_t)> *m_fn;
+    unsigned m_generation;      //bumped by every run(), so workers can tell a new job from a spurious wakeup
+    size_t m_busy;              //threads still in the current job
+    bool m_quit;
+
+    void work(size_t k, unsigned generation);
+
+  public:
+    WorkerPool();
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /// Starts n-1 threads, after stopping any old ones
+    void start(size_t n);
+
+    /// Joins the threads
+    void stop();
+
+    size_t size() const { return m_threads.size() + 1; }
+
+    /// Calls fn(k) for every worker k, in parallel, and returns when all calls have returned
+    void run(const std::function<void(size_t)>& fn);
+  };
+}
+
+#endif //FMIGO_WORKERPOOL_H
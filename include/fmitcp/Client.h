@@ -50,7 +50,10 @@ namespace fmitcp {
         int messages;
         fmitcp_master::BaseMaster * m_master;
 
-        fmitcp_proto::fmi2_kinematic_res last_kinematic;
+        //last fmi2_kinematic_res, decoded
+        //last_dz holds the results of all directional derivatives concatenated, in the order they were requested
+        std::vector<double> last_future_velocities;
+        std::vector<double> last_dz;
 
         //value cache
         std::unordered_map<int, double>      m_reals;
@@ -0,0 +1,93 @@
+#ifndef MEINTEGRATOR_H_
+#define MEINTEGRATOR_H_
+
+#define FMILIB_BUILDING_LIBRARY
+#include <fmilib.h>
+#include <vector>
+#include <map>
+#include "gsl-interface.h"
+#include "common/eventLocator.h"
+
+namespace fmitcp {
+
+  /// Integrates a ModelExchange FMU with cgsl, including state and time events,
+  /// so fmigo-server can present it to the master as a Co-Simulation FMU.
+  /// The time loop is the same as the one in tools/wrapper/sources/wrapper.c, except that
+  /// events are located the same way as ModelExchangeStepper does, with fmigo::EventLocator
+  class MEIntegrator {
+
+    //handed to fmu_function() by cgsl
+    struct fmu_parameters {
+        fmi2_import_t *FMU;
+        size_t nx, ni;
+        double t_ok, t_past;
+        bool stateEvent;
+        //event indicators from the latest evaluation and from the last stored state
+        std::vector<fmi2_real_t> ei, ei_b;
+    };
+
+    //what's needed to restart integration from before an event
+    struct backup {
+        double t, h;
+        unsigned long failed_steps;
+        std::vector<double> x, dydt;
+    };
+
+    struct timeloop {
+        double t_safe, dt_new, t_crossed, t_end;
+    };
+
+    fmu_parameters m_p;
+    backup m_backup;
+    cgsl_simulation m_sim;
+    fmi2_event_info_t m_eventInfo;
+    fmigo::EventLocator m_locator;
+    std::vector<double> m_fm;
+
+    //fmi2_import_set_fmu_state() doesn't roll back m_eventInfo, so it is kept with each FMU state
+    std::map<fmi2_FMU_state_t, fmi2_event_info_t> m_savedEventInfo;
+
+    //set when the FMU state has been changed behind our back
+    bool m_reload;
+
+    //sets time and states, gets derivatives, and event indicators into p->ei
+    static void evaluate(fmu_parameters *p, double t, const double x[], double dxdt[]);
+    static int fmu_function(double t, const double x[], double dxdt[], void *params);
+
+    //pushes m_sim.t and the states to the FMU, and reads the event indicators into m_p.ei_b
+    fmi2_status_t syncFMU();
+    void storeStates();
+    void restoreStates();
+    void reload(double t);
+
+    void getSafeAndCrossed(timeloop& tl);
+    void step(timeloop& tl);
+    //integrates to t without looking at event indicators
+    void integrateTo(double t);
+    //to be run with the states restored to before a step that crossed an event, see ModelExchangeStepper::locateEvent()
+    bool locateEvent(timeloop& tl);
+    void safeTimeStep(timeloop& tl);
+    fmi2_status_t newDiscreteStates();
+
+  public:
+    /// FMU must be instantiated as fmi2_model_exchange. integrator is a cgsl_integrator_ids
+    MEIntegrator(fmi2_import_t *FMU, int integrator);
+    ~MEIntegrator();
+
+    /// To be called right after fmi2_import_exit_initialization_mode()
+    fmi2_status_t initialize();
+
+    /// Integrates from t to t+dt, handling any events along the way
+    fmi2_status_t doStep(double t, double dt);
+
+    /// Call after fmi2_import_get_fmu_state(), so that the event info can be rolled back along with state
+    void stateSaved(fmi2_FMU_state_t state) { m_savedEventInfo[state] = m_eventInfo; }
+
+    /// Call after fmi2_import_set_fmu_state(). Restores the event info saved with state,
+    /// and makes the next doStep() pick up the restored states
+    void stateRestored(fmi2_FMU_state_t state);
+  };
+
+}
+
+#endif
@@ -8,13 +8,17 @@
 #include "fmitcp-common.h"
 #include <map>
 #include <list>
+#include <functional>
 #include "common/common.h"
 #include "common/timer.h"
+#include "common/workerPool.h"
 
 using namespace std;
 
 namespace fmitcp {
 
+  class MEIntegrator;
+
   /// Serves an FMU to a port via FMI/TCP.
   class Server {
 
@@ -34,10 +38,82 @@ namespace fmitcp {
 
     void setStartValues();
 
+    //FMU states given back by releaseState(), for getState() to overwrite in place
+    //FMI 2.0 allows fmi2GetFMUstate() to reuse a previously returned state, so this saves allocations
+    std::vector<fmi2_FMU_state_t> m_freeStates;
+
+    //like fmi2_import_get_fmu_state(), but reuses a state from m_freeStates if there is one
+    fmi2_status_t getState(fmi2_FMU_state_t *state);
+
+    //puts *state in m_freeStates and sets *state to NULL
+    void releaseState(fmi2_FMU_state_t *state);
+
+    //actually frees all FMU states, before the instance goes away
+    void freeStates();
+
+    //unperturbed step shared by the future velocities and all numerical directional derivatives
+    //of one fmi2_kinematic_req, so each seed only costs one extra do_step()
+    //kept as a member to avoid allocations
+    struct baselinestep {
+        fmi2_FMU_state_t state;                     //state before the step, NULL if none
+        double t, dt;
+        std::vector<fmi2_value_reference_t> vrs;    //reals gotten after the step
+        std::vector<fmi2_real_t> values;
+    };
+    baselinestep m_baseline;
+
+    //extra instances for computing numerical directional derivatives in parallel, see -P
+    struct clone {
+        fmi2_import_t *instance;
+        fmi2_callback_functions_t callbacks;
+        fmi2_FMU_state_t state;     //copy of m_baseline.state
+    };
+    std::vector<clone> m_clones;
+    std::vector<fmi2_byte_t> m_serializedState;
+    fmigo::WorkerPool m_workers;    //one worker per clone plus this instance, started along with the clones
+
+    void instantiateClones(fmi2_type_t simType, fmi2_boolean_t visible);
+    void freeClones();
+
+    //calls f on every clone, and drops them all if any call fails, so derivatives go back to being computed serially
+    void forEachClone(const char *what, std::function<fmi2_status_t(fmi2_import_t*)> f);
+
+    //numerical directional derivatives of the first nderivs m_seeds into m_dz, spread over this instance and m_clones
+    //m_baseline must be filled in
+    fmi2_status_t computeNumericalDirectionalDerivativesParallel(size_t nderivs);
+
+    //true if directional derivatives are computed by perturbing the FMU rather than asking it
+    bool usesNumericalDirectionalDerivatives() const;
+
+    //one directional derivative of a fmi2_kinematic_req, decoded from either encoding
+    struct derivseed {
+        std::vector<fmi2_value_reference_t> z_ref, v_ref;
+        std::vector<fmi2_real_t> dv;
+    };
+
+    //decoded fmi2_kinematic_req and its results, reused to avoid allocations
+    std::vector<fmi2_value_reference_t> m_futureVelocityVRs;
+    std::vector<derivseed> m_seeds;
+    std::vector<std::vector<fmi2_real_t> > m_dz;
+
+    //setX part of fmi2_kinematic_req
+    fmi2_status_t setKinematicInputs(const fmitcp_proto::fmi2_kinematic_req& r);
+
+    //if baseline is not NULL then it is used instead of doing an unperturbed step
+    fmi2_status_t getDirectionalDerivative(const derivseed& seed, std::vector<fmi2_real_t>& dz, const baselinestep *baseline);
+
     fmi2_status_t getDirectionalDerivatives(
         const fmitcp_proto::fmi2_import_get_directional_derivative_req& r,
         fmitcp_proto::fmi2_import_get_directional_derivative_res& response);
 
+    //cgsl integrator ID when hosting a ModelExchange FMU as Co-Simulation, else -1, see get_xml_req
+    //m_meIntegrator is created when leaving initialization mode
+    int m_meIntegratorId;
+    MEIntegrator *m_meIntegrator;
+
+    //rewrites the ModelExchange part of modelDescription.xml into CoSimulation
+    static std::string meToCsXml(const std::string& xml);
+
     //the purpose of this vector is to minimize the amount of allocations that need to happen
     //during every call to clientData()
     vector<char> responseBuffer;
@@ -127,10 +203,13 @@ public:
 
     bool hasCapability(fmi2_capabilities_enu_t cap) const;
 
+    //if baseline is not NULL then z_ref must be in baseline->vrs,
+    //and only the perturbed step is taken (from baseline->state)
     std::vector<fmi2_real_t> computeNumericalDirectionalDerivative(
         const std::vector<fmi2_value_reference_t>& z_ref,
         const std::vector<fmi2_value_reference_t>& v_ref,
-        const std::vector<fmi2_real_t>& dv);
+        const std::vector<fmi2_real_t>& dv,
+        const baselinestep *baseline = NULL);
   };
 
 };
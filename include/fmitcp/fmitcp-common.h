@@ -66,6 +66,7 @@ namespace fmitcp {
 #define USE_GET_REAL_S 1
 #define USE_3BYTE_STATUS_RES 1
 #define USE_GET_REAL_RES_S 1
+#define USE_KINEMATIC_S 1
 #define SERVER_CLIENTDATA_NO_STRING_RET 1
 
 //don't bother checking if a value was already requested?
@@ -84,6 +85,22 @@ namespace fmitcp {
         double communicationstepsize;
         bool newStep;
     };
+
+    //header of the binary fmi2_kinematic_req (USE_KINEMATIC_S), followed by:
+    //  int vrs[nreals], double values[nreals]      weak coupling reals
+    //  int vrs[nfuture]                            future velocities, no fake do_step() if nfuture == 0
+    //  nderivs times: int n, int z_ref[n], int v_ref[n], double dv[n]
+    //  nother bytes of protobuf fmi2_kinematic_req, holding any ints, bools and strings
+    //the response is a status byte, int nfuture, int ndz, double future_velocities[nfuture], double dz[ndz]
+    //where dz is the result of all directional derivatives concatenated
+    struct kinematic_req_s {
+        double currentcommunicationpoint;
+        double communicationstepsize;
+        int nreals;
+        int nfuture;
+        int nderivs;
+        int nother;
+    };
 }
 
 #endif
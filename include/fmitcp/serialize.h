@@ -3,6 +3,7 @@
 
 #include <string>
 #include <sstream>
+#include <vector>
 #include "fmitcp.pb.h"
 
 namespace fmitcp {
@@ -99,6 +100,11 @@ namespace fmitcp {
         std::string fmi2_import_get_event_indicators(int nz);
         std::string fmi2_import_get_continuous_states(int nx);
         std::string fmi2_import_get_derivatives(int nDerivatives);
+        //compound message for model exchange RHS evaluations. the first overload only gets derivatives and event indicators
+        std::string fmi2_me_eval(int nDerivatives, int nz);
+        std::string fmi2_me_eval(double time, const double* x, int nx, int nDerivatives, int nz);
+        //compound message for model exchange events. runs the whole event iteration on the server
+        std::string fmi2_me_handle_event(int nx, int nz);
         std::string fmi2_import_get_nominal_continuous_states(int nx);
 
         // ========= FMI 2.0 CS & ME COMMON FUNCTIONS ============
@@ -187,7 +193,37 @@ namespace fmitcp {
         std::string fmi2_import_get_directional_derivative(const std::vector<int>& v_ref, const std::vector<int>& z_ref, const std::vector<double>& dv);
 
         // ========= NETWORK SPECIFIC FUNCTIONS ============
-        std::string get_xml();
+        //meIntegrator >= 0 asks the server to host a ModelExchange FMU as Co-Simulation, see get_xml_req
+        std::string get_xml(int meIntegrator = -1);
+
+        //fmi2_kinematic_req in a form that is cheap to fill in every step, see StrongMaster
+        //pack() gives the binary format described by kinematic_req_s if USE_KINEMATIC_S == 1, else protobuf
+        struct kinematic_req {
+            double currentCommunicationPoint, communicationStepSize;
+
+            //weak coupling reals
+            std::vector<int> realVRs;
+            std::vector<double> reals;
+
+            //if not empty then the server does a fake do_step() to get future velocities
+            std::vector<int> futureVelocityVRs;
+
+            //directional derivatives, with z_ref/v_ref/dv of all of them concatenated
+            std::vector<int> derivSizes;
+            std::vector<int> zRefs, vRefs;
+            std::vector<double> dvs;
+
+            //weak coupling ints, bools and strings - rare enough to not bother with a binary format
+            fmitcp_proto::fmi2_kinematic_req other;
+
+            kinematic_req();
+            //clears everything, keeping allocated memory around
+            void clear();
+            //true if there is nothing for the server to do
+            bool empty() const;
+            void addDirectionalDerivative(const std::vector<int>& z_ref, const std::vector<int>& v_ref, const double *dv);
+            std::string pack() const;
+        };
     }
 }
 
@@ -16,6 +16,7 @@
 using namespace fmigo_storage;
 #endif
 #include <chrono>
+#include <atomic>
 
 namespace fmitcp_master {
     class BaseMaster {
@@ -42,7 +43,8 @@ namespace fmitcp_master {
         zmq::socket_t rep_socket;
         bool initing, paused, running;
         bool zmqControl;
-        int m_pendingRequests;
+        //atomic since ModelExchangeStepper can queue requests from several threads
+        std::atomic<int> m_pendingRequests;
         double t; //current time
 
         explicit BaseMaster(zmq::context_t &context, std::vector<FMIClient*> clients, std::vector<WeakConnection> weakConnections);
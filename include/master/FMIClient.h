@@ -96,6 +96,11 @@ namespace fmitcp_master {
         size_t getNumEventIndicators(void);
         size_t getNumContinuousStates(void);
 
+        /// Which of this FMU's states each state derivative depends on, according to ModelStructure/Derivatives.
+        /// dependsOnInputs[i] is set if derivative i may depend on inputs.
+        /// Derivatives without dependency information depend on everything.
+        void getDerivativeDependencies(std::vector<std::vector<size_t> >& states, std::vector<bool>& dependsOnInputs);
+
         // --- These methods overrides Client methods. Most of them just passes the result to the Master ---
 
         void on_fmi2_import_instantiate_res                     (fmitcp_proto::jm_status_enu_t status);
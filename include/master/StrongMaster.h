@@ -10,6 +10,7 @@
 
 #include "WeakMasters.h"
 #include "sc/Solver.h"
+#include "fmitcp/serialize.h"
 
 namespace fmitcp_master {
 class WeakConnection;
@@ -35,7 +36,7 @@ class StrongMaster : public JacobiMaster {
     //for keeping track of what outputs from which clients each client will want values from
     std::map<int, OutputRefsType> clientGetXs;
 
-    void getDirectionalDerivative(fmitcp_proto::fmi2_kinematic_req& kin, const sc::Vec3& seedVec, const std::vector<int>& accelerationRefs, const std::vector<int>& forceRefs);
+    void getDirectionalDerivative(fmitcp::serialize::kinematic_req& kin, const sc::Vec3& seedVec, const std::vector<int>& accelerationRefs, const std::vector<int>& forceRefs);
 
     //crank the system until the open set contains target
     //if target is empty then the system is cranked until all FMUs have been executed
@@ -54,10 +55,46 @@ class StrongMaster : public JacobiMaster {
     //all kinematic FMUs must be in the open set before calling this function
     void stepKinematicFmus(double t, double dt);
 
+    //kinematic step plan, compiled in prepare() so stepKinematicFmus() needs no casts or lookups
+    //one entry per (equation, force connector, acceleration connector),
+    //in the order the directional derivatives are requested and returned
+    struct mobilityplanentry {
+        sc::Equation *eq;
+        StrongConnector *forceConnector;
+        int clientId;
+        int slot;                                       //in the solver's mobility storage
+        bool spatial, rotational;
+        const std::vector<int> *accelerationRefs;       //of the acceleration connector
+        const std::vector<int> *angularAccelerationRefs;
+        const std::vector<int> *forceRefs;              //of the force connector
+        const std::vector<int> *torqueRefs;
+    };
+    std::vector<mobilityplanentry> m_mobilityPlan;
+
+    //kinematic requests and offsets into returned dz, by client ID
+    //reused every step to avoid allocations
+    std::vector<fmitcp::serialize::kinematic_req> m_kin;
+    std::vector<int> m_kinOfs;
+
     //computed forces, for writeFields()
     std::vector<double> forces;
     int getNumForces() const;
 
+    //offset of each client's forces in this->forces
+    std::vector<int> m_forceOffsets;
+
+    //VRs of each client's forces and torques, matching its range in this->forces
+    //so all of them can be set with a single set_real
+    std::vector<std::vector<int> > m_forceVRs;
+    std::vector<double> m_forceValues;
+
+    //client IDs of the FMUs in each of the solver's islands
+    std::vector<std::vector<int> > m_islandClients;
+
+    //queues a client's strong coupling forces and do_step()
+    //returns the number of force values put in this->forces
+    int sendForcesAndStep(int id, double t, double dt);
+
     //for avoiding allocations in getInputWeakRefsAndValues()
     InputRefsValuesType m_refValues;
 
@@ -76,10 +113,33 @@ class StrongMaster : public JacobiMaster {
 
     //resets m_refValues and fills with values via m_simpleConnections
     void initRefValues(const fmitcp::int_set& cset);
+
+    //mobility caching, see -Y
+    struct mobilitycache {
+        int period;         //get new directional derivatives at least every period steps
+        double tolerance;   //or when a constraint velocity misses its prediction by more than this, if > 0
+        int age;            //steps since the last refresh
+        bool refresh;       //get new directional derivatives this step
+    };
+    std::vector<mobilitycache> m_mobilityCache;   //by client ID
+
+    //constraint velocities predicted by the last solve, by equation index
+    std::vector<double> m_predictedVelocities;
+    std::vector<double> m_predictionErrors;
+
+    //number of directional derivatives requested and skipped thanks to caching
+    long m_derivsRequested, m_derivsSaved;
+
+    //decides which kinematic FMUs need new mobilities this step
+    void updateMobilityCache();
 public:
     StrongMaster(zmq::context_t &context, std::vector<FMIClient*> slaves, std::vector<WeakConnection> weakConnections,
                  sc::Solver *strongCouplingSolver, bool holonomic, const std::vector<Rend>& rends);
     ~StrongMaster();
+
+    //reuse FMU id's mobilities for up to period steps, or until a constraint it is part of
+    //ends up more than tolerance (if > 0) off the velocity predicted by the solver
+    void setMobilityCaching(int id, int period, double tolerance);
     void prepare();
     void runIteration(double t, double dt);
 
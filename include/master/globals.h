@@ -18,6 +18,9 @@ namespace fmigo {
 
     extern fmigo::timer timer;
 
+    //cgsl integrator for ModelExchange FMUs integrated by the master, see -i
+    extern int meIntegrator;
+
     /**
      * @brief Returns the separator used for the current file format.
      * For CSV this is comma, for TikZ this is space.
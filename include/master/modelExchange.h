@@ -7,6 +7,10 @@
 
 #ifdef USE_GPL
 #include "gsl-interface.h"
+#include "common/eventLocator.h"
+#include "common/workerPool.h"
+#include <mutex>
+#include <condition_variable>
 #endif
 
 using namespace fmitcp_master;
@@ -25,6 +29,8 @@ struct Backup
     unsigned long failed_steps;
 };
 class ModelExchangeStepper;
+/** One independent group of ME FMUs, integrated by its own cgsl_simulation.
+ *  x holds the states of clients[c] from offsets[c] onward */
 struct fmu_parameters{
 
     double t_ok;
@@ -33,12 +39,24 @@ struct fmu_parameters{
 
     ModelExchangeStepper* stepper;       /* ModelExchangeStepper object pointer */
     std::vector<FMIClient*> clients;            /* FMIClient vector */
+    std::vector<size_t> offsets;                /* where each client's states start in x */
     std::vector<int> intv;            /* FMIClient vector */
     //std::vector<WeakConnection> weakConnections;
 
     bool stateEvent;
     Backup backup;
     bool sim_started;
+    bool solveLoops;              /* weak connections need solveLoops() between setting states and getting derivatives */
+
+    /* Jacobian for the implicit integrators, by finite differences over groups of structurally orthogonal columns */
+    std::vector<std::vector<size_t> > jacRows;  /* rows that can be nonzero in each column */
+    std::vector<std::vector<size_t> > colors;   /* columns perturbed together */
+    std::vector<double> jx, jh, jf0, jf1;       /* scratch space */
+
+    TimeLoop timeLoop;
+    /* used by locateEvent(), along with derivatives after the event */
+    fmigo::EventLocator locator;
+    std::vector<double> fm;
 };
 struct fmu_model{
     cgsl_model *model;
@@ -47,10 +65,18 @@ struct fmu_model{
 
 class ModelExchangeStepper : public BaseMaster {
 #ifdef USE_GPL
-cgsl_simulation m_sim;
-fmu_parameters m_p;
-fmu_model m_model;
-TimeLoop timeLoop;
+//ME clients that aren't connected to each other are integrated separately, one simulation per group
+std::vector<cgsl_simulation> m_sims;
+std::vector<fmu_parameters*> m_groups;
+
+//groups are integrated on threads of their own when none of them needs solveLoops().
+//their requests are gathered up and sent together by meWait()
+bool m_concurrent, m_threaded;
+fmigo::WorkerPool m_groupThreads;   //one worker per group, started by prepareME()
+std::mutex m_waitMutex;
+std::condition_variable m_waitCond;
+int m_running, m_waiting;
+unsigned m_round;
 #endif
 
 std::vector<WeakConnection> me_weakConnections;
@@ -64,6 +90,13 @@ std::vector<WeakConnection> me_weakConnections;
     ~ModelExchangeStepper();
 
 #ifdef USE_GPL
+    /** meWait
+     *  wait() for the ME requests of the calling group. When the groups run on threads
+     *  of their own this blocks until every group still integrating has queued its
+     *  requests, then one of them does a single wait() for all of them
+     */
+    void meWait();
+
  protected:
     void solveME(double t, double dt);
 
@@ -75,7 +108,7 @@ std::vector<WeakConnection> me_weakConnections;
      *
      *  @param m Pointer to a fmu_model
      */
-    void allocateMemory(fmu_model &m, const std::vector<FMIClient*> &clients);
+    void allocateMemory(fmu_model &m, fmu_parameters *p);
 
     static void *get_model_parameters(const cgsl_model *m){
         return m->parameters;
@@ -84,9 +117,24 @@ std::vector<WeakConnection> me_weakConnections;
     /** init_fmu_model
      *  Creates the fmu_model and sets the parameters
      *
-     *  @param client A pointer to a fmi client
+     *  @param m The fmu_model
+     *  @param p Parameters of the group, with clients and offsets filled in
+     */
+    void init_fmu_model(fmu_model &m, fmu_parameters *p);
+
+    /** partition
+     *  Splits me_clients into groups that no weak connection goes between.
+     *  FMUs without states join the first group, gsl can't integrate nothing
      */
-    void init_fmu_model(fmu_model &m,  const std::vector<FMIClient*> &clients);
+    std::vector<std::vector<FMIClient*> > partition();
+
+    /** setupJacobian
+     *  Derives the sparsity pattern of the Jacobian from each FMU's
+     *  ModelStructure/Derivatives and the connections between ME FMUs,
+     *  then colours its columns so that fmu_jacobian() needs one RHS
+     *  evaluation per colour instead of one per state
+     */
+    void setupJacobian(fmu_parameters *p);
 
 #define STATIC_GET_CLIENT_OFFSET(name)                                  \
    p->baseMaster->get_storage().get_offset(client->m_id, STORAGE::name)
@@ -110,8 +158,10 @@ std::vector<WeakConnection> me_weakConnections;
      *  from a known safe time.
      *
      *  @param sim The simulation
+     *  @param fetch Whether to get the states from the FMUs first.
+     *         false if they already are in storage
      */
-    void storeStates(cgsl_simulation &sim);
+    void storeStates(cgsl_simulation &sim, bool fetch = true);
 
     /** hasStateEvent:
      ** returns true if at least one simulation has an event
@@ -120,14 +170,6 @@ std::vector<WeakConnection> me_weakConnections;
      */
     bool hasStateEvent(cgsl_simulation &sim);
 
-    /** getSafeTime:
-     *  caluclates a "safe" time, uses the golden ratio to get
-     *  t_crossed and t_safe to converge towards same value
-     *
-     *  @param sim A cgsl simulation
-     */
-    void getGoldenNewTime(cgsl_simulation &sim);
-
     /** step
      *  run cgsl_step_to on all simulations
      *
@@ -135,32 +177,56 @@ std::vector<WeakConnection> me_weakConnections;
      */
     void step(cgsl_simulation &sim);
 
-    /** stepToEvent
-     *  if there is an event, find the event and return
-     *  the time at where the time event occured
+    /** integrateTo
+     *  run cgsl_step_to up to t without looking at event indicators
      *
      *  @param sim The simulation
-     *  @return Returns the time immediatly after the event
+     *  @param t End time
      */
-    void stepToEvent(cgsl_simulation &sim);
+    void integrateTo(cgsl_simulation &sim, double t);
+
+    /** locateEvent
+     *  To be run with the simulation restored to before a step that crossed an event.
+     *  Integrates once to its timeLoop.t_crossed, then finds the first zero crossing of the
+     *  event indicators with the Illinois method, probing them at states taken from a
+     *  cubic Hermite interpolant over the step. Finally integrates once more to just past
+     *  the event. Each probe costs one round trip instead of a re-integration.
+     *
+     *  @param sim The simulation
+     *  @return false if the end of the step does not actually have an event
+     */
+    bool locateEvent(cgsl_simulation &sim);
 
     /** newDiscreteStates
      *  Should be used where a new discrete state ends
      *  and another begins. Resets the loop variables
      *  and store all states of the simulation
      *
-     *  @param t The current time
-     *  @param t_new New next time
+     *  @param sim The simulation
      */
-    void newDiscreteStates();
+    void newDiscreteStates(cgsl_simulation &sim);
 
     void printStates(void);
 
-    void getSafeAndCrossed();
+    void getSafeAndCrossed(cgsl_simulation &sim);
 
     void safeTimeStep(cgsl_simulation &sim);
 
     void getSafeTime(const std::vector<FMIClient*> clients, double t, double &dt);
+
+    /** solveGroup
+     *  The time loop of solveME() for one group
+     *
+     *  @param sim The simulation of the group
+     *  @param t The current time
+     *  @param dt The timestep to be taken
+     */
+    void solveGroup(cgsl_simulation &sim, double t, double dt);
+
+    /** groupDone
+     *  Called by each thread of solveME() when its group has reached t+dt
+     */
+    void groupDone();
 #endif
 };
 }
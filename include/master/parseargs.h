@@ -39,6 +39,21 @@ struct strongconnection {
     std::vector<std::string> vrORname;              // Value reference
 };
 
+//see -Y
+struct mobilitycaching {
+    int period;                     // get new mobilities at least every this many steps
+    double tolerance;               // or when a constraint velocity misses its prediction by more than this, if > 0
+};
+
+//see -K
+struct kinematicsolver {
+    std::string method;             // "direct", "pcg" or "gs"
+    double tolerance;               // relative residual for "pcg" and "gs"
+    int maxIterations;
+    int threads;                    // number of threads to solve islands on, see -j
+    std::map<int, mobilitycaching> mobilityCaching;    // by FMU ID
+};
+
 struct param {
     int valueReference;
     fmi2_base_type_enu_t type;
@@ -107,7 +122,10 @@ void parseArguments( int argc,
                     fmigo_csv_fmu *csv_fmu,
                     int * maxSamples,
                     double * relaxation,
-                    bool *writeSolverFields
+                    bool *writeSolverFields,
+                    kinematicsolver *kinematicSolver,
+                    std::map<int,int> *meIntegrators,
+                    int *meIntegrator
                     );
 }
 
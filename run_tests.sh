@@ -10,6 +10,7 @@ then
   (cd tests/splitting/python && ( python3 truckstring.py --test  || ( echo "failed truckstring test" && exit 1 ) ) )
 fi
 (cd tests/work-reports       && ( ./run_tests.sh  || ( echo "failed tests in work-reports" && exit 1 ) ) )
+(cd tests/umit-fmus/kinematictruck   && ( ./test_clones.sh ||  ( echo "failed kinematictruck clones" && exit 1 ) ) )
 (cd tests/umit-fmus/tests             && ( ./run_tests.sh ||  ( echo "failed umit-fmus tests" && exit 1 ) ) )
 (cd ${BUILD_DIR}                && ( ctest --output-on-failure || ( echo "ctest failed" && exit 1 ) ) )
 (cd tests/umit-fmus/meWrapper         &&( ./test_wrapper.sh ||  ( echo "failed wrapper" && exit 1 ) ) )
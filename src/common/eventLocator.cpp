@@ -0,0 +1,84 @@
+#include "common/eventLocator.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace fmigo;
+
+static bool signChange(const std::vector<double>& a, const std::vector<double>& b) {
+    for (size_t i = 0; i < a.size(); i++) {
+        if (signbit(a[i]) != signbit(b[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EventLocator::start(const evaluator& f, size_t n, double t0, const double *x0) {
+    m_t0 = t0;
+    m_x0.assign(x0, x0 + n);
+    m_f0.resize(n);
+    m_f1.resize(n);
+    m_xm.resize(n);
+    m_fm.resize(n);
+    f(t0, m_x0.data(), m_f0.data(), m_ga);
+}
+
+bool EventLocator::locate(const evaluator& f, double t1, const double *x1, double tol, double& ta, double& tb) {
+    size_t n = m_x0.size();
+    double t0 = m_t0;
+    double h = t1 - t0;
+
+    m_x1.assign(x1, x1 + n);
+    f(t1, m_x1.data(), m_f1.data(), m_gb);
+
+    if (!signChange(m_ga, m_gb)) {
+        return false;
+    }
+
+    //Illinois: regula falsi on the earliest crossing indicator,
+    //halving the retained end's indicators when the same end is kept twice in a row
+    ta = t0;
+    tb = t1;
+    int side = 0;
+    for (int iter = 0; iter < 100 && tb - ta > tol; iter++) {
+        double tm = tb;
+        for (size_t i = 0; i < m_ga.size(); i++) {
+            if (signbit(m_ga[i]) != signbit(m_gb[i])) {
+                tm = std::min(tm, ta - m_ga[i] * (tb - ta) / (m_gb[i] - m_ga[i]));
+            }
+        }
+        if (!(tm > ta && tm < tb)) {
+            tm = 0.5 * (ta + tb);
+        }
+
+        //cubic Hermite interpolant of the states
+        double s = (tm - t0) / h;
+        double h00 = (1 + 2*s) * (1 - s) * (1 - s);
+        double h10 = s * (1 - s) * (1 - s);
+        double h01 = s * s * (3 - 2*s);
+        double h11 = s * s * (s - 1);
+        for (size_t i = 0; i < n; i++) {
+            m_xm[i] = h00 * m_x0[i] + h10 * h * m_f0[i] + h01 * m_x1[i] + h11 * h * m_f1[i];
+        }
+
+        f(tm, m_xm.data(), m_fm.data(), m_gm);
+
+        if (signChange(m_ga, m_gm)) {
+            tb = tm;
+            m_gb.swap(m_gm);
+            if (side < 0) {
+                for (double& g : m_ga) g *= 0.5;
+            }
+            side = -1;
+        } else {
+            ta = tm;
+            m_ga.swap(m_gm);
+            if (side > 0) {
+                for (double& g : m_gb) g *= 0.5;
+            }
+            side = 1;
+        }
+    }
+
+    return true;
+}
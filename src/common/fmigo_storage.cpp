@@ -36,17 +36,14 @@ FmigoStorage::FmigoStorage(const vector<size_t> &number_of_states,const vector<s
 }
 void FmigoStorage::allocate_storage_states(const vector<size_t> &size_vec, enum STORAGE type)
 {
-        size_t total_size = 0;
-        size_t first = 0;
-        get_bounds(type).resize(0);
-        for(auto n: size_vec){
-            total_size += n;
-            get_bounds(type).push_back(Bounds(first, first + n));
-            first += n;
-        }
+        vector<size_t> &offsets = m_offsets[slot(type)];
+        offsets.resize(0);
+        offsets.push_back(0);
+        for(auto n: size_vec)
+            offsets.push_back(offsets.back() + n);
 
         get_current(type).resize(0,0);
-        get_current(type).resize(total_size,0);
+        get_current(type).resize(offsets.back(),0);
 
         get_backup(type) = get_current(type);
     }
@@ -66,16 +63,12 @@ void FmigoStorage::print(enum STORAGE type,char *str)
         Data& current = get_current(type);
         Data& backup = get_backup(type);
         debug("current \n");
-        for(auto x: get_bounds(type)) {
-                for(size_t i = x.first; i != x.second; ++i)
-                    debug("%f ",current.at(i));
-            }
+        for(size_t i = 0; i < current.size(); ++i)
+            debug("%f ",current[i]);
         debug("\n");
         debug("backup \n");
-        for(auto x: get_bounds(type)) {
-                for(size_t i = x.first; i != x.second; ++i)
-                    debug("%f ",backup.at(i));
-            }
+        for(size_t i = 0; i < backup.size(); ++i)
+            debug("%f ",backup[i]);
         debug("\n");
     }
 
@@ -89,11 +82,13 @@ double FmigoStorage::absmin(enum STORAGE type){
     return min;
 }
 double FmigoStorage::absmin(enum STORAGE type,size_t id){
+    const double *data = get_current(type).data();
     size_t o = get_offset(id, type);
-    double min = abs( *(get_current(type).begin() + o));
-    for(size_t i = o + 1; i < get_end(id, type); i++)
-        if(abs(*(get_current(type).begin() + i)) < min)
-            min =abs(*(get_current(type).begin() + i));
+    size_t e = get_end(id, type);
+    double min = abs(data[o]);
+    for(size_t i = o + 1; i < e; i++)
+        if(abs(data[i]) < min)
+            min = abs(data[i]);
     return min;
 }
 
@@ -101,7 +96,7 @@ double FmigoStorage::absmin(enum STORAGE type,size_t id){
  *  returns the number of fmus that have allocated memory
  */
 size_t FmigoStorage::get_size(enum STORAGE type){
-    return get_bounds(type).size();
+    return m_offsets[slot(type)].size() - 1;
 }
 
     /** push_to():
@@ -119,9 +114,8 @@ void FmigoStorage::push_to(size_t client_id, enum STORAGE type, const Data &vec)
             debug("error:FmuData-push_to(): client_id != vector.size!!\n");
             exit(1);
         }
-        copy(vec.begin(),
-             vec.end(),
-             get_current(type).begin() + get_offset(client_id,type));
+        memcpy(get_current(type).data() + get_offset(client_id,type),
+               vec.data(), s * sizeof(double));
     }
 
     /** push_to():
@@ -133,41 +127,64 @@ void FmigoStorage::push_to(size_t client_id, enum STORAGE type, const Data &vec)
      */
 void FmigoStorage::push_to(size_t client_id, enum STORAGE type, double* array)
     {
-        for(size_t i = get_offset(client_id,type); i < get_end(client_id, type); i++)
-            get_current(type).at(i) = *array++;
+        memcpy(get_current(type).data() + get_offset(client_id,type),
+               array, get_size(client_id, type) * sizeof(double));
     }
 
     /** cycle(): maybe reset?
      *  Toggles the working dataset with a backup copy from last call of sync()
-     *  swap only makes shallow copies
+     *  swap only flips the buffer pointers
      */
-#define cycle_storage_cpp(name)\
-    swap(get_current_##name(), get_backup_##name() );
 void FmigoStorage::cycle() {
-    cycle_storage_cpp(states);
-    cycle_storage_cpp(derivatives);
-    cycle_storage_cpp(indicators);
-    cycle_storage_cpp(nominals);
+    for(Storage &s: m_data)
+        swap(s.first, s.second);
 }
 
     /** sync():
      *  Makes a deep copy of the current dataset to a backup dataset
      */
-#define sync_storage_cpp(name)\
-    copy(get_current_##name().begin(), get_current_##name().end(), get_backup_##name().begin() );
 void FmigoStorage::sync(){
-    sync_storage_cpp(states);
-    sync_storage_cpp(derivatives);
-    sync_storage_cpp(indicators);
-    sync_storage_cpp(nominals);
+    for(Storage &s: m_data)
+        memcpy(s.second.data(), s.first.data(), s.first.size() * sizeof(double));
+}
+
+    /** restore():
+     *  Makes a deep copy of the backup dataset to the current dataset
+     */
+void FmigoStorage::restore(){
+    for(Storage &s: m_data)
+        memcpy(s.first.data(), s.second.data(), s.first.size() * sizeof(double));
+}
+
+    /** sync():
+     *  Makes a deep copy of the current dataset of one client to its backup dataset
+     */
+void FmigoStorage::sync(size_t client_id){
+    for(size_t k = 0; k < FMIGO_STORAGE_TYPES; k++){
+        size_t o = m_offsets[k][client_id];
+        size_t n = m_offsets[k][client_id + 1] - o;
+        memcpy(m_data[k].second.data() + o, m_data[k].first.data() + o, n * sizeof(double));
+    }
+}
+
+    /** restore():
+     *  Makes a deep copy of the backup dataset of one client to its current dataset
+     */
+void FmigoStorage::restore(size_t client_id){
+    for(size_t k = 0; k < FMIGO_STORAGE_TYPES; k++){
+        size_t o = m_offsets[k][client_id];
+        size_t n = m_offsets[k][client_id + 1] - o;
+        memcpy(m_data[k].first.data() + o, m_data[k].second.data() + o, n * sizeof(double));
+    }
 }
 
 bool FmigoStorage::past_event(size_t id){
     enum STORAGE type = STORAGE::indicators;
-    size_t index = get_offset(id, type);
-    for(; index < get_end(id, type); index++)
-        if(signbit( *(get_current(type).begin() + index)) !=
-           signbit( *(get_backup(type).begin() + index)))
+    const double *current = get_current(type).data();
+    const double *backup = get_backup(type).data();
+    size_t e = get_end(id, type);
+    for(size_t index = get_offset(id, type); index < e; index++)
+        if(signbit(current[index]) != signbit(backup[index]))
             return true;
     return false;
 }
@@ -273,6 +290,35 @@ void FmigoStorage::test_functions(void)
         test_sync_storage_cpp(indicators);
         test_sync_storage_cpp(nominals);
 
+#define test_restore_storage_cpp(name)\
+        debug("Testing restore() -- "#name"  -  ");\
+        b = testFmigoStorage.get_backup_##name();\
+        testFmigoStorage.push_to(1,STORAGE::name,Data second_vec_storage_cpp ); \
+        testFmigoStorage.restore();\
+        a = testFmigoStorage.get_current_##name();\
+        if(a != b || testFmigoStorage.get_backup_##name() != b){\
+            FMIGO_FAILED_TEST("Faild!\n");\
+        }\
+        else debug("OK!\n");
+
+        test_restore_storage_cpp(states);
+        test_restore_storage_cpp(derivatives);
+        test_restore_storage_cpp(indicators);
+        test_restore_storage_cpp(nominals);
+
+        debug("Testing sync(id) and restore(id)  -  ");
+        a = testFmigoStorage.get_current_states();
+        testFmigoStorage.push_to(0,STORAGE::states,Data {7});
+        testFmigoStorage.push_to(2,STORAGE::states,Data third_vec_storage_cpp );
+        testFmigoStorage.sync(0);
+        testFmigoStorage.restore(2);
+        if(testFmigoStorage.get_backup_states(0,0) != 7 ||
+           testFmigoStorage.get_current_states() != testFmigoStorage.get_backup_states() ||
+           testFmigoStorage.get_current_states(2,0) != a[first_size_storage_cpp + second_size_storage_cpp]){
+            FMIGO_FAILED_TEST("Faild!\n");
+        }
+        else debug("OK!\n");
+
         double x[first_size_storage_cpp] = first_vec_storage_cpp;
         double y[second_size_storage_cpp] = second_vec_storage_cpp;
         double z[third_size_storage_cpp] = third_vec_storage_cpp;
@@ -0,0 +1,73 @@
+#include "common/workerPool.h"
+
+using namespace fmigo;
+
+WorkerPool::WorkerPool() : m_fn(NULL), m_generation(0), m_busy(0), m_quit(false) {
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::start(size_t n) {
+    stop();
+    m_quit = false;
+    for (size_t k = 1; k < n; k++) {
+        m_threads.push_back(std::thread(&WorkerPool::work, this, k, m_generation));
+    }
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& th : m_threads) {
+        th.join();
+    }
+    m_threads.clear();
+}
+
+void WorkerPool::run(const std::function<void(size_t)>& fn) {
+    if (m_threads.empty()) {
+        fn(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn = &fn;
+        m_busy = m_threads.size();
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    fn(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_busy == 0; });
+    m_fn = NULL;
+}
+
+void WorkerPool::work(size_t k, unsigned generation) {
+    for (;;) {
+        const std::function<void(size_t)> *fn;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, generation]{ return m_quit || m_generation != generation; });
+            if (m_quit) {
+                return;
+            }
+            generation = m_generation;
+            fn = m_fn;
+        }
+
+        (*fn)(k);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_busy == 0) {
+            m_done.notify_one();
+        }
+    }
+}
@@ -81,7 +81,7 @@ void Client::clientDataInner(const char* data, size_t size){
     data += 2;
     size -= 2;
 
-    if ((m_master ? m_master->m_pendingRequests : m_pendingRequests) == 0) {
+    if ((m_master ? m_master->m_pendingRequests.load() : m_pendingRequests) == 0) {
         fatal("Got response while m_pendingRequests = 0\n");
     }
     if (m_master) {
@@ -300,6 +300,31 @@ void Client::clientDataInner(const char* data, size_t size){
         debug("< fmi2_import_get_derivatives_res(mid=%d, status=%d)\n", r.status());
         break;
     }
+    case type_fmi2_me_eval_res: {
+        fmi2_me_eval_res r; r.ParseFromArray(data, size);
+        std::vector<double> derivatives(r.derivatives().begin(), r.derivatives().end());
+        on_fmi2_import_get_derivatives_res(derivatives,r.status());
+        if (r.z_size() > 0) {
+            std::vector<double> z(r.z().begin(), r.z().end());
+            on_fmi2_import_get_event_indicators_res(z,r.status());
+        }
+        debug("< fmi2_me_eval_res(status=%d)\n", r.status());
+        break;
+    }
+    case type_fmi2_me_handle_event_res: {
+        fmi2_me_handle_event_res r; r.ParseFromArray(data, size);
+        on_fmi2_import_new_discrete_states_res(r.eventinfo());
+        std::vector<double> x(r.x().begin(), r.x().end());
+        on_fmi2_import_get_continuous_states_res(x,r.status());
+        std::vector<double> nominals(r.nominals().begin(), r.nominals().end());
+        on_fmi2_import_get_nominal_continuous_states_res(nominals,r.status());
+        if (r.z_size() > 0) {
+            std::vector<double> z(r.z().begin(), r.z().end());
+            on_fmi2_import_get_event_indicators_res(z,r.status());
+        }
+        debug("< fmi2_me_handle_event_res(status=%d)\n", r.status());
+        break;
+    }
     case type_fmi2_import_get_nominal_continuous_states_res: {
         debug("This command is NOT TESTED\n");
         fmi2_import_get_nominal_continuous_states_res r; r.ParseFromArray(data, size);
@@ -330,7 +355,32 @@ void Client::clientDataInner(const char* data, size_t size){
     case type_fmi2_import_get_boolean_status_res:           CLIENT_VALUE_CASE(fmi2_import_get_boolean_status); break;
     case type_fmi2_import_get_string_status_res:            CLIENT_VALUE_CASE(fmi2_import_get_string_status); break;
     case type_fmi2_kinematic_res: {
-        last_kinematic.ParseFromArray(data, size);
+#if USE_KINEMATIC_S == 1
+        fmitcp_proto::fmi2_status_t status = (fmitcp_proto::fmi2_status_t)data[0];
+        int nfuture, ndz;
+        memcpy(&nfuture, &data[1], sizeof(int));
+        memcpy(&ndz, &data[1+sizeof(int)], sizeof(int));
+        if (size != 1 + 2*sizeof(int) + (nfuture + ndz)*sizeof(double)) {
+            fatal("fmi2_kinematic_res size mismatch\n");
+        }
+
+        const char *p = &data[1+2*sizeof(int)];
+        last_future_velocities.resize(nfuture);
+        last_dz.resize(ndz);
+        memcpy(last_future_velocities.data(), p, nfuture*sizeof(double));
+        memcpy(last_dz.data(), p + nfuture*sizeof(double), ndz*sizeof(double));
+#else
+        fmi2_kinematic_res r; r.ParseFromArray(data, size);
+        fmitcp_proto::fmi2_status_t status = r.status();
+        last_future_velocities.assign(r.future_velocities().begin(), r.future_velocities().end());
+        last_dz.clear();
+        for (const fmi2_import_get_directional_derivative_res& deriv : r.derivs()) {
+            last_dz.insert(last_dz.end(), deriv.dz().begin(), deriv.dz().end());
+        }
+#endif
+        if (!statusIsOK(status)) {
+            fatal("FMI call fmi2_kinematic_req failed with status=%d\n", status);
+        }
         break;
     }
     case type_get_xml_res: {
@@ -0,0 +1,316 @@
+#include "MEIntegrator.h"
+#include "common/common.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace fmitcp;
+
+#define CHECK(call) if ((status = (call)) != fmi2_status_ok) return status
+
+MEIntegrator::MEIntegrator(fmi2_import_t *FMU, int integrator) : m_reload(false) {
+    m_p.FMU         = FMU;
+    m_p.nx          = fmi2_import_get_number_of_continuous_states(FMU);
+    m_p.ni          = fmi2_import_get_number_of_event_indicators(FMU);
+    m_p.t_ok        = 0;
+    m_p.t_past      = 0;
+    m_p.stateEvent  = false;
+    m_p.ei.resize(m_p.ni);
+    m_p.ei_b.resize(m_p.ni);
+
+    //gsl can't integrate zero variables, so FMUs without continuous states get a dummy one
+    int n = m_p.nx > 0 ? m_p.nx : 1;
+    cgsl_model *model = cgsl_model_default_alloc(n, NULL, &m_p, fmu_function, NULL, NULL, NULL, 0);
+    m_sim = cgsl_init_simulation(model, (enum cgsl_integrator_ids)integrator, 1e-10, 0, 0, 0, NULL);
+
+    m_backup.t = 0;
+    m_backup.h = 0;
+    m_backup.failed_steps = 0;
+    m_backup.x.resize(n);
+    m_backup.dydt.resize(n);
+
+    memset(&m_eventInfo, 0, sizeof(m_eventInfo));
+}
+
+MEIntegrator::~MEIntegrator() {
+    cgsl_free_simulation(m_sim);
+}
+
+static bool pastEvent(const std::vector<fmi2_real_t>& a, const std::vector<fmi2_real_t>& b) {
+    for (size_t i = 0; i < a.size(); i++) {
+        if (signbit(a[i]) != signbit(b[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MEIntegrator::evaluate(fmu_parameters *p, double t, const double x[], double dxdt[]) {
+    fmi2_import_set_time(p->FMU, t);
+    if (p->nx > 0) {
+        fmi2_import_set_continuous_states(p->FMU, x, p->nx);
+        fmi2_import_get_derivatives(p->FMU, dxdt, p->nx);
+    } else {
+        dxdt[0] = 0;
+    }
+
+    if (p->ni > 0) {
+        fmi2_import_get_event_indicators(p->FMU, p->ei.data(), p->ni);
+    }
+}
+
+int MEIntegrator::fmu_function(double t, const double x[], double dxdt[], void *params) {
+    fmu_parameters *p = (fmu_parameters*)params;
+
+    //stepping past an event, no point in evaluating anything until restoreStates()
+    if (p->stateEvent) return GSL_SUCCESS;
+
+    evaluate(p, t, x, dxdt);
+
+    //only look for events past the latest time known to be free of them, see integrateTo()
+    if (p->ni > 0 && t > p->t_ok) {
+        if (pastEvent(p->ei_b, p->ei)) {
+            p->stateEvent = true;
+            p->t_past = t;
+        } else {
+            p->t_ok = t;
+        }
+    }
+
+    return GSL_SUCCESS;
+}
+
+fmi2_status_t MEIntegrator::syncFMU() {
+    fmi2_status_t status;
+    CHECK(fmi2_import_set_time(m_p.FMU, m_sim.t));
+    if (m_p.nx > 0) {
+        CHECK(fmi2_import_set_continuous_states(m_p.FMU, m_sim.model->x, m_p.nx));
+    }
+    if (m_p.ni > 0) {
+        CHECK(fmi2_import_get_event_indicators(m_p.FMU, m_p.ei_b.data(), m_p.ni));
+    }
+    return fmi2_status_ok;
+}
+
+void MEIntegrator::storeStates() {
+    syncFMU();
+
+    size_t n = m_sim.model->n_variables;
+    memcpy(m_backup.x.data(),    m_sim.model->x,              n * sizeof(double));
+    memcpy(m_backup.dydt.data(), m_sim.i.evolution->dydt_out, n * sizeof(double));
+
+    m_backup.failed_steps = m_sim.i.evolution->failed_steps;
+    m_backup.t = m_sim.t;
+    m_backup.h = m_sim.h;
+}
+
+void MEIntegrator::restoreStates() {
+    size_t n = m_sim.model->n_variables;
+    memcpy(m_sim.model->x,              m_backup.x.data(),    n * sizeof(double));
+    memcpy(m_sim.i.evolution->dydt_out, m_backup.dydt.data(), n * sizeof(double));
+
+    m_sim.i.evolution->failed_steps = m_backup.failed_steps;
+    m_sim.t = m_backup.t;
+    m_sim.h = m_backup.h;
+
+    fmi2_import_set_time(m_p.FMU, m_sim.t);
+    if (m_p.nx > 0) {
+        fmi2_import_set_continuous_states(m_p.FMU, m_sim.model->x, m_p.nx);
+    }
+
+    gsl_odeiv2_evolve_reset(m_sim.i.evolution);
+    gsl_odeiv2_step_reset(m_sim.i.step);
+    gsl_odeiv2_driver_reset(m_sim.i.driver);
+}
+
+void MEIntegrator::reload(double t) {
+    m_sim.t = t;
+    if (m_p.nx > 0) {
+        fmi2_import_get_continuous_states(m_p.FMU, m_sim.model->x, m_p.nx);
+    }
+
+    gsl_odeiv2_evolve_reset(m_sim.i.evolution);
+    gsl_odeiv2_step_reset(m_sim.i.step);
+    gsl_odeiv2_driver_reset(m_sim.i.driver);
+
+    m_p.stateEvent = false;
+    storeStates();
+    m_reload = false;
+}
+
+void MEIntegrator::stateRestored(fmi2_FMU_state_t state) {
+    auto it = m_savedEventInfo.find(state);
+    if (it != m_savedEventInfo.end()) {
+        m_eventInfo = it->second;
+    }
+    m_reload = true;
+}
+
+void MEIntegrator::getSafeAndCrossed(timeloop& tl) {
+    tl.t_safe    = m_p.t_ok;
+    tl.t_crossed = m_p.t_past;
+}
+
+void MEIntegrator::step(timeloop& tl) {
+    m_p.stateEvent = false;
+    m_p.t_past = std::max(m_p.t_past, m_sim.t + tl.dt_new);
+    m_p.t_ok = m_sim.t;
+
+    cgsl_step_to(&m_sim, m_sim.t, tl.dt_new);
+}
+
+void MEIntegrator::integrateTo(double t) {
+    m_p.stateEvent = false;
+    m_p.t_ok = t;
+
+    cgsl_step_to(&m_sim, m_sim.t, t - m_sim.t);
+}
+
+//leaves the simulation immediately after the first event in [m_sim.t, tl.t_crossed]
+//returns false if there turned out to be no event at tl.t_crossed
+bool MEIntegrator::locateEvent(timeloop& tl) {
+    double ta, tb;
+    fmu_parameters *p = &m_p;
+    fmigo::EventLocator::evaluator f = [p](double t, const double *x, double *dxdt, std::vector<double>& g) {
+        evaluate(p, t, x, dxdt);
+        g.assign(p->ei.begin(), p->ei.end());
+    };
+
+    //both ends of the step, by integrating across it once
+    m_locator.start(f, m_sim.model->n_variables, m_sim.t, m_sim.model->x);
+    integrateTo(tl.t_crossed);
+
+    if (!m_locator.locate(f, tl.t_crossed, m_sim.model->x, 1e-9, ta, tb)) {
+        //only some stage inside the step saw the event
+        m_p.stateEvent = false;
+        return false;
+    }
+
+    //integrate once more, to just past the event, and leave the FMU there
+    m_fm.resize(m_sim.model->n_variables);
+    restoreStates();
+    integrateTo(tb);
+    evaluate(p, tb, m_sim.model->x, m_fm.data());
+
+    m_p.stateEvent = true;
+    tl.t_safe = ta;
+    tl.t_crossed = tb;
+    return true;
+}
+
+//makes sure we take a small first step when we're at an event
+void MEIntegrator::safeTimeStep(timeloop& tl) {
+    if (m_p.stateEvent) {
+        tl.dt_new = m_sim.h * 0.00001;
+    } else {
+        tl.dt_new = tl.t_end - m_sim.t;
+    }
+}
+
+fmi2_status_t MEIntegrator::newDiscreteStates() {
+    fmi2_status_t status;
+    CHECK(fmi2_import_enter_event_mode(m_p.FMU));
+
+    m_eventInfo.newDiscreteStatesNeeded = true;
+    m_eventInfo.terminateSimulation = false;
+
+    while (m_eventInfo.newDiscreteStatesNeeded) {
+        CHECK(fmi2_import_new_discrete_states(m_p.FMU, &m_eventInfo));
+        if (m_eventInfo.terminateSimulation) {
+            error("MEIntegrator: FMU terminated simulation\n");
+            return fmi2_status_error;
+        }
+    }
+
+    CHECK(fmi2_import_enter_continuous_time_mode(m_p.FMU));
+
+    if (m_eventInfo.valuesOfContinuousStatesChanged && m_p.nx > 0) {
+        CHECK(fmi2_import_get_continuous_states(m_p.FMU, m_sim.model->x, m_p.nx));
+    }
+
+    //the derivatives are likely discontinuous, so don't let the stepper reuse any
+    gsl_odeiv2_evolve_reset(m_sim.i.evolution);
+    gsl_odeiv2_step_reset(m_sim.i.step);
+    return fmi2_status_ok;
+}
+
+fmi2_status_t MEIntegrator::initialize() {
+    fmi2_status_t status;
+
+    //exit_initialization_mode leaves the FMU in event mode
+    m_eventInfo.newDiscreteStatesNeeded = true;
+    m_eventInfo.terminateSimulation = false;
+    while (m_eventInfo.newDiscreteStatesNeeded) {
+        CHECK(fmi2_import_new_discrete_states(m_p.FMU, &m_eventInfo));
+        if (m_eventInfo.terminateSimulation) {
+            error("MEIntegrator: FMU terminated simulation during initialization\n");
+            return fmi2_status_error;
+        }
+    }
+    CHECK(fmi2_import_enter_continuous_time_mode(m_p.FMU));
+
+    m_reload = true;
+    return fmi2_status_ok;
+}
+
+fmi2_status_t MEIntegrator::doStep(double t, double dt) {
+    fmi2_status_t status;
+    timeloop tl;
+
+    if (m_reload) {
+        reload(t);
+    }
+    m_sim.t = t;
+
+    tl.t_safe    = t;
+    tl.t_crossed = t;
+    tl.t_end     = t + dt;
+    tl.dt_new    = dt;
+
+    if (m_eventInfo.nextEventTimeDefined && m_eventInfo.nextEventTime <= t) {
+        CHECK(newDiscreteStates());
+        storeStates();
+    }
+
+    while (tl.t_safe < tl.t_end) {
+        //don't step past time events
+        if (m_eventInfo.nextEventTimeDefined && m_eventInfo.nextEventTime > m_sim.t) {
+            tl.dt_new = std::min(tl.dt_new, m_eventInfo.nextEventTime - m_sim.t);
+        }
+
+        step(tl);
+
+        if (m_p.stateEvent) {
+            getSafeAndCrossed(tl);
+
+            //restore and find the event
+            restoreStates();
+            if (!locateEvent(tl)) {
+                tl.t_safe = m_sim.t;
+                tl.t_crossed = tl.t_end;
+            }
+        } else {
+            tl.t_safe = m_sim.t;
+            tl.t_crossed = tl.t_end;
+        }
+
+        safeTimeStep(tl);
+
+        bool timeEvent = m_eventInfo.nextEventTimeDefined && m_sim.t >= m_eventInfo.nextEventTime;
+        fmi2_boolean_t stepEvent = false, terminate = false;
+        CHECK(syncFMU());
+        CHECK(fmi2_import_completed_integrator_step(m_p.FMU, true, &stepEvent, &terminate));
+        if (terminate) {
+            error("MEIntegrator: FMU terminated simulation\n");
+            return fmi2_status_error;
+        }
+
+        if (m_p.stateEvent || timeEvent || stepEvent) {
+            CHECK(newDiscreteStates());
+        }
+        //this also leaves the FMU at the end of the step, so outputs are up to date
+        storeStates();
+    }
+
+    return fmi2_status_ok;
+}
@@ -11,7 +11,11 @@
 #include <stdint.h>
 #include "master/globals.h"
 #include <set>
+#include <algorithm>
 #include "serialize.h"
+#ifdef USE_GPL
+#include "MEIntegrator.h"
+#endif
 
 using namespace fmitcp;
 
@@ -64,6 +68,9 @@ Server::Server(string fmuPath, int rank_or_port, std::string hdf5Filename) {
   m_fmuPath = fmuPath;
   this->hdf5Filename = hdf5Filename;
   lastStateId = -1;
+  m_baseline.state = NULL;
+  m_meIntegratorId = -1;
+  m_meIntegrator = NULL;
   nextStateId = 0;
   m_sendDummyResponses = false;
   m_freed = false;
@@ -289,33 +296,251 @@ Server::~Server() {
 #endif
 }
 
-fmi2_status_t Server::getDirectionalDerivatives(
-        const fmitcp_proto::fmi2_import_get_directional_derivative_req& r,
-        fmitcp_proto::fmi2_import_get_directional_derivative_res& response) {
-    vector<fmi2_value_reference_t> v_ref(r.v_ref_size());
-    vector<fmi2_value_reference_t> z_ref(r.z_ref_size());
-    vector<fmi2_real_t> dv(r.dv_size()), dz(r.z_ref_size());
+fmi2_status_t Server::getState(fmi2_FMU_state_t *state) {
+    *state = NULL;
+    if (m_freeStates.size() > 0) {
+        *state = m_freeStates.back();
+        m_freeStates.pop_back();
+    }
+    fmi2_status_t status = fmi2_import_get_fmu_state(m_fmi2Instance, state);
+#ifdef USE_GPL
+    if (m_meIntegrator && status == fmi2_status_ok) {
+        m_meIntegrator->stateSaved(*state);
+    }
+#endif
+    return status;
+}
 
-    for (int i = 0 ; i < r.v_ref_size() ; i++) {
-      v_ref[i] = r.v_ref(i);
+void Server::releaseState(fmi2_FMU_state_t *state) {
+    if (*state) {
+        m_freeStates.push_back(*state);
+        *state = NULL;
     }
-    for (int i = 0 ; i < r.z_ref_size() ; i++) {
-      z_ref[i] = r.z_ref(i);
+}
+
+void Server::freeStates() {
+    for (fmi2_FMU_state_t& state : m_freeStates) {
+        fmi2_import_free_fmu_state(m_fmi2Instance, &state);
     }
-    for (int i = 0 ; i < r.dv_size() ; i++) {
-      dv[i] = r.dv(i);
+    m_freeStates.clear();
+
+    for (auto& it : stateMap) {
+        fmi2_import_free_fmu_state(m_fmi2Instance, &it.second);
+    }
+    stateMap.clear();
+}
+
+//integrator is non-NULL for a hosted ModelExchange FMU, see get_xml_req
+static fmi2_status_t doStep(fmi2_import_t *fmu, MEIntegrator *integrator, double t, double dt, bool newStep) {
+#ifdef USE_GPL
+    if (integrator) {
+        return integrator->doStep(t, dt);
+    }
+#endif
+    return fmi2_import_do_step(fmu, t, dt, newStep);
+}
+
+static fmi2_status_t setState(fmi2_import_t *fmu, MEIntegrator *integrator, fmi2_FMU_state_t state) {
+    fmi2_status_t status = fmi2_import_set_fmu_state(fmu, state);
+#ifdef USE_GPL
+    if (integrator) {
+        integrator->stateRestored(state);
+    }
+#endif
+    return status;
+}
+
+//takes one step from state with dv added to the v_ref inputs, reads the z_ref outputs into z1, then restores state
+static fmi2_status_t perturbedStep(fmi2_import_t *fmu, MEIntegrator *integrator, fmi2_FMU_state_t state, double t, double dt,
+        const vector<fmi2_value_reference_t>& z_ref,
+        const vector<fmi2_value_reference_t>& v_ref,
+        const vector<fmi2_real_t>& dv,
+        vector<fmi2_real_t>& z1) {
+    fmi2_status_t status;
+    vector<fmi2_real_t> v(v_ref.size());
+    z1.resize(z_ref.size());
+
+    if ((status = fmi2_import_get_real(fmu, v_ref.data(), v_ref.size(), v.data())) != fmi2_status_ok) return status;
+    for (size_t x = 0; x < v_ref.size(); x++) {
+        v[x] += dv[x];
+    }
+    if ((status = fmi2_import_set_real(fmu, v_ref.data(), v_ref.size(), v.data())) != fmi2_status_ok) return status;
+    if ((status = doStep(fmu, integrator, t, dt, false)) != fmi2_status_ok) return status;
+    if ((status = fmi2_import_get_real(fmu, z_ref.data(), z_ref.size(), z1.data())) != fmi2_status_ok) return status;
+    return setState(fmu, integrator, state);
+}
+
+void Server::instantiateClones(fmi2_type_t simType, fmi2_boolean_t visible) {
+    if (numPerturbationClones <= 0 || simType != fmi2_cosimulation) {
+        return;
     }
-    debug("fmi2_import_get_directional_derivative_req(vref=%s,zref=%s,dv=%s)\n",
-                       arrayToString(v_ref).c_str(), arrayToString(z_ref).c_str(), arrayToString(dv).c_str());
 
+    if (fmi2_import_get_capability(m_fmi2Instance, fmi2_cs_canBeInstantiatedOnlyOncePerProcess) ||
+        !hasCapability(fmi2_cs_canSerializeFMUstate)) {
+        warning("%s: not cloning FMU for parallel directional derivatives, need canBeInstantiatedOnlyOncePerProcess=\"false\" and canSerializeFMUstate=\"true\"\n",
+                m_fmuPath.c_str());
+        return;
+    }
+
+    //each clone gets its own import, so the callbacks can point to it
+    m_clones.resize(numPerturbationClones);
+    for (clone& c : m_clones) {
+        c.state = NULL;
+        c.instance = fmi2_import_parse_xml(m_context, m_workingDir.c_str(), 0);
+        if (!c.instance) {
+            fatal("%s: failed to parse modelDescription.xml for clone\n", m_fmuPath.c_str());
+        }
+
+        c.callbacks = m_fmi2CallbackFunctions;
+        c.callbacks.componentEnvironment = c.instance;
+
+        if (fmi2_import_create_dllfmu(c.instance, fmi2_import_get_fmu_kind(c.instance), &c.callbacks) == jm_status_error ||
+            fmi2_import_instantiate(c.instance, m_instanceName, simType, m_resourcePath.c_str(), visible) == jm_status_error) {
+            fatal("%s: failed to instantiate clone\n", m_fmuPath.c_str());
+        }
+    }
+
+    m_workers.start(m_clones.size() + 1);
+    info("%s: %i clone(s) for parallel directional derivatives\n", m_fmuPath.c_str(), (int)m_clones.size());
+}
+
+void Server::freeClones() {
+    m_workers.stop();
+    for (clone& c : m_clones) {
+        if (c.state) {
+            fmi2_import_free_fmu_state(c.instance, &c.state);
+        }
+        fmi2_import_free_instance(c.instance);
+        fmi2_import_destroy_dllfmu(c.instance);
+        fmi2_import_free(c.instance);
+    }
+    m_clones.clear();
+}
+
+void Server::forEachClone(const char *what, std::function<fmi2_status_t(fmi2_import_t*)> f) {
+    for (clone& c : m_clones) {
+        fmi2_status_t status = f(c.instance);
+        if (status != fmi2_status_ok && status != fmi2_status_warning) {
+            warning("%s: %s failed on a clone (status=%d), computing directional derivatives without clones\n",
+                    m_fmuPath.c_str(), what, status);
+            freeClones();
+            return;
+        }
+    }
+}
+
+fmi2_status_t Server::computeNumericalDirectionalDerivativesParallel(size_t nderivs) {
+    fmi2_status_t status;
+    size_t sz = 0;
+
+    //copy the baseline state into every clone
+    if ((status = fmi2_import_serialized_fmu_state_size(m_fmi2Instance, m_baseline.state, &sz)) != fmi2_status_ok) return status;
+    m_serializedState.resize(sz);
+    if ((status = fmi2_import_serialize_fmu_state(m_fmi2Instance, m_baseline.state, m_serializedState.data(), sz)) != fmi2_status_ok) return status;
+
+    //c.state is kept between requests and overwritten in place, which FMI 2.0 allows like for fmi2GetFMUstate()
+    for (clone& c : m_clones) {
+        if ((status = fmi2_import_de_serialize_fmu_state(c.instance, m_serializedState.data(), sz, &c.state)) != fmi2_status_ok) return status;
+        if ((status = fmi2_import_set_fmu_state(c.instance, c.state)) != fmi2_status_ok) return status;
+    }
+
+    //worker 0 is this instance, the rest are the clones
+    //seeds are dealt out round-robin
+    size_t nworkers = m_clones.size() + 1;
+    vector<fmi2_status_t> statuses(nworkers, fmi2_status_ok);
+
+    auto work = [&](size_t k) {
+        fmi2_import_t *fmu       = k == 0 ? m_fmi2Instance   : m_clones[k-1].instance;
+        MEIntegrator *integrator = k == 0 ? m_meIntegrator   : NULL;
+        fmi2_FMU_state_t state   = k == 0 ? m_baseline.state : m_clones[k-1].state;
+
+        for (size_t x = k; x < nderivs && statuses[k] == fmi2_status_ok; x += nworkers) {
+            const derivseed& seed = m_seeds[x];
+            statuses[k] = perturbedStep(fmu, integrator, state, m_baseline.t, m_baseline.dt, seed.z_ref, seed.v_ref, seed.dv, m_dz[x]);
+        }
+    };
+
+    m_workers.run(work);
+    m_timer.rotate("deriv");
+
+    for (fmi2_status_t s : statuses) {
+        if (s != fmi2_status_ok) {
+            return s;
+        }
+    }
+
+    //dz = z1 - z0, see computeNumericalDirectionalDerivative()
+    for (size_t x = 0; x < nderivs; x++) {
+        const derivseed& seed = m_seeds[x];
+        for (size_t i = 0; i < seed.z_ref.size(); i++) {
+            size_t j = find(m_baseline.vrs.begin(), m_baseline.vrs.end(), seed.z_ref[i]) - m_baseline.vrs.begin();
+            m_dz[x][i] -= m_baseline.values[j];
+        }
+    }
+
+    return fmi2_status_ok;
+}
+
+bool Server::usesNumericalDirectionalDerivatives() const {
+    return (alwaysComputeNumericalDirectionalDerivatives ||
+            !hasCapability(fmi2_cs_providesDirectionalDerivatives)) &&
+           hasCapability(fmi2_cs_canGetAndSetFMUstate);
+}
+
+fmi2_status_t Server::setKinematicInputs(const fmitcp_proto::fmi2_kinematic_req& r) {
+    fmi2_status_t status = fmi2_status_ok;
+
+    if (r.has_reals()) {
+      vector<fmi2_value_reference_t> vr(r.reals().valuereferences_size());
+      vector<fmi2_real_t> value(r.reals().values_size());
+      for (size_t i = 0 ; i < vr.size() ; i++) {
+        vr[i] = r.reals().valuereferences(i);
+        value[i] = r.reals().values(i);
+      }
+      if ((status = fmi2_import_set_real(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) return status;
+    }
+    if (r.has_ints()) {
+      vector<fmi2_value_reference_t> vr(r.ints().valuereferences_size());
+      vector<fmi2_integer_t> value(r.ints().values_size());
+      for (size_t i = 0 ; i < vr.size() ; i++) {
+        vr[i] = r.ints().valuereferences(i);
+        value[i] = r.ints().values(i);
+      }
+      if ((status = fmi2_import_set_integer(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) return status;
+    }
+    if (r.has_bools()) {
+      vector<fmi2_value_reference_t> vr(r.bools().valuereferences_size());
+      vector<fmi2_boolean_t> value(r.bools().values_size());
+      for (size_t i = 0 ; i < vr.size() ; i++) {
+        vr[i] = r.bools().valuereferences(i);
+        value[i] = r.bools().values(i);
+      }
+      if ((status = fmi2_import_set_boolean(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) return status;
+    }
+    if (r.has_strings()) {
+      vector<fmi2_value_reference_t> vr(r.strings().valuereferences_size());
+      vector<fmi2_string_t> value(r.strings().values_size());
+      for (size_t i = 0 ; i < vr.size() ; i++) {
+        vr[i] = r.strings().valuereferences(i);
+        value[i] = r.strings().values(i).c_str();
+      }
+      if ((status = fmi2_import_set_string(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) return status;
+    }
+
+    return status;
+}
+
+fmi2_status_t Server::getDirectionalDerivative(const derivseed& seed, vector<fmi2_real_t>& dz, const baselinestep *baseline) {
     fmi2_status_t status = fmi2_status_ok;
+    dz.resize(seed.z_ref.size());
+
     if (!m_sendDummyResponses) {
      if (!alwaysComputeNumericalDirectionalDerivatives &&
           hasCapability(fmi2_cs_providesDirectionalDerivatives)) {
       // interact with FMU
-      status = fmi2_import_get_directional_derivative(m_fmi2Instance, v_ref.data(), r.v_ref_size(), z_ref.data(), r.z_ref_size(), dv.data(), dz.data());
+      status = fmi2_import_get_directional_derivative(m_fmi2Instance, seed.v_ref.data(), seed.v_ref.size(), seed.z_ref.data(), seed.z_ref.size(), seed.dv.data(), dz.data());
      } else if (hasCapability(fmi2_cs_canGetAndSetFMUstate)) {
-      dz = computeNumericalDirectionalDerivative(z_ref, v_ref, dv);
+      dz = computeNumericalDirectionalDerivative(seed.z_ref, seed.v_ref, seed.dv, baseline);
      } else {
          error("Tried to fmi2_import_get_directional_derivative() on FMU without directional derivatives or ability to save/load FMU state\n");
       status = fmi2_status_error;
@@ -323,9 +548,26 @@ fmi2_status_t Server::getDirectionalDerivatives(
      m_timer.rotate("deriv");
     }
 
+    return status;
+}
+
+fmi2_status_t Server::getDirectionalDerivatives(
+        const fmitcp_proto::fmi2_import_get_directional_derivative_req& r,
+        fmitcp_proto::fmi2_import_get_directional_derivative_res& response) {
+    derivseed seed;
+    vector<fmi2_real_t> dz;
+
+    seed.v_ref.assign(r.v_ref().begin(), r.v_ref().end());
+    seed.z_ref.assign(r.z_ref().begin(), r.z_ref().end());
+    seed.dv.assign(r.dv().begin(), r.dv().end());
+    debug("fmi2_import_get_directional_derivative_req(vref=%s,zref=%s,dv=%s)\n",
+                       arrayToString(seed.v_ref).c_str(), arrayToString(seed.z_ref).c_str(), arrayToString(seed.dv).c_str());
+
+    fmi2_status_t status = getDirectionalDerivative(seed, dz, NULL);
+
     // Create response
     response.set_status(fmi2StatusToProtofmi2Status(status));
-    for (int i = 0 ; i < r.z_ref_size() ; i++) {
+    for (size_t i = 0 ; i < seed.z_ref.size() ; i++) {
       response.add_dz(dz[i]);
     }
 
@@ -506,7 +748,7 @@ string Server::clientDataInner(const char *data, size_t size) {
 
     fmi2_type_t simType;
     simType = fmi2_cosimulation;
-    if (r.has_fmutype() && r.fmutype() == 2)
+    if ((r.has_fmutype() && r.fmutype() == 2) || m_meIntegratorId >= 0)
       simType = fmi2_model_exchange;
     debug("fmi2_import_instantiate_req(visible=%d)\n", visible);
 
@@ -518,6 +760,10 @@ string Server::clientDataInner(const char *data, size_t size) {
       //must be done prior to entering initalization mode, since the master
       //will be sending values before and during initialization mode
       setStartValues();
+
+      if (status != jm_status_error) {
+        instantiateClones(simType, visible);
+      }
     }
     //HACKHACK: count waiting for the master to start toward "instantiate"
     m_timer.dont_rotate = false;
@@ -547,6 +793,12 @@ string Server::clientDataInner(const char *data, size_t size) {
 
     if (!m_sendDummyResponses) {
       // Interact with FMU
+      freeStates();
+      freeClones();
+#ifdef USE_GPL
+      delete m_meIntegrator;
+      m_meIntegrator = NULL;
+#endif
       fmi2_import_free_instance(m_fmi2Instance);
       fmi2_import_destroy_dllfmu(m_fmi2Instance);
       fmi2_import_free(m_fmi2Instance);
@@ -578,6 +830,9 @@ string Server::clientDataInner(const char *data, size_t size) {
     fmi2_status_t status = fmi2_status_ok;
     if (!m_sendDummyResponses) {
       status =  fmi2_import_setup_experiment(m_fmi2Instance, toleranceDefined, tolerance, starttime, stopTimeDefined, stoptime);
+      forEachClone("fmi2SetupExperiment", [&](fmi2_import_t *fmu) {
+        return fmi2_import_setup_experiment(fmu, toleranceDefined, tolerance, starttime, stopTimeDefined, stoptime);
+      });
     }
     m_timer.rotate("initialization");
 
@@ -593,6 +848,7 @@ string Server::clientDataInner(const char *data, size_t size) {
     fmi2_status_t status = fmi2_status_ok;
     if (!m_sendDummyResponses) {
       status = fmi2_import_enter_initialization_mode(m_fmi2Instance);
+      forEachClone("fmi2EnterInitializationMode", fmi2_import_enter_initialization_mode);
     }
     m_timer.rotate("initialization");
 
@@ -608,6 +864,14 @@ string Server::clientDataInner(const char *data, size_t size) {
     fmi2_status_t status = fmi2_status_ok;
     if (!m_sendDummyResponses) {
       status = fmi2_import_exit_initialization_mode(m_fmi2Instance);
+      forEachClone("fmi2ExitInitializationMode", fmi2_import_exit_initialization_mode);
+#ifdef USE_GPL
+      if (m_meIntegratorId >= 0 && status == fmi2_status_ok) {
+        delete m_meIntegrator;
+        m_meIntegrator = new MEIntegrator(m_fmi2Instance, m_meIntegratorId);
+        status = m_meIntegrator->initialize();
+      }
+#endif
     }
     m_timer.rotate("initialization");
 
@@ -949,9 +1213,12 @@ string Server::clientDataInner(const char *data, size_t size) {
     nextStateId = (nextStateId + 1) & 0xFF;
     lastStateId = stateId;
     if(!m_sendDummyResponses){
-        fmi2_FMU_state_t state = NULL;
-        status = fmi2_import_get_fmu_state(m_fmi2Instance, &state);
-        stateMap[stateId] = state;
+        //stateId wraps around, so there may be an old state to reuse
+        auto it = stateMap.find(stateId);
+        if (it != stateMap.end()) {
+            releaseState(&it->second);
+        }
+        status = getState(&stateMap[stateId]);
         m_timer.rotate("get_set_state");
     }
 
@@ -971,7 +1238,7 @@ string Server::clientDataInner(const char *data, size_t size) {
 
     fmi2_status_t status = fmi2_status_ok;
     if(!m_sendDummyResponses){
-        status = fmi2_import_set_fmu_state(m_fmi2Instance, stateMap[r.stateid()]);
+        status = setState(m_fmi2Instance, m_meIntegrator, stateMap[r.stateid()]);
         m_timer.rotate("get_set_state");
     }
 
@@ -986,8 +1253,12 @@ string Server::clientDataInner(const char *data, size_t size) {
     fmi2_status_t status = fmi2_status_ok;
     if(!m_sendDummyResponses){
         auto it = stateMap.find(r.stateid());
-        status = fmi2_import_free_fmu_state(m_fmi2Instance, &it->second);
-        stateMap.erase(it);
+        if (it != stateMap.end()) {
+            releaseState(&it->second);
+            stateMap.erase(it);
+        } else {
+            status = fmi2_status_error;
+        }
         m_timer.rotate("get_set_state");
     }
 
@@ -1004,9 +1275,9 @@ string Server::clientDataInner(const char *data, size_t size) {
     auto it = stateMap.find(lastStateId);
 
     if (lastStateId >= 0 && it != stateMap.end()) {
-        status = fmi2_import_set_fmu_state(m_fmi2Instance, it->second);
+        status = setState(m_fmi2Instance, m_meIntegrator, it->second);
         if (status == fmi2_status_ok) {
-            status = fmi2_import_free_fmu_state(m_fmi2Instance, &it->second);
+            releaseState(&it->second);
             stateMap.erase(it);
         }
     } else {
@@ -1175,6 +1446,89 @@ string Server::clientDataInner(const char *data, size_t size) {
 
     ret.second = response.SerializeAsString();
     log_error_or_debug(status, "fmi2_import_get_derivatives_res()\n");
+  break; } case fmitcp_proto::type_fmi2_me_eval_req: {
+    // Unpack message
+    fmitcp_proto::fmi2_me_eval_req r; r.ParseFromArray(data, size);
+    debug("fmi2_me_eval_req(nx=%d, nderivatives=%d, nz=%d)\n", r.x_size(), r.nderivatives(), r.nz());
+
+    fmi2_status_t status = fmi2_status_ok;
+    std::vector<fmi2_real_t> derivatives(r.nderivatives());
+    std::vector<fmi2_real_t> z(r.nz());
+
+    //stop at the first call that fails
+    if (!m_sendDummyResponses) {
+      if (r.has_time()) {
+        status = fmi2_import_set_time(m_fmi2Instance, r.time());
+      }
+      if (status == fmi2_status_ok && r.x_size() > 0) {
+        status = fmi2_import_set_continuous_states(m_fmi2Instance, r.x().data(), r.x_size());
+      }
+      if (status == fmi2_status_ok && r.nderivatives() > 0) {
+        status = fmi2_import_get_derivatives(m_fmi2Instance, derivatives.data(), r.nderivatives());
+      }
+      if (status == fmi2_status_ok && r.nz() > 0) {
+        status = fmi2_import_get_event_indicators(m_fmi2Instance, z.data(), r.nz());
+      }
+    }
+
+    //Create response
+    fmitcp_proto::fmi2_me_eval_res response;
+    ret.first = fmitcp_proto::type_fmi2_me_eval_res;
+    response.set_status(fmi2StatusToProtofmi2Status(status));
+    for(int i = 0; i< r.nderivatives();i++)
+      response.add_derivatives(derivatives[i]);
+    for(int i = 0; i< r.nz();i++)
+      response.add_z(z[i]);
+
+    ret.second = response.SerializeAsString();
+    log_error_or_debug(status, "fmi2_me_eval_res()\n");
+  break; } case fmitcp_proto::type_fmi2_me_handle_event_req: {
+    // Unpack message
+    fmitcp_proto::fmi2_me_handle_event_req r; r.ParseFromArray(data, size);
+    debug("fmi2_me_handle_event_req(nx=%d, nz=%d)\n", r.nx(), r.nz());
+
+    fmi2_status_t status = fmi2_status_ok;
+    fmi2_event_info_t eventInfo;
+    std::vector<fmi2_real_t> x(r.nx()), nominals(r.nx()), z(r.nz());
+    int iterations = 0;
+    memset(&eventInfo, 0, sizeof(eventInfo));
+
+    //stop at the first call that fails, or when the FMU wants to terminate
+    if (!m_sendDummyResponses) {
+      status = fmi2_import_enter_event_mode(m_fmi2Instance);
+      eventInfo.newDiscreteStatesNeeded = true;
+      while (status == fmi2_status_ok && eventInfo.newDiscreteStatesNeeded && !eventInfo.terminateSimulation) {
+        status = fmi2_import_new_discrete_states(m_fmi2Instance, &eventInfo);
+        iterations++;
+      }
+      if (status == fmi2_status_ok && !eventInfo.terminateSimulation) {
+        status = fmi2_import_enter_continuous_time_mode(m_fmi2Instance);
+      }
+      if (status == fmi2_status_ok && r.nx() > 0) {
+        status = fmi2_import_get_continuous_states(m_fmi2Instance, x.data(), r.nx());
+      }
+      if (status == fmi2_status_ok && r.nx() > 0) {
+        status = fmi2_import_get_nominals_of_continuous_states(m_fmi2Instance, nominals.data(), r.nx());
+      }
+      if (status == fmi2_status_ok && r.nz() > 0) {
+        status = fmi2_import_get_event_indicators(m_fmi2Instance, z.data(), r.nz());
+      }
+    }
+
+    //Create response
+    fmitcp_proto::fmi2_me_handle_event_res response;
+    ret.first = fmitcp_proto::type_fmi2_me_handle_event_res;
+    response.set_status(fmi2StatusToProtofmi2Status(status));
+    response.set_allocated_eventinfo(fmi2EventInfoToProtoEventInfo(eventInfo));
+    for(int i = 0; i < r.nx(); i++)
+      response.add_x(x[i]);
+    for(int i = 0; i < r.nx(); i++)
+      response.add_nominals(nominals[i]);
+    for(int i = 0; i < r.nz(); i++)
+      response.add_z(z[i]);
+
+    ret.second = response.SerializeAsString();
+    log_error_or_debug(status, "fmi2_me_handle_event_res(iterations=%d, terminateSimulation=%d)\n", iterations, eventInfo.terminateSimulation);
   break; } case fmitcp_proto::type_fmi2_import_get_nominal_continuous_states_req: {
     // TODO
     // Unpack message
@@ -1303,9 +1657,9 @@ string Server::clientDataInner(const char *data, size_t size) {
     if (!m_sendDummyResponses) {
       // Step the FMU
 #if USE_DO_STEP_S == 1
-      status = fmi2_import_do_step(m_fmi2Instance, s->currentcommunicationpoint, s->communicationstepsize, newStep);
+      status = doStep(m_fmi2Instance, m_meIntegrator, s->currentcommunicationpoint, s->communicationstepsize, newStep);
 #else
-      status = fmi2_import_do_step(m_fmi2Instance, r.currentcommunicationpoint(), r.communicationstepsize(), newStep);
+      status = doStep(m_fmi2Instance, m_meIntegrator, r.currentcommunicationpoint(), r.communicationstepsize(), newStep);
 #endif
       if (newStep) {
         m_timer.rotate("do_step");
@@ -1437,97 +1791,203 @@ string Server::clientDataInner(const char *data, size_t size) {
 
   break; } case fmitcp_proto::type_fmi2_kinematic_req: {
 
-    fmitcp_proto::fmi2_kinematic_req r; r.ParseFromArray(data, size);
     fmi2_status_t status = fmi2_status_ok;
-    fmitcp_proto::fmi2_kinematic_res response;
-
-    debug("fmi2_kinematic_req: %i %i %i %i %i %i\n",
-        r.has_reals() ? r.reals().values_size() : 0,
-        r.has_ints() ? r.ints().values_size() : 0,
-        r.has_bools() ? r.bools().values_size() : 0,
-        r.has_strings() ? r.strings().values_size() : 0,
-        r.future_velocity_vrs_size(),
-        r.get_derivs_size()
-    );
-
-    //setX
-    if (r.has_reals()) {
-      vector<fmi2_value_reference_t> vr(r.reals().valuereferences_size());
-      vector<fmi2_real_t> value(r.reals().values_size());
-      for (size_t i = 0 ; i < vr.size() ; i++) {
-        vr[i] = r.reals().valuereferences(i);
-        value[i] = r.reals().values(i);
+    double t = currentCommunicationPoint;
+    double dt = communicationStepSize;
+    size_t nderivs = 0;
+
+    //decode into m_futureVelocityVRs and m_seeds, and do setX along the way
+#if USE_KINEMATIC_S == 1
+    if (size < sizeof(kinematic_req_s)) {
+        fatal("fmi2_kinematic_req too small (%zu B)\n", size);
+    }
+    kinematic_req_s s;
+    memcpy(&s, data, sizeof(s));
+    const char *p = data + sizeof(s);
+    const char *end = data + size;
+    t = s.currentcommunicationpoint;
+    dt = s.communicationstepsize;
+
+    debug("fmi2_kinematic_req: %i %i %i %i\n", s.nreals, s.nfuture, s.nderivs, s.nother);
+
+    //true if n items of sz bytes each are left in the request. checked before every block
+    //so that a malformed request is rejected before anything is read past its end or set on the FMU
+    auto fits = [&p, end](int n, size_t sz) {
+      return n >= 0 && (size_t)n <= (size_t)(end - p) / sz;
+    };
+
+    if (!fits(s.nreals, sizeof(fmi2_value_reference_t) + sizeof(fmi2_real_t))) {
+        fatal("fmi2_kinematic_req too small for %i reals\n", s.nreals);
+    }
+    const fmi2_value_reference_t *realVRs = (const fmi2_value_reference_t*)p;
+    const fmi2_real_t *realValues = (const fmi2_real_t*)&realVRs[s.nreals];
+    p = (const char*)&realValues[s.nreals];
+
+    if (!fits(s.nfuture, sizeof(fmi2_value_reference_t))) {
+        fatal("fmi2_kinematic_req too small for %i future velocities\n", s.nfuture);
+    }
+    m_futureVelocityVRs.assign((const fmi2_value_reference_t*)p, (const fmi2_value_reference_t*)p + s.nfuture);
+    p += s.nfuture * sizeof(fmi2_value_reference_t);
+
+    if (s.nderivs < 0) {
+        fatal("fmi2_kinematic_req has nderivs=%i\n", s.nderivs);
+    }
+    nderivs = s.nderivs;
+    m_seeds.resize(nderivs);
+    for (derivseed& seed : m_seeds) {
+      int n;
+      if (!fits(1, sizeof(n))) {
+        fatal("fmi2_kinematic_req too small for directional derivative seeds\n");
       }
-      if ((status = fmi2_import_set_real(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) goto bork;
-    }
-    if (r.has_ints()) {
-      vector<fmi2_value_reference_t> vr(r.ints().valuereferences_size());
-      vector<fmi2_integer_t> value(r.ints().values_size());
-      for (size_t i = 0 ; i < vr.size() ; i++) {
-        vr[i] = r.ints().valuereferences(i);
-        value[i] = r.ints().values(i);
+      memcpy(&n, p, sizeof(n));
+      p += sizeof(n);
+      if (!fits(n, 2*sizeof(fmi2_value_reference_t) + sizeof(fmi2_real_t))) {
+        fatal("fmi2_kinematic_req too small for a directional derivative seed of size %i\n", n);
       }
-      if ((status = fmi2_import_set_integer(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) goto bork;
+      const fmi2_value_reference_t *z_ref = (const fmi2_value_reference_t*)p;
+      const fmi2_value_reference_t *v_ref = &z_ref[n];
+      const fmi2_real_t *dv = (const fmi2_real_t*)&v_ref[n];
+      seed.z_ref.assign(z_ref, z_ref + n);
+      seed.v_ref.assign(v_ref, v_ref + n);
+      seed.dv.assign(dv, dv + n);
+      p = (const char*)&dv[n];
     }
-    if (r.has_bools()) {
-      vector<fmi2_value_reference_t> vr(r.bools().valuereferences_size());
-      vector<fmi2_boolean_t> value(r.bools().values_size());
-      for (size_t i = 0 ; i < vr.size() ; i++) {
-        vr[i] = r.bools().valuereferences(i);
-        value[i] = r.bools().values(i);
-      }
-      if ((status = fmi2_import_set_boolean(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) goto bork;
+
+    if (!fits(s.nother, 1) || p + s.nother != end) {
+        fatal("fmi2_kinematic_req size mismatch\n");
     }
-    if (r.has_strings()) {
-      vector<fmi2_value_reference_t> vr(r.strings().valuereferences_size());
-      vector<fmi2_string_t> value(r.strings().values_size());
-      for (size_t i = 0 ; i < vr.size() ; i++) {
-        vr[i] = r.strings().valuereferences(i);
-        value[i] = r.strings().values(i).c_str();
-      }
-      if ((status = fmi2_import_set_string(m_fmi2Instance, vr.data(), vr.size(), value.data())) != fmi2_status_ok) goto bork;
+
+    if (s.nreals) {
+      if ((status = fmi2_import_set_real(m_fmi2Instance, realVRs, s.nreals, realValues)) != fmi2_status_ok) goto bork;
+    }
+
+    //ints, bools and strings
+    if (s.nother) {
+      fmitcp_proto::fmi2_kinematic_req r; r.ParseFromArray(p, s.nother);
+      if ((status = setKinematicInputs(r)) != fmi2_status_ok) goto bork;
     }
+#else
+    {
+      fmitcp_proto::fmi2_kinematic_req r; r.ParseFromArray(data, size);
 
-    if (r.future_velocity_vrs_size()) {
-      //get state, step, get reals, set state, free state
-      fmi2_FMU_state_t state = NULL;
-      vector<fmi2_value_reference_t> vr(r.future_velocity_vrs_size());
-      vector<fmi2_real_t> vel(r.future_velocity_vrs_size());
+      debug("fmi2_kinematic_req: %i %i %i %i %i %i\n",
+          r.has_reals() ? r.reals().values_size() : 0,
+          r.has_ints() ? r.ints().values_size() : 0,
+          r.has_bools() ? r.bools().values_size() : 0,
+          r.has_strings() ? r.strings().values_size() : 0,
+          r.future_velocity_vrs_size(),
+          r.get_derivs_size()
+      );
 
-      for (size_t i = 0 ; i < vr.size() ; i++) {
-        vr[i] = r.future_velocity_vrs(i);
+      if ((status = setKinematicInputs(r)) != fmi2_status_ok) goto bork;
+
+      if (r.has_currentcommunicationpoint()) {
+        t = r.currentcommunicationpoint();
+      }
+      if (r.has_communicationstepsize()) {
+        dt = r.communicationstepsize();
       }
 
-      if ((status = fmi2_import_get_fmu_state(m_fmi2Instance, &state)) != fmi2_status_ok) goto bork;
-      if ((status = fmi2_import_do_step(m_fmi2Instance, r.currentcommunicationpoint(), r.communicationstepsize(), false)) != fmi2_status_ok) goto bork;
-      if ((status = fmi2_import_get_real(m_fmi2Instance, vr.data(), vr.size(), vel.data())) != fmi2_status_ok) goto bork;
-      if ((status = fmi2_import_set_fmu_state(m_fmi2Instance, state)) != fmi2_status_ok) goto bork;
-      if ((status = fmi2_import_free_fmu_state(m_fmi2Instance, &state)) != fmi2_status_ok) goto bork;
+      m_futureVelocityVRs.assign(r.future_velocity_vrs().begin(), r.future_velocity_vrs().end());
 
-      for (fmi2_real_t v : vel) {
-        response.add_future_velocities(v);
+      nderivs = r.get_derivs_size();
+      m_seeds.resize(nderivs);
+      for (size_t x = 0; x < nderivs; x++) {
+        const fmitcp_proto::fmi2_import_get_directional_derivative_req &get = r.get_derivs(x);
+        m_seeds[x].z_ref.assign(get.z_ref().begin(), get.z_ref().end());
+        m_seeds[x].v_ref.assign(get.v_ref().begin(), get.v_ref().end());
+        m_seeds[x].dv.assign(get.dv().begin(), get.dv().end());
       }
     }
+#endif
 
-    if (status == fmi2_status_ok) {
-      for (int x = 0; x < r.get_derivs_size(); x++) {
-        const fmitcp_proto::fmi2_import_get_directional_derivative_req &get = r.get_derivs(x);
-        fmitcp_proto::fmi2_import_get_directional_derivative_res *deriv = response.add_derivs();
+    {
+      //one unperturbed step serves both the future velocities and every numerical directional derivative
+      bool numerical = !m_sendDummyResponses && nderivs && usesNumericalDirectionalDerivatives();
+
+      if (m_futureVelocityVRs.size() || numerical) {
+        //get state, step, get reals, set state
+        m_baseline.t  = t;
+        m_baseline.dt = dt;
+        m_baseline.vrs = m_futureVelocityVRs;
+
+        if (numerical) {
+          for (const derivseed& seed : m_seeds) {
+            m_baseline.vrs.insert(m_baseline.vrs.end(), seed.z_ref.begin(), seed.z_ref.end());
+          }
+        }
+        m_baseline.values.resize(m_baseline.vrs.size());
+
+        if ((status = getState(&m_baseline.state)) != fmi2_status_ok) goto bork;
+        if ((status = doStep(m_fmi2Instance, m_meIntegrator, m_baseline.t, m_baseline.dt, false)) != fmi2_status_ok) goto bork;
+        if ((status = fmi2_import_get_real(m_fmi2Instance, m_baseline.vrs.data(), m_baseline.vrs.size(), m_baseline.values.data())) != fmi2_status_ok) goto bork;
+        if ((status = setState(m_fmi2Instance, m_meIntegrator, m_baseline.state)) != fmi2_status_ok) goto bork;
+      }
 
-        if ((status = getDirectionalDerivatives(get, *deriv)) != fmi2_status_ok) goto bork;
+      m_dz.resize(nderivs);
+      if (numerical && m_clones.size() > 0) {
+        if ((status = computeNumericalDirectionalDerivativesParallel(nderivs)) != fmi2_status_ok) goto bork;
+      } else {
+        for (size_t x = 0; x < nderivs; x++) {
+          if ((status = getDirectionalDerivative(m_seeds[x], m_dz[x], numerical ? &m_baseline : NULL)) != fmi2_status_ok) goto bork;
+        }
       }
     }
 
 bork:
-    response.set_status(fmi2StatusToProtofmi2Status(status));
-    ret.first = fmitcp_proto::type_fmi2_kinematic_res;
-    ret.second = response.SerializeAsString();
+    releaseState(&m_baseline.state);
+
+    //future velocities are the first values of the baseline step
+#if USE_KINEMATIC_S == 1
+    {
+      //status byte, int nfuture, int ndz, double future_velocities[nfuture], double dz[ndz]
+      int nfuture = status == fmi2_status_ok ? (int)m_futureVelocityVRs.size() : 0;
+      int ndz = 0;
+      for (size_t x = 0; status == fmi2_status_ok && x < nderivs; x++) {
+        ndz += m_dz[x].size();
+      }
+
+      ret.second.resize(1 + 2*sizeof(int) + (nfuture + ndz)*sizeof(double));
+      char *q = &ret.second[0];
+      *q++ = fmi2StatusToProtofmi2Status(status);
+      memcpy(q, &nfuture, sizeof(int));     q += sizeof(int);
+      memcpy(q, &ndz, sizeof(int));         q += sizeof(int);
+      memcpy(q, m_baseline.values.data(), nfuture*sizeof(double));
+      q += nfuture*sizeof(double);
+      for (size_t x = 0; ndz && x < nderivs; x++) {
+        memcpy(q, m_dz[x].data(), m_dz[x].size()*sizeof(double));
+        q += m_dz[x].size()*sizeof(double);
+      }
+      ret.first = fmitcp_proto::type_fmi2_kinematic_res;
+    }
+#else
+    {
+      fmitcp_proto::fmi2_kinematic_res response;
+      response.set_status(fmi2StatusToProtofmi2Status(status));
+
+      if (status == fmi2_status_ok) {
+        for (size_t i = 0; i < m_futureVelocityVRs.size(); i++) {
+          response.add_future_velocities(m_baseline.values[i]);
+        }
+        for (size_t x = 0; x < nderivs; x++) {
+          fmitcp_proto::fmi2_import_get_directional_derivative_res *deriv = response.add_derivs();
+          deriv->set_status(fmi2StatusToProtofmi2Status(status));
+          for (fmi2_real_t dz : m_dz[x]) {
+            deriv->add_dz(dz);
+          }
+        }
+      }
+
+      ret.first = fmitcp_proto::type_fmi2_kinematic_res;
+      ret.second = response.SerializeAsString();
+    }
+#endif
 
   break; } case fmitcp_proto::type_get_xml_req: {
 
     // Unpack message
     fmitcp_proto::get_xml_req r; r.ParseFromArray(data, size);
-    debug("get_xml_req()\n");
+    debug("get_xml_req(meIntegrator=%d)\n", r.has_meintegrator() ? r.meintegrator() : -1);
 
     string xml = "";
     if (!m_sendDummyResponses) {
@@ -1545,6 +2005,20 @@ bork:
           error("Error opening the %s file.\n", xmlFilePath);
       }
       free(xmlFilePath);
+
+      if (r.has_meintegrator()) {
+#ifdef USE_GPL
+        if (fmi2_import_get_fmu_kind(m_fmi2Instance) == fmi2_fmu_kind_me) {
+          info("Integrating ModelExchange FMU with cgsl integrator %d\n", r.meintegrator());
+          m_meIntegratorId = r.meintegrator();
+          xml = meToCsXml(xml);
+        } else {
+          info("FMU already supports Co-Simulation, not integrating it on the server\n");
+        }
+#else
+        error("Can't integrate ModelExchange FMUs without USE_GPL\n");
+#endif
+      }
     }
 
     // Create response
@@ -1670,42 +2144,98 @@ void Server::fillHDF5Row(char *dest, double t) {
 }
 
 bool Server::hasCapability(fmi2_capabilities_enu_t cap) const {
+    if (m_meIntegratorId >= 0) {
+        //hosted ModelExchange FMU, see get_xml_req
+        switch (cap) {
+        case fmi2_cs_canGetAndSetFMUstate:              cap = fmi2_me_canGetAndSetFMUstate; break;
+        case fmi2_cs_canSerializeFMUstate:              cap = fmi2_me_canSerializeFMUstate; break;
+        case fmi2_cs_canBeInstantiatedOnlyOncePerProcess: cap = fmi2_me_canBeInstantiatedOnlyOncePerProcess; break;
+        case fmi2_cs_providesDirectionalDerivatives:    return false;
+        default: break;
+        }
+    }
     return fmi2_import_get_capability(m_fmi2Instance, cap) != 0;
 }
 
+//removes attr="..." from the tag between begin and end, returns the number of characters removed
+static size_t removeAttribute(string& xml, size_t begin, size_t end, const string& attr) {
+    size_t pos = begin;
+    while ((pos = xml.find(attr + "=", pos + 1)) < end && !isspace(xml[pos-1])) {
+    }
+    if (pos >= end) {
+        return 0;
+    }
+    size_t q = pos + attr.length() + 1;
+    size_t close = xml.find(xml[q], q + 1);
+    if (close >= end) {
+        return 0;
+    }
+    //also remove the whitespace before the attribute
+    pos--;
+    xml.erase(pos, close + 1 - pos);
+    return close + 1 - pos;
+}
+
+string Server::meToCsXml(const string& xml_in) {
+    string xml = xml_in;
+    size_t begin = xml.find("<ModelExchange");
+    if (begin == string::npos) {
+        fatal("No <ModelExchange> element in modelDescription.xml\n");
+    }
+    size_t end = xml.find('>', begin);
+
+    //the integrator doesn't call fmi2DoStep(), so the FMU's completedIntegratorStepNotNeeded is meaningless
+    //and directional derivatives come from perturbing steps instead
+    end -= removeAttribute(xml, begin, end, "completedIntegratorStepNotNeeded");
+    end -= removeAttribute(xml, begin, end, "providesDirectionalDerivative");
+    end -= removeAttribute(xml, begin, end, "canHandleVariableCommunicationStepSize");
+
+    string cs = "<CoSimulation canHandleVariableCommunicationStepSize=\"true\"";
+    xml.replace(begin, strlen("<ModelExchange"), cs);
+
+    size_t close = xml.find("</ModelExchange>", begin);
+    if (close != string::npos) {
+        xml.replace(close, strlen("</ModelExchange>"), "</CoSimulation>");
+    }
+    return xml;
+}
+
 vector<fmi2_real_t> Server::computeNumericalDirectionalDerivative(
         const vector<fmi2_value_reference_t>& z_ref,
         const vector<fmi2_value_reference_t>& v_ref,
-        const vector<fmi2_real_t>& dv) {
+        const vector<fmi2_real_t>& dv,
+        const baselinestep *baseline) {
     vector<fmi2_real_t> dz;
     fmi2_FMU_state_t state = NULL;
     double t = currentCommunicationPoint;
     double dt = communicationStepSize;
 
-    fmi2_import_get_fmu_state(m_fmi2Instance, &state);
-
     //this assumes the system is linear
-    //conveniently this allows us to simplify things to just two do_step() calls
-    vector<fmi2_real_t> v0(v_ref.size()), v1;
+    //conveniently this allows us to simplify things to just two do_step() calls,
+    //or just one if the unperturbed step has already been taken
     vector<fmi2_real_t> z0(z_ref.size());
     vector<fmi2_real_t> z1(z_ref.size());
 
-    fmi2_import_get_real(m_fmi2Instance, v_ref.data(), v_ref.size(), v0.data());
-    fmi2_import_do_step(m_fmi2Instance, t, dt, false);
-    fmi2_import_get_real(m_fmi2Instance, z_ref.data(), z_ref.size(), z0.data());
-    fmi2_import_set_fmu_state(m_fmi2Instance, state);
-
-    debug("dv = ");
-    for (size_t x = 0; x < v_ref.size(); x++) {
-        debug("%f ", dv[x]);
-        v1.push_back(v0[x] + dv[x]);
+    if (baseline) {
+        state = baseline->state;
+        t = baseline->t;
+        dt = baseline->dt;
+        for (size_t x = 0; x < z_ref.size(); x++) {
+            size_t i = find(baseline->vrs.begin(), baseline->vrs.end(), z_ref[x]) - baseline->vrs.begin();
+            z0[x] = baseline->values[i];
+        }
+    } else {
+        getState(&state);
+        doStep(m_fmi2Instance, m_meIntegrator, t, dt, false);
+        fmi2_import_get_real(m_fmi2Instance, z_ref.data(), z_ref.size(), z0.data());
+        setState(m_fmi2Instance, m_meIntegrator, state);
     }
 
-    fmi2_import_set_real(m_fmi2Instance, v_ref.data(), v_ref.size(), v1.data());
-    fmi2_import_do_step(m_fmi2Instance, t, dt, false);
-    fmi2_import_get_real(m_fmi2Instance, z_ref.data(), z_ref.size(), z1.data());
-    fmi2_import_set_fmu_state(m_fmi2Instance, state);
-    fmi2_import_free_fmu_state(m_fmi2Instance, &state);
+    debug("dv = %s\n", arrayToString(dv).c_str());
+    perturbedStep(m_fmi2Instance, m_meIntegrator, state, t, dt, z_ref, v_ref, dv, z1);
+    if (!baseline) {
+        releaseState(&state);
+    }
 
     debug("-> dz = ");
     for (size_t x = 0; x < z_ref.size(); x++) {
@@ -170,6 +170,32 @@ std::string fmitcp::serialize::fmi2_import_get_derivatives(int nderivatives){
     SERIALIZE_NORMAL_MESSAGE_(fmi2_import_get_derivatives,nderivatives);
 }
 
+std::string fmitcp::serialize::fmi2_me_eval(int nDerivatives, int nz){
+    fmi2_me_eval_req req;
+    req.set_nderivatives(nDerivatives);
+    req.set_nz(nz);
+    return pack(type_fmi2_me_eval_req, req);
+}
+
+std::string fmitcp::serialize::fmi2_me_eval(double time, const double* x, int nx, int nDerivatives, int nz){
+    fmi2_me_eval_req req;
+    req.set_time(time);
+    req.set_nderivatives(nDerivatives);
+    req.set_nz(nz);
+
+    for(int i = 0; i < nx; i++)
+        req.add_x(x[i]);
+
+    return pack(type_fmi2_me_eval_req, req);
+}
+
+std::string fmitcp::serialize::fmi2_me_handle_event(int nx, int nz){
+    fmi2_me_handle_event_req req;
+    req.set_nx(nx);
+    req.set_nz(nz);
+    return pack(type_fmi2_me_handle_event_req, req);
+}
+
 std::string fmitcp::serialize::fmi2_import_get_nominal_continuous_states(int nx){
     SERIALIZE_NORMAL_MESSAGE_(fmi2_import_get_nominal_continuous_states,nx);
 }
@@ -284,4 +310,125 @@ std::string fmitcp::serialize::fmi2_import_get_directional_derivative(
     return pack(type_fmi2_import_get_directional_derivative_req, req);
 }
 
-FMU_VOID_REQ_IMPL(get_xml)
+std::string fmitcp::serialize::get_xml(int meIntegrator) {
+    get_xml_req req;
+    if (meIntegrator >= 0) {
+        req.set_meintegrator(meIntegrator);
+    }
+    return pack(type_get_xml_req, req);
+}
+
+fmitcp::serialize::kinematic_req::kinematic_req() {
+    currentCommunicationPoint = 0;
+    communicationStepSize = 0;
+}
+
+void fmitcp::serialize::kinematic_req::clear() {
+    realVRs.clear();
+    reals.clear();
+    futureVelocityVRs.clear();
+    derivSizes.clear();
+    zRefs.clear();
+    vRefs.clear();
+    dvs.clear();
+    other.Clear();
+}
+
+bool fmitcp::serialize::kinematic_req::empty() const {
+    return realVRs.size() == 0 &&
+           futureVelocityVRs.size() == 0 &&
+           derivSizes.size() == 0 &&
+           !other.has_ints() &&
+           !other.has_bools() &&
+           !other.has_strings();
+}
+
+void fmitcp::serialize::kinematic_req::addDirectionalDerivative(const vector<int>& z_ref, const vector<int>& v_ref, const double *dv) {
+    if (z_ref.size() != v_ref.size()) {
+        fatal("z_ref.size() != v_ref.size()\n");
+    }
+    derivSizes.push_back(z_ref.size());
+    zRefs.insert(zRefs.end(), z_ref.begin(), z_ref.end());
+    vRefs.insert(vRefs.end(), v_ref.begin(), v_ref.end());
+    dvs.insert(dvs.end(), dv, dv + v_ref.size());
+}
+
+std::string fmitcp::serialize::kinematic_req::pack() const {
+#if USE_KINEMATIC_S == 1
+    kinematic_req_s s;
+    s.currentcommunicationpoint = currentCommunicationPoint;
+    s.communicationstepsize = communicationStepSize;
+    s.nreals = realVRs.size();
+    s.nfuture = futureVelocityVRs.size();
+    s.nderivs = derivSizes.size();
+    s.nother = 0;
+    if (other.has_ints() || other.has_bools() || other.has_strings()) {
+#if GOOGLE_PROTOBUF_VERSION >= 3021000
+        s.nother = other.ByteSizeLong();
+#else
+        s.nother = other.ByteSize();
+#endif
+    }
+
+    size_t sz = 2 + sizeof(s) +
+                s.nreals * (sizeof(int) + sizeof(double)) +
+                s.nfuture * sizeof(int) +
+                s.nderivs * sizeof(int) +
+                zRefs.size() * (2*sizeof(int) + sizeof(double)) +
+                s.nother;
+    std::string str(sz, 0);
+    char *p = &str[2];
+
+    str[0] = type_fmi2_kinematic_req & 0xFF;
+    str[1] = type_fmi2_kinematic_req >> 8;
+
+    memcpy(p, &s, sizeof(s));                                   p += sizeof(s);
+    memcpy(p, realVRs.data(), s.nreals*sizeof(int));            p += s.nreals*sizeof(int);
+    memcpy(p, reals.data(), s.nreals*sizeof(double));           p += s.nreals*sizeof(double);
+    memcpy(p, futureVelocityVRs.data(), s.nfuture*sizeof(int)); p += s.nfuture*sizeof(int);
+
+    size_t ofs = 0;
+    for (int n : derivSizes) {
+        memcpy(p, &n, sizeof(int));                 p += sizeof(int);
+        memcpy(p, &zRefs[ofs], n*sizeof(int));      p += n*sizeof(int);
+        memcpy(p, &vRefs[ofs], n*sizeof(int));      p += n*sizeof(int);
+        memcpy(p, &dvs[ofs], n*sizeof(double));     p += n*sizeof(double);
+        ofs += n;
+    }
+
+    if (s.nother) {
+        other.SerializeWithCachedSizesToArray((uint8_t*)p);
+    }
+
+    return str;
+#else
+    fmi2_kinematic_req req(other);
+
+    if (realVRs.size()) {
+        fmi2_import_set_real_req *r = req.mutable_reals();
+        for (size_t i = 0; i < realVRs.size(); i++) {
+            r->add_valuereferences(realVRs[i]);
+            r->add_values(reals[i]);
+        }
+    }
+
+    for (int vr : futureVelocityVRs) {
+        req.add_future_velocity_vrs(vr);
+    }
+    req.set_currentcommunicationpoint(currentCommunicationPoint);
+    req.set_communicationstepsize(communicationStepSize);
+
+    size_t ofs = 0;
+    for (int n : derivSizes) {
+        fmi2_import_get_directional_derivative_req *get = req.add_get_derivs();
+        for (int i = 0; i < n; i++) {
+            get->add_z_ref(zRefs[ofs+i]);
+            get->add_v_ref(vRefs[ofs+i]);
+            get->add_dv(dvs[ofs+i]);
+        }
+        ofs += n;
+    }
+
+    return fmitcp::serialize::pack(type_fmi2_kinematic_req, req);
+#endif
+}
@@ -172,6 +172,54 @@ size_t FMIClient::getNumContinuousStates(void){
     return fmi2_import_get_number_of_continuous_states(m_fmi2Instance);
 }
 
+void FMIClient::getDerivativeDependencies(std::vector<std::vector<size_t> >& states, std::vector<bool>& dependsOnInputs){
+    size_t ns = getNumContinuousStates();
+    states.assign(ns, std::vector<size_t>());
+    dependsOnInputs.assign(ns, true);
+
+    //the states are ordered like ModelStructure/Derivatives
+    //map the 1-based ModelVariables index of each state to its position
+    map<size_t, size_t> stateIndex;
+    fmi2_import_variable_list_t *ders = fmi2_import_get_derivatives_list(m_fmi2Instance);
+    for (size_t j = 0; j < ns && j < fmi2_import_get_variable_list_size(ders); j++) {
+        fmi2_import_real_variable_t *der = fmi2_import_get_variable_as_real(fmi2_import_get_variable(ders, j));
+        fmi2_import_real_variable_t *state = der ? fmi2_import_get_real_variable_derivative_of(der) : NULL;
+        if (state) {
+            stateIndex[fmi2_import_get_variable_original_order((fmi2_import_variable_t*)state) + 1] = j;
+        }
+    }
+    fmi2_import_free_variable_list(ders);
+
+    size_t *startIndex = NULL, *dependency = NULL;
+    char *factorKind = NULL;
+    fmi2_import_get_derivatives_dependencies(m_fmi2Instance, &startIndex, &dependency, &factorKind);
+
+    for (size_t i = 0; i < ns; i++) {
+        bool all = !startIndex;
+        if (startIndex) {
+            dependsOnInputs[i] = false;
+            for (size_t k = startIndex[i]; k < startIndex[i+1]; k++) {
+                auto it = stateIndex.find(dependency[k]);
+                if (dependency[k] == 0) {
+                    //FMIL's way of saying "depends on everything"
+                    all = true;
+                } else if (it != stateIndex.end()) {
+                    states[i].push_back(it->second);
+                } else {
+                    dependsOnInputs[i] = true;
+                }
+            }
+        }
+        if (all) {
+            states[i].clear();
+            for (size_t j = 0; j < ns; j++) {
+                states[i].push_back(j);
+            }
+            dependsOnInputs[i] = true;
+        }
+    }
+}
+
 void FMIClient::on_fmi2_import_instantiate_res(fmitcp_proto::jm_status_enu_t status){
     m_fmuState = control_proto::fmu_state_State_instantiated;
     m_master->onSlaveInstantiated(this);
@@ -13,6 +13,7 @@
 #include "master/globals.h"
 #include "fmitcp.pb.h"
 #include <algorithm>
+#include <cmath>
 
 using namespace fmitcp_master;
 using namespace fmitcp;
@@ -31,6 +32,12 @@ StrongMaster::StrongMaster(zmq::context_t &context, vector<FMIClient*> clients,
 
     counters.resize(rends.size());
 
+    //by default every FMU gets new mobilities every step
+    mobilitycache mc = {1, 0, 0, true};
+    m_mobilityCache.resize(m_clients.size(), mc);
+    m_derivsRequested = 0;
+    m_derivsSaved = 0;
+
     //populate clientrend
     //sanity check rends while we're at it - it should contain all client IDs in children and parents
     fmitcp::int_set children, parents;
@@ -85,11 +92,50 @@ StrongMaster::StrongMaster(zmq::context_t &context, vector<FMIClient*> clients,
 }
 
 StrongMaster::~StrongMaster() {
+    if (m_derivsSaved > 0) {
+        info("Mobility caching saved %li of %li directional derivative evaluations\n",
+            m_derivsSaved, m_derivsSaved + m_derivsRequested);
+    }
     if (m_strongCouplingSolver) {
         delete m_strongCouplingSolver;
     }
 }
 
+void StrongMaster::setMobilityCaching(int id, int period, double tolerance) {
+    if (id < 0 || (size_t)id >= m_clients.size()) {
+        fatal("Mobility caching: FMU id=%i is outside the valid range\n", id);
+    }
+    if (period < 1) {
+        fatal("Mobility caching: period must be at least 1 (got %i)\n", period);
+    }
+    m_mobilityCache[id].period = period;
+    m_mobilityCache[id].tolerance = tolerance;
+}
+
+void StrongMaster::updateMobilityCache() {
+    const vector<sc::Equation*>& eqs = m_strongCouplingSolver->getEquations();
+
+    //did the last step go as the solver predicted?
+    if (m_predictedVelocities.size() == eqs.size()) {
+        for (sc::Equation *eq : eqs) {
+            m_predictionErrors[eq->m_index] = fabs(eq->getVelocity() - m_predictedVelocities[eq->m_index]);
+        }
+        for (const mobilityplanentry& mp : m_mobilityPlan) {
+            mobilitycache& mc = m_mobilityCache[mp.clientId];
+            if (mc.tolerance > 0 && m_predictionErrors[mp.eq->m_index] > mc.tolerance) {
+                mc.refresh = true;
+            }
+        }
+    }
+
+    for (int id : kins) {
+        mobilitycache& mc = m_mobilityCache[id];
+        if (mc.age >= mc.period) {
+            mc.refresh = true;
+        }
+    }
+}
+
 void StrongMaster::prepare() {
     JacobiMaster::prepare();
 
@@ -109,9 +155,90 @@ void StrongMaster::prepare() {
                 }
             }
         }
+
+        //compile the directional derivative requests, and figure out where each one goes in the solver's mobility storage
+        m_mobilityPlan.clear();
+        for (sc::Equation *eq : m_strongCouplingSolver->getEquations()) {
+            for (sc::Connector *fc : eq->m_connectors) {
+                StrongConnector *forceConnector = dynamic_cast<StrongConnector*>(fc);
+                FMIClient *client = dynamic_cast<FMIClient*>(forceConnector->m_slave);
+                for (int x = 0; x < client->numConnectors(); x++) {
+                    StrongConnector *accelerationConnector = client->getConnector(x);
+
+                    //HACKHACK: use the presence of shaft angle VR to distinguish connector type
+                    if (accelerationConnector->hasShaftAngle() != forceConnector->hasShaftAngle()) {
+                        //the reason this is a problem is because we can't always get the positional mobilities for rotational constraints and vice versa
+                        //in theory we can though, by just putting zeroes in the relevant places
+                        //it's just very hairy, so i'm not doing it right now
+                        fatal("Can't deal with different types of kinematic connections to the same FMU\n");
+                    }
+                    if (eq->m_isSpatial && !(accelerationConnector->hasAcceleration() && forceConnector->hasForce())) {
+                        fatal("Strong coupling requires acceleration outputs for now\n");
+                    }
+                    if (eq->m_isRotational && !(accelerationConnector->hasAngularAcceleration() && forceConnector->hasTorque())) {
+                        fatal("Strong coupling requires angular acceleration outputs for now\n");
+                    }
+
+                    mobilityplanentry mp;
+                    mp.eq = eq;
+                    mp.forceConnector = forceConnector;
+                    mp.clientId = client->m_id;
+                    mp.slot = m_strongCouplingSolver->getMobilityIndex(accelerationConnector->m_index, eq->m_index);
+                    mp.spatial = eq->m_isSpatial;
+                    mp.rotational = eq->m_isRotational;
+                    mp.accelerationRefs = &accelerationConnector->getAccelerationValueRefs();
+                    mp.angularAccelerationRefs = &accelerationConnector->getAngularAccelerationValueRefs();
+                    mp.forceRefs = &forceConnector->getForceValueRefs();
+                    mp.torqueRefs = &forceConnector->getTorqueValueRefs();
+
+                    if (mp.slot < 0) {
+                        fatal("No mobility slot for connector %i in equation %i\n", accelerationConnector->m_index, eq->m_index);
+                    }
+                    m_mobilityPlan.push_back(mp);
+                }
+            }
+        }
+
+        //FMUs of each island, so they can be stepped as soon as the island is solved
+        m_islandClients.resize(m_strongCouplingSolver->getNumIslands());
+        for (int k = 0; k < m_strongCouplingSolver->getNumIslands(); k++) {
+            m_islandClients[k].clear();
+            for (sc::Slave *slave : m_strongCouplingSolver->getIslandSlaves(k)) {
+                m_islandClients[k].push_back(dynamic_cast<FMIClient*>(slave)->m_id);
+            }
+        }
+        info("%i kinematic island(s)\n", m_strongCouplingSolver->getNumIslands());
+
+        m_predictedVelocities.clear();
+        m_predictionErrors.resize(m_strongCouplingSolver->getEquations().size());
+        for (int id : kins) {
+            m_mobilityCache[id].refresh = true;
+        }
     }
 
     forces.resize(getNumForces());
+    m_kin.resize(m_clients.size());
+    m_kinOfs.resize(m_clients.size());
+
+    //where each client's forces go in this->forces, and the VRs they're set on
+    m_forceOffsets.resize(m_clients.size());
+    m_forceVRs.resize(m_clients.size());
+    int ofs = 0;
+    for (size_t i = 0; i < m_clients.size(); i++) {
+        m_forceOffsets[i] = ofs;
+        m_forceVRs[i].clear();
+        for (int j = 0; j < m_clients[i]->numConnectors(); j++) {
+            StrongConnector *sc = m_clients[i]->getConnector(j);
+            if (sc->hasForce()) {
+                ofs += sc->getAccelerationValueRefs().size();
+                m_forceVRs[i].insert(m_forceVRs[i].end(), sc->getForceValueRefs().begin(), sc->getForceValueRefs().end());
+            }
+            if (sc->hasTorque()) {
+                ofs += sc->getAngularAccelerationValueRefs().size();
+                m_forceVRs[i].insert(m_forceVRs[i].end(), sc->getTorqueValueRefs().begin(), sc->getTorqueValueRefs().end());
+            }
+        }
+    }
 }
 
 void StrongMaster::initRefValues(const fmitcp::int_set& cset) {
@@ -150,14 +277,14 @@ void StrongMaster::initRefValues(const fmitcp::int_set& cset) {
     }
 }
 
-void StrongMaster::getDirectionalDerivative(fmitcp_proto::fmi2_kinematic_req& kin, const Vec3& seedVec, const vector<int>& accelerationRefs, const vector<int>& forceRefs) {
-    fmitcp_proto::fmi2_import_get_directional_derivative_req* get_derivs = kin.add_get_derivs();
+void StrongMaster::getDirectionalDerivative(fmitcp::serialize::kinematic_req& kin, const Vec3& seedVec, const vector<int>& accelerationRefs, const vector<int>& forceRefs) {
+    double dv[3];
 
     for (size_t x = 0; x < accelerationRefs.size(); x++) {
-      get_derivs->add_z_ref(accelerationRefs[x]);
-      get_derivs->add_v_ref(forceRefs[x]);
-      get_derivs->add_dv(seedVec[x]);
+      dv[x] = seedVec[x];
     }
+
+    kin.addDirectionalDerivative(accelerationRefs, forceRefs, dv);
 }
 
 //"convenience" function for filling out setX entries in fmi2_kinematic_req
@@ -280,20 +407,20 @@ void StrongMaster::stepKinematicFmus(double t, double dt) {
     initRefValues(open);
     getInputWeakRefsAndValues(m_complexConnections, open, m_refValues);
 
-    vector<fmitcp_proto::fmi2_kinematic_req> kin(open.size(), fmitcp_proto::fmi2_kinematic_req());
-    vector<int> kin_ofs(open.size(), 0);  //current offset into derivs
-    map<int,int> id2kin; //maps FMU IDs into indices into kin
-
     //set weak connector inputs
-    int kini = 0;
+    //m_kin is reused every step to avoid allocations
     for (int id : open) {
-        id2kin[id] = kini;
+        fmitcp::serialize::kinematic_req& kin = m_kin[id];
         const SendSetXType& it = m_refValues[m_clients[id]];
-        fill_kinematic_req(it.real_vrs,   it.reals,   kin[kini], &fmitcp_proto::fmi2_kinematic_req::mutable_reals);
-        fill_kinematic_req(it.int_vrs,    it.ints,    kin[kini], &fmitcp_proto::fmi2_kinematic_req::mutable_ints);
-        fill_kinematic_req(it.bool_vrs,   it.bools,   kin[kini], &fmitcp_proto::fmi2_kinematic_req::mutable_bools);
-        fill_kinematic_req(it.string_vrs, it.strings, kin[kini], &fmitcp_proto::fmi2_kinematic_req::mutable_strings);
-        kini++;
+        kin.clear();
+        m_kinOfs[id] = 0;
+        if (it.reals.size() > 0) {
+            kin.realVRs = it.real_vrs;
+            kin.reals   = it.reals;
+        }
+        fill_kinematic_req(it.int_vrs,    it.ints,    kin.other, &fmitcp_proto::fmi2_kinematic_req::mutable_ints);
+        fill_kinematic_req(it.bool_vrs,   it.bools,   kin.other, &fmitcp_proto::fmi2_kinematic_req::mutable_bools);
+        fill_kinematic_req(it.string_vrs, it.strings, kin.other, &fmitcp_proto::fmi2_kinematic_req::mutable_strings);
     }
 
     //set connector values
@@ -306,6 +433,7 @@ void StrongMaster::stepKinematicFmus(double t, double dt) {
     //update constraints since connector values changed
     if (m_strongCouplingSolver) {
         m_strongCouplingSolver->updateConstraints();
+        updateMobilityCache();
     }
 
     //get future velocities:
@@ -318,190 +446,180 @@ void StrongMaster::stepKinematicFmus(double t, double dt) {
     for (int id : open) {
         FMIClient *client = m_clients[id];
         if (client->hasCapability(fmi2_cs_canGetAndSetFMUstate)) {
-            for (int vr : client->getStrongConnectorValueReferences()) {
-                kin[id2kin[id]].add_future_velocity_vrs(vr);
-            }
-            kin[id2kin[id]].set_currentcommunicationpoint(t);
-            kin[id2kin[id]].set_communicationstepsize(dt);
+            m_kin[id].futureVelocityVRs = client->getStrongConnectorValueReferences();
+            m_kin[id].currentCommunicationPoint = t;
+            m_kin[id].communicationStepSize = dt;
+        }
+    }
+
+    for (int id : kins) {
+        if (!open.count(id)) {
+            fatal("Kinematic FMU %i not in open set\n", id);
         }
     }
 
     //get directional derivatives
     //this is a two-step process which is important to get the order of correct
-    if (m_strongCouplingSolver) {
-    for (sc::Equation *eq : m_strongCouplingSolver->getEquations()) {
-        for (sc::Connector *fc : eq->m_connectors) {
-            StrongConnector *forceConnector = dynamic_cast<StrongConnector*>(fc);
-            FMIClient *client = dynamic_cast<FMIClient*>(forceConnector->m_slave);
-            for (int x = 0; x < client->numConnectors(); x++) {
-                StrongConnector *accelerationConnector = dynamic_cast<StrongConnector*>(forceConnector->m_slave->getConnector(x));
-
-                //HACKHACK: use the presence of shaft angle VR to distinguish connector type
-                if (accelerationConnector->hasShaftAngle() != forceConnector->hasShaftAngle()) {
-                    //the reason this is a problem is because we can't always get the positional mobilities for rotational constraints and vice versa
-                    //in theory we can though, by just putting zeroes in the relevant places
-                    //it's just very hairy, so i'm not doing it right now
-                    fatal("Can't deal with different types of kinematic connections to the same FMU\n");
-                }
-
-                //step 0 = send fmi2_import_get_directional_derivative() requests
-                if (eq->m_isSpatial) {
-                    if (accelerationConnector->hasAcceleration() && forceConnector->hasForce()) {
-                        getDirectionalDerivative(kin[id2kin[client->m_id]], eq->jacobianElementForConnector(forceConnector).getSpatial(), accelerationConnector->getAccelerationValueRefs(), forceConnector->getForceValueRefs());
-                    } else {
-                        fatal("Strong coupling requires acceleration outputs for now\n");
-                    }
-                }
+    //step 0 = send fmi2_import_get_directional_derivative() requests
+    for (const mobilityplanentry& mp : m_mobilityPlan) {
+        //keep last step's mobilities?
+        if (!m_mobilityCache[mp.clientId].refresh) {
+            m_derivsSaved += mp.spatial + mp.rotational;
+            continue;
+        }
+        m_derivsRequested += mp.spatial + mp.rotational;
 
-                if (eq->m_isRotational) {
-                    if (accelerationConnector->hasAngularAcceleration() && forceConnector->hasTorque()) {
-                        getDirectionalDerivative(kin[id2kin[client->m_id]], eq->jacobianElementForConnector(forceConnector).getRotational(), accelerationConnector->getAngularAccelerationValueRefs(), forceConnector->getTorqueValueRefs());
-                    } else {
-                        fatal("Strong coupling requires angular acceleration outputs for now\n");
-                    }
-                }
-            }
+        if (mp.spatial) {
+            getDirectionalDerivative(m_kin[mp.clientId], mp.eq->jacobianElementForConnector(mp.forceConnector).getSpatial(), *mp.accelerationRefs, *mp.forceRefs);
+        }
+        if (mp.rotational) {
+            getDirectionalDerivative(m_kin[mp.clientId], mp.eq->jacobianElementForConnector(mp.forceConnector).getRotational(), *mp.angularAccelerationRefs, *mp.torqueRefs);
         }
-    }
     }
 
     for (int id : open) {
-        if (kin[id2kin[id]].has_reals() ||
-            kin[id2kin[id]].has_ints() ||
-            kin[id2kin[id]].has_bools() ||
-            kin[id2kin[id]].has_strings() ||
-            kin[id2kin[id]].future_velocity_vrs_size()) {
-          m_clients[id]->queueMessage(pack(fmitcp_proto::type_fmi2_kinematic_req, kin[id2kin[id]]));
+        const fmitcp::serialize::kinematic_req& kin = m_kin[id];
+        if (!kin.empty()) {
+          m_clients[id]->queueMessage(kin.pack());
         }
     }
 
     wait();
 
-    if (m_strongCouplingSolver) {
-    for (sc::Equation *eq : m_strongCouplingSolver->getEquations()) {
-        for (sc::Connector *fc : eq->m_connectors) {
-            StrongConnector *forceConnector = dynamic_cast<StrongConnector*>(fc);
-            FMIClient *client = dynamic_cast<FMIClient*>(forceConnector->m_slave);
-            if (!open.count(client->m_id)) {
-                fatal("Kinematic FMU %i not in open set\n", client->m_id);
+    //step 1 = put returned directional derivatives in the correct place in the sparse mobility matrix
+    for (const mobilityplanentry& mp : m_mobilityPlan) {
+        if (!m_mobilityCache[mp.clientId].refresh) {
+            //cached - the solver still has the old values
+            continue;
+        }
+
+        const vector<double>& dz = m_clients[mp.clientId]->last_dz;
+        int& ofs = m_kinOfs[mp.clientId];
+        JacobianElement &el = m_strongCouplingSolver->getMobility(mp.slot);
+
+        if (mp.spatial) {
+            if (mp.accelerationRefs->size() == 1) {
+                el.setSpatial(    dz[ofs], 0,         0);
+            } else {
+                el.setSpatial(    dz[ofs], dz[ofs+1], dz[ofs+2]);
             }
-            for (int x = 0; x < client->numConnectors(); x++) {
-                StrongConnector *accelerationConnector = dynamic_cast<StrongConnector*>(forceConnector->m_slave->getConnector(x));
-
-                //step 1 = put returned directional derivatives in the correct place in the sparse mobility matrix
-                int I = accelerationConnector->m_index;
-                int J = eq->m_index;
-                JacobianElement &el = m_strongCouplingSolver->m_mobilities[make_pair(I,J)];
-
-                if (eq->m_isSpatial) {
-                    const fmitcp_proto::fmi2_import_get_directional_derivative_res& res = client->last_kinematic.derivs(kin_ofs[id2kin[client->m_id]]++);
-                    if (accelerationConnector->getAccelerationValueRefs().size() == 1) {
-                        el.setSpatial(    res.dz(0), 0,         0);
-                    } else {
-                        el.setSpatial(    res.dz(0), res.dz(1), res.dz(2));
-                    }
-                } else {
-                    el.setSpatial(0,0,0);
-                }
+            ofs += mp.accelerationRefs->size();
+        } else {
+            el.setSpatial(0,0,0);
+        }
 
-                if (eq->m_isRotational) {
-                    const fmitcp_proto::fmi2_import_get_directional_derivative_res& res = client->last_kinematic.derivs(kin_ofs[id2kin[client->m_id]]++);
-                    //1-D?
-                    if (accelerationConnector->getAngularAccelerationValueRefs().size() == 1) {
-                        //debug("J(%i,%i) = %f\n", I, J, client->m_getDirectionalDerivativeValues.front()[0]);
-                        el.setRotational( res.dz(0), 0,         0);
-                    } else {
-                        el.setRotational( res.dz(0), res.dz(1), res.dz(2));
-                    }
-                } else {
-                    el.setRotational(0,0,0);
-                }
+        if (mp.rotational) {
+            //1-D?
+            if (mp.angularAccelerationRefs->size() == 1) {
+                el.setRotational( dz[ofs], 0,         0);
+            } else {
+                el.setRotational( dz[ofs], dz[ofs+1], dz[ofs+2]);
             }
+            ofs += mp.angularAccelerationRefs->size();
+        } else {
+            el.setRotational(0,0,0);
         }
     }
-    }
 
     //set FUTURE connector values (velocities only)
     for (int id : open) {
-        if (kin[id2kin[id]].future_velocity_vrs_size()) {
+        if (m_kin[id].futureVelocityVRs.size()) {
             const vector<int>& vrs = m_clients[id]->getStrongConnectorValueReferences();
-            vector<double> reals;
-            reals.reserve(kin[id2kin[id]].future_velocity_vrs_size());
-            for (int x = 0; x < kin[id2kin[id]].future_velocity_vrs_size(); x++) {
-              reals.push_back(m_clients[id]->last_kinematic.future_velocities(x));
-            }
-            m_clients[id]->setConnectorFutureVelocities(vrs, reals);
+            m_clients[id]->setConnectorFutureVelocities(vrs, m_clients[id]->last_future_velocities);
         }
     }
 
     //compute strong coupling forces
+    //each island's FMUs get their forces and are stepped as soon as that island is solved,
+    //so they can get going while the rest of the system is being solved
+    fmitcp::int_set stepped;
+    int numForces = 0;
     if (m_strongCouplingSolver) {
-        m_strongCouplingSolver->solve(holonomic);
+        m_strongCouplingSolver->solve(holonomic, 0, [this, t, dt, &stepped, &numForces](int island) {
+            for (int id : m_islandClients[island]) {
+                numForces += sendForcesAndStep(id, t, dt);
+                m_clients[id]->sendQueuedMessages();
+                stepped.insert(id);
+            }
+        });
+
+        //remember what the solver expects, so the next step can tell if the mobilities are still good
+        const vector<sc::Equation*>& eqs = m_strongCouplingSolver->getEquations();
+        m_predictedVelocities.resize(eqs.size());
+        for (sc::Equation *eq : eqs) {
+            m_predictedVelocities[eq->m_index] = m_strongCouplingSolver->getPredictedVelocity(eq->m_index);
+        }
+
+        for (int id : kins) {
+            mobilitycache& mc = m_mobilityCache[id];
+            if (mc.refresh) {
+                mc.age = 1;
+                mc.refresh = false;
+            } else {
+                mc.age++;
+            }
+        }
     }
 
-    //distribute forces
-    char separator = fmigo::globals::getSeparator();
-    //offset into this->forces
-    int forceofs = 0;
+    //do actual step for the FMUs not in any island
     for (int id : open) {
-        FMIClient *client = m_clients[id];
-        for (int j = 0; j < client->numConnectors(); j++) {
-            StrongConnector *sc = client->getConnector(j);
-            vector<double> vec;
-            vec.reserve(6);
+        if (!stepped.count(id)) {
+            numForces += sendForcesAndStep(id, t, dt);
+        }
+    }
 
-            vector<int> fvrs = sc->getForceValueRefs();
-            vector<int> tvrs = sc->getTorqueValueRefs();
+    if ((size_t)numForces != forces.size()) {
+      fatal("numForces != forces.size()\n");
+    }
 
-            //dump force/torque
-            if (sc->hasForce()) {
-                this->forces[forceofs++] = sc->m_force.x();
-                vec.push_back(sc->m_force.x());
-
-                if (fvrs.size() > 1) {
-                  this->forces[forceofs++] = sc->m_force.y();
-                  this->forces[forceofs++] = sc->m_force.z();
-                  vec.push_back(sc->m_force.y());
-                  vec.push_back(sc->m_force.z());
-                }
-            }
+    //do_step() makes values old
+    deleteCachedValues(true, open);
 
-            if (sc->hasTorque()) {
-                //only set/print one torque for shafts
-                this->forces[forceofs++] = sc->m_torque.x();
-                vec.push_back(sc->m_torque.x());
-
-                if (tvrs.size() > 1) {
-                  this->forces[forceofs++] = sc->m_torque.y();
-                  this->forces[forceofs++] = sc->m_torque.z();
-                  vec.push_back(sc->m_torque.y());
-                  vec.push_back(sc->m_torque.z());
-                }
+    //copy open explicitly, since moveCranked modifies open
+    fmitcp::int_set open_copy = open;
+    moveCranked(open_copy);
+}
+
+int StrongMaster::sendForcesAndStep(int id, double t, double dt) {
+    FMIClient *client = m_clients[id];
+    //offset into this->forces
+    int forceofs = m_forceOffsets[id];
+
+    for (int j = 0; j < client->numConnectors(); j++) {
+        StrongConnector *sc = client->getConnector(j);
+
+        //dump force/torque
+        if (sc->hasForce()) {
+            this->forces[forceofs++] = sc->m_force.x();
+
+            if (sc->getForceValueRefs().size() > 1) {
+              this->forces[forceofs++] = sc->m_force.y();
+              this->forces[forceofs++] = sc->m_force.z();
             }
+        }
 
-            fvrs.insert(fvrs.end(), tvrs.begin(), tvrs.end());
+        if (sc->hasTorque()) {
+            //only set/print one torque for shafts
+            this->forces[forceofs++] = sc->m_torque.x();
 
-            queueMessage(client, fmi2_import_set_real(fvrs, vec));
+            if (sc->getTorqueValueRefs().size() > 1) {
+              this->forces[forceofs++] = sc->m_torque.y();
+              this->forces[forceofs++] = sc->m_torque.z();
+            }
         }
     }
 
-    if ((size_t)forceofs != forces.size()) {
-      fatal("forceofs != forces.size()\n");
+    //all of the FMU's forces and torques in one go, in the same order as m_forceVRs
+    if (m_forceVRs[id].size() > 0) {
+        m_forceValues.assign(this->forces.begin() + m_forceOffsets[id], this->forces.begin() + forceofs);
+        queueMessage(client, fmi2_import_set_real(m_forceVRs[id], m_forceValues));
     }
 
-    //do actual step
     //noSetFMUStatePriorToCurrentPoint = true
     //In other words: do the step, commit the results (basically, we're not going back)
-    for (int id : open) {
-        queueMessage(m_clients[id], fmi2_import_do_step(t, dt, true));
-    }
-
-    //do_step() makes values old
-    deleteCachedValues(true, open);
+    queueMessage(client, fmi2_import_do_step(t, dt, true));
 
-    //copy open explicitly, since moveCranked modifies open
-    fmitcp::int_set open_copy = open;
-    moveCranked(open_copy);
+    return forceofs - m_forceOffsets[id];
 }
 
 void StrongMaster::runIteration(double t, double dt) {
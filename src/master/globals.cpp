@@ -7,6 +7,7 @@ namespace fmigo {
   namespace globals {
     FILEFORMAT fileFormat = csv;
     fmigo::timer timer;
+    int meIntegrator = 4;   //rk8pd
 
     char getSeparator() {
       switch (fileFormat) {
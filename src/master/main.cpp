@@ -41,6 +41,7 @@ using namespace common;
 
 jm_log_level_enu_t fmigo_loglevel = jm_log_level_warning;
 bool alwaysComputeNumericalDirectionalDerivatives = false;
+int numPerturbationClones = 0;
 
 #ifdef USE_MPI
 static vector<FMIClient*> setupClients(int numFMUs) {
@@ -812,6 +813,8 @@ int main(int argc, char *argv[] ) {
     string hdf5Filename;
     int maxSamples = -1;
     bool writeSolverFields = false;
+    kinematicsolver kinematicSolver = {"direct", 1e-10, 100, 1, {}};
+    map<int,int> meIntegrators;
     MatlabOutput mo;
 
     parseArguments(
@@ -823,7 +826,8 @@ int main(int argc, char *argv[] ) {
 #endif
             &hdf5Filename, &fieldnameFilename, &holonomic, &compliance,
             &command_port, &results_port, &startPaused, &solveLoops, &useHeadersInCSV, &csv_fmu, &maxSamples, &relaxation,
-            &writeSolverFields
+            &writeSolverFields, &kinematicSolver, &meIntegrators,
+            &fmigo::globals::meIntegrator
     );
 
 #ifdef USE_MPI
@@ -890,8 +894,10 @@ int main(int argc, char *argv[] ) {
     try {
     //get modelDescription XML
     //important to be able to resolve variable names
+    //FMUs given with -I are integrated on their servers and come back as Co-Simulation
     for (auto it = clients.begin(); it != clients.end(); it++) {
-        (*it)->sendMessageBlocking(get_xml());
+        auto me = meIntegrators.find((*it)->m_id);
+        (*it)->sendMessageBlocking(get_xml(me != meIntegrators.end() ? me->second : -1));
     }
 
     connectionNamesToVr(
@@ -921,8 +927,16 @@ int main(int argc, char *argv[] ) {
         );
         if (solver) {
             solver->setSpookParams(relaxation,compliance,timeStep);
+            solver->setMethod(
+                kinematicSolver.method == "pcg" ? SOLVER_PCG :
+                kinematicSolver.method == "gs"  ? SOLVER_GS  : SOLVER_DIRECT,
+                kinematicSolver.tolerance, kinematicSolver.maxIterations);
+            solver->setNumThreads(kinematicSolver.threads);
         }
         StrongMaster *sm = new StrongMaster(context, clients, weakConnections, solver, holonomic, executionOrder);
+        for (const auto& it : kinematicSolver.mobilityCaching) {
+            sm->setMobilityCaching(it.first, it.second.period, it.second.tolerance);
+        }
         master = sm;
     }
 #endif
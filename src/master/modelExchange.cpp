@@ -1,5 +1,8 @@
 #include "master/modelExchange.h"
+#include "master/globals.h"
 #include"modelExchangeFmiInterface.h"
+#include <set>
+#include <float.h>
 #define storage_alloc storage_alloc
 //#define get_storage get_storage
 using namespace fmitcp::serialize;
@@ -49,6 +52,14 @@ ModelExchangeStepper::ModelExchangeStepper(zmq::context_t &context, std::vector<
            wc.to->getFmuKind()   == fmi2_fmu_kind_me )
             me_weakConnections.push_back(wc);
     }
+
+#ifdef USE_GPL
+    m_concurrent = false;
+    m_threaded = false;
+    m_running = 0;
+    m_waiting = 0;
+    m_round = 0;
+#endif
 }
 
 /** ~ModelExchangeStepper()
@@ -56,14 +67,82 @@ ModelExchangeStepper::ModelExchangeStepper(zmq::context_t &context, std::vector<
  */
 ModelExchangeStepper::~ModelExchangeStepper(){
 #ifdef USE_GPL
-    if (me_clients.size() > 0) {
-        cgsl_free_simulation(m_sim);
-        free(m_p.backup.dydt);
+    m_groupThreads.stop();
+    for(size_t g = 0; g < m_groups.size(); g++){
+        cgsl_free_simulation(m_sims[g]);
+        free(m_groups[g]->backup.dydt);
+        delete m_groups[g];
     }
 #endif
 }
 
 #ifdef USE_GPL
+/** getStates
+ *  Copies the group's part of states, derivatives or nominals from storage to x order
+ *
+ *  @param p Model parameters
+ *  @param type Which data
+ *  @param ret Output, sized like x
+ */
+static void getStates(fmu_parameters* p, enum STORAGE type, double *ret)
+{
+    FmigoStorage& storage = p->stepper->get_storage();
+    for(size_t c = 0; c < p->clients.size(); c++)
+        memcpy(ret + p->offsets[c],
+               storage.get_current(type).data() + storage.get_offset(p->clients[c]->m_id, type),
+               p->clients[c]->getNumContinuousStates() * sizeof(double));
+}
+
+/** getIndicators
+ *  Gathers the group's current event indicators from storage
+ *
+ *  @param p Model parameters
+ *  @param g Output
+ */
+static void getIndicators(fmu_parameters* p, std::vector<double>& g)
+{
+    FmigoStorage& storage = p->stepper->get_storage();
+    Data& indicators = storage.get_current_indicators();
+    g.clear();
+    for(auto client: p->clients){
+        size_t o = storage.get_offset(client->m_id, STORAGE::indicators);
+        g.insert(g.end(), indicators.begin() + o, indicators.begin() + o + client->getNumEventIndicators());
+    }
+}
+
+/** evaluate
+ *  Sets time and states on all ME FMUs and gets their derivatives,
+ *  and optionally their event indicators into storage
+ *
+ *  @param p Model parameters
+ *  @param t Time
+ *  @param x States vector
+ *  @param dxdt Output derivatives
+ *  @param indicators Whether to get event indicators
+ */
+static void evaluate(fmu_parameters* p, double t, const double x[], double dxdt[], bool indicators)
+{
+    // set time and states, get derivatives and event indicators, all in one round trip.
+    // weak connections need their loops solved in between, which takes two
+    if(p->solveLoops){
+        for(size_t c = 0; c < p->clients.size(); c++){
+            p->FMIGO_ME_SET_TIME(p->clients[c]);
+            p->FMIGO_ME_SET_CONTINUOUS_STATES(p->clients[c], x + p->offsets[c]);
+        }
+        p->FMIGO_ME_WAIT();
+        p->stepper->solveLoops();
+
+        for(auto client: p->clients)
+            p->FMIGO_ME_GET_EVAL(client, indicators ? (int)client->getNumEventIndicators() : 0);
+    } else {
+        for(size_t c = 0; c < p->clients.size(); c++)
+            p->FMIGO_ME_EVAL(p->clients[c], x + p->offsets[c], indicators ? (int)p->clients[c]->getNumEventIndicators() : 0);
+    }
+    p->FMIGO_ME_WAIT();
+
+    getStates(p, STORAGE::derivatives, dxdt);
+}
+
 /** fmu_function
  *  function needed by cgsl_simulation to get and set the current
  *  states and derivatives
@@ -82,26 +161,14 @@ static int fmu_function(double t, const double x[], double dxdt[], void* params)
     ++p->count; /* count function evaluations */
     if(p->stateEvent)return GSL_SUCCESS;
 
-    for(auto client: p->clients){
-        p->FMIGO_ME_SET_TIME(client);
-        p->FMIGO_ME_SET_CONTINUOUS_STATES(client, x);
-    }
-    p->FMIGO_ME_WAIT();
-    p->stepper->solveLoops();
-
-    for(auto client: p->clients)
-        p-> FMIGO_ME_GET_DERIVATIVES(client);
-    p->FMIGO_ME_WAIT();
+    // event indicators are only needed past the latest time known to be free of events.
+    // stages at or before it, like the first stage of a step or the stages of a retried step, skip them
+    bool indicators = t > p->t_ok;
 
-    for(auto client: p->clients)
-        p->stepper->get_storage().get_current_derivatives(dxdt, client->m_id);
+    evaluate(p, t, x, dxdt, indicators);
 
-    for(auto client: p->clients){
-        if(client->getNumEventIndicators())
-            p->FMIGO_ME_GET_EVENT_INDICATORS(client);
-    }
-
-    p->FMIGO_ME_WAIT();
+    if(!indicators)
+        return GSL_SUCCESS;
 
     //p->stepper->get_storage().print(states);
     //debug("x[0] %f x[1] %f\n",x[0],x[1]);
@@ -120,28 +187,73 @@ static int fmu_function(double t, const double x[], double dxdt[], void* params)
     return GSL_SUCCESS;
 }
 
+/** fmu_jacobian
+ *  Jacobian needed by the implicit cgsl integrators.
+ *  Perturbs all columns of one colour at a time, see setupJacobian()
+ *
+ *  @param t Input time
+ *  @param x Input states vector
+ *  @param dfdy Output Jacobian, row major
+ *  @param dfdt Output time derivative of the derivatives
+ *  @param params Contains model specific parameters
+ */
+static int fmu_jacobian(double t, const double x[], double *dfdy, double dfdt[], void* params)
+{
+    fmu_parameters* p = (fmu_parameters*)params;
+    size_t n = p->jx.size();
+
+    if(p->stateEvent)return GSL_SUCCESS;
+
+    evaluate(p, t, x, p->jf0.data(), false);
+    p->jx.assign(x, x + n);
+    memset(dfdy, 0, n * n * sizeof(dfdy[0]));
+
+    for(const auto& color: p->colors){
+        for(size_t j: color){
+            p->jx[j] = x[j] + sqrt(DBL_EPSILON) * max(fabs(x[j]), 1.0);
+            p->jh[j] = p->jx[j] - x[j];
+        }
+
+        evaluate(p, t, p->jx.data(), p->jf1.data(), false);
+        p->count++;
+
+        for(size_t j: color){
+            for(size_t i: p->jacRows[j])
+                dfdy[i*n + j] = (p->jf1[i] - p->jf0[i]) / p->jh[j];
+            p->jx[j] = x[j];
+        }
+    }
+
+    double ht = sqrt(DBL_EPSILON) * max(fabs(t), 1.0);
+    evaluate(p, t + ht, x, p->jf1.data(), false);
+    for(size_t i = 0; i < n; i++)
+        dfdt[i] = (p->jf1[i] - p->jf0[i]) / ht;
+    p->count += 2;
+
+    return GSL_SUCCESS;
+}
 
 /** allocate Memory
  *  Allocates memory needed by the fmu_model
  *
  *  @param m The fmu_model
- *  @param clients Vector with clients
+ *  @param p Parameters of the group
  */
-void ModelExchangeStepper::allocateMemory(fmu_model &m, const std::vector<FMIClient*> &clients){
+void ModelExchangeStepper::allocateMemory(fmu_model &m, fmu_parameters *p){
     m.model = (cgsl_model*)calloc(1,sizeof(cgsl_model));
-    storage_alloc(clients);
-    m.model->n_variables = get_storage().get_current_states().size();
-    if(m.model->n_variables == 0){
-        cerr << "ModelExchangeStepper nothing to integrate" << endl;
-        exit(0);
+    m.model->n_variables = 0;
+    p->offsets.clear();
+    for(auto client: p->clients){
+        p->offsets.push_back(m.model->n_variables);
+        m.model->n_variables += client->getNumContinuousStates();
     }
 
     m.model->x = (double*)calloc(m.model->n_variables, sizeof(double));
     m.model->x_backup = (double*)calloc(m.model->n_variables, sizeof(double));
 
-    m_p.backup.dydt = (double*)calloc(m.model->n_variables, sizeof(double));
+    p->backup.dydt = (double*)calloc(m.model->n_variables, sizeof(double));
 
-    if(!m.model->x || !m_p.backup.dydt){
+    if(!m.model->x || !p->backup.dydt){
         //freeFMUModel(m);
         perror("WeakMaster:ModelExchange:allocateMemory ERROR -  could not allocate memory");
         exit(1);
@@ -152,13 +264,12 @@ void ModelExchangeStepper::allocateMemory(fmu_model &m, const std::vector<FMICli
  *  Setup all parameters and function pointers needed by fmu_model
  *
  *  @param m The fmu_model we are working on
- *  @param client A vector with clients
+ *  @param p Parameters of the group, with clients filled in
  */
-void ModelExchangeStepper::init_fmu_model(fmu_model &m,  const std::vector<FMIClient*> &clients){
-    allocateMemory(m, clients);
-    m.model->parameters = (void*)&m_p;
+void ModelExchangeStepper::init_fmu_model(fmu_model &m, fmu_parameters *p){
+    allocateMemory(m, p);
+    m.model->parameters = (void*)p;
     m.model->get_model_parameters = get_model_parameters;
-    fmu_parameters* p = get_p(m);
 
     p->t_ok = 0;
     p->t_past = 0;
@@ -170,10 +281,16 @@ void ModelExchangeStepper::init_fmu_model(fmu_model &m,  const std::vector<FMICl
 
     p->backup.t = 0;
     p->backup.h = 0;
-    p->clients = me_clients;
+
+    // only connections into the group change its inputs while it is integrated.
+    // partition() keeps both ends of those in the same group
+    p->solveLoops = false;
+    for(const WeakConnection& wc: me_weakConnections)
+        if(std::find(p->clients.begin(), p->clients.end(), wc.to) != p->clients.end())
+            p->solveLoops = true;
 
     m.model->function = fmu_function;
-    m.model->jacobian = NULL;
+    m.model->jacobian = fmu_jacobian;
     m.model->post_step = NULL;
     m.model->pre_step = NULL;
     m.model->free = cgsl_model_default_free;//freeFMUModel;
@@ -181,12 +298,138 @@ void ModelExchangeStepper::init_fmu_model(fmu_model &m,  const std::vector<FMICl
     // Dymola FMUs claim we've already entered continuous mode at this point
     //p->FMIGO_ME_ENTER_CONTINUOUS_TIME_MODE(me_clients);
 
-    for(auto client: clients)
+    for(auto client: p->clients)
         p->FMIGO_ME_GET_CONTINUOUS_STATES(client);
-    wait();
+    meWait();
 
-    for(auto client: clients)
-        get_storage().get_current_states(m.model->x, client->m_id);
+    getStates(p, STORAGE::states, m.model->x);
+
+    setupJacobian(p);
+}
+
+/** partition()
+ *  Connected components of me_clients under me_weakConnections
+ */
+std::vector<std::vector<FMIClient*> > ModelExchangeStepper::partition(){
+    size_t nc = me_clients.size();
+    std::map<FMIClient*, size_t> index;
+    std::vector<size_t> root(nc);
+    for(size_t c = 0; c < nc; c++){
+        index[me_clients[c]] = c;
+        root[c] = c;
+    }
+
+    auto find = [&root](size_t c){
+        while(root[c] != c)
+            c = root[c] = root[root[c]];
+        return c;
+    };
+    for(const WeakConnection& wc: me_weakConnections)
+        root[find(index[wc.from])] = find(index[wc.to]);
+
+    std::vector<std::vector<FMIClient*> > groups;
+    std::map<size_t, size_t> group;
+    for(size_t c = 0; c < nc; c++){
+        size_t r = find(c);
+        if(group.find(r) == group.end()){
+            group[r] = groups.size();
+            groups.push_back(std::vector<FMIClient*>());
+        }
+        groups[group[r]].push_back(me_clients[c]);
+    }
+
+    // gsl can't integrate zero variables
+    std::vector<std::vector<FMIClient*> > ret;
+    std::vector<FMIClient*> stateless;
+    for(auto& g: groups){
+        size_t n = 0;
+        for(auto client: g)
+            n += client->getNumContinuousStates();
+        if(n)
+            ret.push_back(g);
+        else
+            stateless.insert(stateless.end(), g.begin(), g.end());
+    }
+    if(ret.empty()){
+        cerr << "ModelExchangeStepper nothing to integrate" << endl;
+        exit(0);
+    }
+    ret[0].insert(ret[0].end(), stateless.begin(), stateless.end());
+    return ret;
+}
+
+void ModelExchangeStepper::setupJacobian(fmu_parameters *p){
+    size_t nc = p->clients.size();
+    size_t n = p->offsets.back() + p->clients.back()->getNumContinuousStates();
+    std::map<FMIClient*, size_t> index;
+    for(size_t c = 0; c < nc; c++)
+        index[p->clients[c]] = c;
+
+    // upstream[c] = ME FMUs whose states can reach the inputs of c, possibly through other FMUs
+    std::vector<std::set<size_t> > upstream(nc);
+    for(bool changed = true; changed; ){
+        changed = false;
+        for(const WeakConnection& wc: me_weakConnections){
+            if(index.find(wc.to) == index.end())
+                continue;
+            size_t from = index[wc.from], to = index[wc.to];
+            size_t before = upstream[to].size();
+            upstream[to].insert(from);
+            upstream[to].insert(upstream[from].begin(), upstream[from].end());
+            changed = changed || upstream[to].size() != before;
+        }
+    }
+
+    std::vector<std::set<size_t> > rows(n);
+    for(size_t c = 0; c < nc; c++){
+        FMIClient *client = p->clients[c];
+        size_t o = p->offsets[c];
+        size_t ns = client->getNumContinuousStates();
+
+        std::vector<std::vector<size_t> > deps;
+        std::vector<bool> inputs;
+        client->getDerivativeDependencies(deps, inputs);
+
+        for(size_t i = 0; i < ns; i++){
+            for(size_t j: deps[i])
+                rows[o + i].insert(o + j);
+            if(inputs[i])
+                for(size_t u: upstream[c]){
+                    size_t uo = p->offsets[u];
+                    for(size_t j = 0; j < p->clients[u]->getNumContinuousStates(); j++)
+                        rows[o + i].insert(uo + j);
+                }
+        }
+    }
+
+    // transpose, then greedily give each column the lowest colour not used by a column sharing a row with it
+    p->jacRows.assign(n, std::vector<size_t>());
+    for(size_t i = 0; i < n; i++)
+        for(size_t j: rows[i])
+            p->jacRows[j].push_back(i);
+
+    std::vector<int> color(n, -1);
+    std::vector<size_t> forbidden(n, n);
+    p->colors.clear();
+    for(size_t j = 0; j < n; j++){
+        for(size_t i: p->jacRows[j])
+            for(size_t k: rows[i])
+                if(color[k] >= 0)
+                    forbidden[color[k]] = j;
+        size_t col = 0;
+        while(forbidden[col] == j)
+            col++;
+        color[j] = col;
+        if(col == p->colors.size())
+            p->colors.push_back(std::vector<size_t>());
+        p->colors[col].push_back(j);
+    }
+
+    p->jx.resize(n);
+    p->jh.resize(n);
+    p->jf0.resize(n);
+    p->jf1.resize(n);
+    debug("ME Jacobian: %zu states in %zu colours\n", n, p->colors.size());
 }
 
 /** epce_post_step()
@@ -204,12 +447,12 @@ static int epce_post_step(double t, int n, const double outputs[], void * params
         // extract current states to restore after outputs are changed
         for(auto client: p->clients)
             p->FMIGO_ME_GET_CONTINUOUS_STATES(client);
-        std::vector<double> tmp(p->stepper->get_storage().get_current_states().size());
-        p->stepper->get_storage().get_current_states(tmp.data());
+        std::vector<double> tmp(p->offsets.back() + p->clients.back()->getNumContinuousStates());
+        getStates(p, STORAGE::states, tmp.data());
 
         //set filtered states
-        for(auto client: p->clients){
-          p->FMIGO_ME_SET_CONTINUOUS_STATES(client, outputs);
+        for(size_t c = 0; c < p->clients.size(); c++){
+          p->FMIGO_ME_SET_CONTINUOUS_STATES(p->clients[c], outputs + p->offsets[c]);
         }
         p->FMIGO_ME_WAIT();
         p->stepper->solveLoops();
@@ -220,8 +463,8 @@ static int epce_post_step(double t, int n, const double outputs[], void * params
         p->FMIGO_ME_WAIT();
 
         //reset old states
-        for(auto client: p->clients){
-          p->FMIGO_ME_SET_CONTINUOUS_STATES(client,tmp.data());
+        for(size_t c = 0; c < p->clients.size(); c++){
+          p->FMIGO_ME_SET_CONTINUOUS_STATES(p->clients[c], tmp.data() + p->offsets[c]);
         }
     }
 
@@ -234,30 +477,45 @@ static int epce_post_step(double t, int n, const double outputs[], void * params
 void ModelExchangeStepper::prepareME() {
   if (me_clients.size() > 0) {
 #ifdef USE_GPL
-    // set up a gsl_simulation for each client
-    init_fmu_model(m_model, me_clients);
-    fmu_parameters* p = get_p(m_model);
-    int filter_length = get_storage().get_current_states().size();
+    storage_alloc(me_clients);
+
+    // set up a gsl_simulation for each group of connected clients
+    for(auto& clients: partition()){
+        fmu_model model;
+        fmu_parameters* p = new fmu_parameters();
+        p->clients = clients;
+        init_fmu_model(model, p);
 #ifdef MODEL_EXCHANGE_FILTER
-    cgsl_model* e_model = cgsl_epce_default_model_init(m_model.model,  /* model */
-                                                       2,
-                                                       epce_post_step,
-                                                       p);
+        cgsl_model* e_model = cgsl_epce_default_model_init(model.model,  /* model */
+                                                           2,
+                                                           epce_post_step,
+                                                           p);
 #endif
 
-    //m_sim = (cgsl_simulation *)malloc(sizeof(cgsl_simulation));
-    m_sim = cgsl_init_simulation(
+        m_groups.push_back(p);
+        m_sims.push_back(cgsl_init_simulation(
 #ifdef MODEL_EXCHANGE_FILTER
-                                 e_model,
+                                     e_model,
 #else
-                                 m_model.model,
+                                     model.model,
 #endif
-                                 rk8pd, /* integrator: Runge-Kutta Prince Dormand pair order 7-8 */
-                                 1e-10,
-                                 0,
-                                 0,
-                                 0, NULL
-                                 );
+                                     (enum cgsl_integrator_ids)fmigo::globals::meIntegrator, /* rk8pd unless -i says otherwise */
+                                     1e-10,
+                                     0,
+                                     0,
+                                     0, NULL
+                                     ));
+    }
+
+    // threads can't share solveLoops(), it works on every connection at once
+    m_concurrent = m_groups.size() > 1;
+    for(auto p: m_groups)
+        m_concurrent = m_concurrent && !p->solveLoops;
+    info("ModelExchange: %zu independent group%s of FMUs%s\n", m_groups.size(),
+         m_groups.size() == 1 ? "" : "s", m_concurrent ? ", integrated concurrently" : "");
+    if(m_concurrent)
+        m_groupThreads.start(m_groups.size());
+
     // might not be needed
     get_storage().sync();
 #else
@@ -273,13 +531,12 @@ void ModelExchangeStepper::prepareME() {
  *  @param sim The simulation
  */
 void ModelExchangeStepper::restoreStates(cgsl_simulation &sim){
-    get_storage().cycle();
-    get_storage().sync();
     fmu_parameters* p = get_p(sim);
-    //restore previous states
+    for(auto client: p->clients)
+        get_storage().restore(client->m_id);
 
-    for(auto client: me_clients)
-        get_storage().get_current_states(sim.model->x,client->m_id);
+    //restore previous states
+    getStates(p, STORAGE::states, sim.model->x);
 
     memcpy(sim.i.evolution->dydt_out, p->backup.dydt,
            sim.model->n_variables * sizeof(p->backup.dydt[0]));
@@ -294,11 +551,13 @@ void ModelExchangeStepper::restoreStates(cgsl_simulation &sim){
  *  from a state before an event
  *
  *  @param sim The simulation
+ *  @param fetch Whether to get the states from the FMUs first
  */
-void ModelExchangeStepper::storeStates(cgsl_simulation &sim){
+void ModelExchangeStepper::storeStates(cgsl_simulation &sim, bool fetch){
     fmu_parameters* p = get_p(sim);
-    for(auto client: me_clients)
-        p->FMIGO_ME_GET_CONTINUOUS_STATES(client);
+    if(fetch)
+        for(auto client: p->clients)
+            p->FMIGO_ME_GET_CONTINUOUS_STATES(client);
 
     p->backup.failed_steps = sim.i.evolution->failed_steps;
     p->backup.t = sim.t;
@@ -307,10 +566,11 @@ void ModelExchangeStepper::storeStates(cgsl_simulation &sim){
     memcpy(p->backup.dydt, sim.i.evolution->dydt_out,
            sim.model->n_variables * sizeof(p->backup.dydt[0]));
 
-    wait();
-    for(auto client: me_clients)
-        get_storage().get_current_states(sim.model->x,client->m_id);
-    get_storage().sync();
+    if(fetch)
+        meWait();
+    getStates(p, STORAGE::states, sim.model->x);
+    for(auto client: p->clients)
+        get_storage().sync(client->m_id);
 }
 
 /** hasStateEvent()
@@ -323,28 +583,6 @@ bool ModelExchangeStepper::hasStateEvent(cgsl_simulation &sim){
     return get_p(sim)->stateEvent;
 }
 
-/** getSafeTime()
- *  Calculates a time step which brings solution closer to the event
- *  Uses the golden ratio to get t_crossed and t_safe to converge
- *  to the event time
- *
- *  @param sim The simulation
- */
-void ModelExchangeStepper::getGoldenNewTime(cgsl_simulation &sim){
-    // golden ratio
-    double phi = (1 + sqrt(5)) / 2;
-    /* passed solution, need to reduce tEnd */
-    if(hasStateEvent(sim)){
-        getSafeAndCrossed();
-        restoreStates(sim);
-        timeLoop.dt_new = (timeLoop.t_crossed - sim.t) / phi;
-    } else { // havent passed solution, increase step
-        storeStates(sim);
-        timeLoop.t_safe = max(timeLoop.t_safe, sim.t);
-        timeLoop.dt_new = timeLoop.t_crossed - sim.t - (timeLoop.t_crossed - timeLoop.t_safe) / phi;
-    }
-}
-
 /** step()
  *  Run cgsl_step_to the simulation
  *
@@ -354,93 +592,94 @@ void ModelExchangeStepper::step(cgsl_simulation &sim){
     fmu_parameters *p;
     p = get_p(sim);
     p->stateEvent = false;
-    p->t_past = max(p->t_past, sim.t + timeLoop.dt_new);
+    p->t_past = max(p->t_past, sim.t + p->timeLoop.dt_new);
     p->t_ok = sim.t;
 
-    cgsl_step_to(&sim, sim.t, timeLoop.dt_new);
+    cgsl_step_to(&sim, sim.t, p->timeLoop.dt_new);
 }
 
-/** stepToEvent()
- *  To be runned when an event is crossed.
- *  Finds the event and returns a state immediately after the event
+/** integrateTo()
+ *  Run cgsl_step_to up to t without looking at event indicators
  *
  *  @param sim The simulation
+ *  @param t End time
  */
-void ModelExchangeStepper::stepToEvent(cgsl_simulation &sim){
-    double tol = 1e-9;
-    get_storage().print(states);
-    while(!hasStateEvent(sim) &&
-            !(get_storage().absmin(STORAGE::indicators) < tol || timeLoop.dt_new < tol)){
-        getGoldenNewTime(sim);
-        step(sim);
-        if(timeLoop.dt_new == 0){
-            debug("stepToEvent: dt == 0, abort\n");
-            exit(1);
-        }
-        if(hasStateEvent(sim)){
-            // step back to where event occured
-            restoreStates(sim);
-            getSafeAndCrossed();
-            timeLoop.dt_new = timeLoop.t_safe - sim.t;
-            step(sim);
-            if(!hasStateEvent(sim)) storeStates(sim);
-            else{
-                debug("stepToEvent: failed at stepping to safe time, aborting\n");
-                exit(1);
-            }
-            timeLoop.dt_new = timeLoop.t_crossed - sim.t;
-            step(sim);
-            if(!hasStateEvent(sim)){
-                cerr << "stepToEvent: failed at stepping to event " << endl;
-                exit(1);
-            }
-        }
+void ModelExchangeStepper::integrateTo(cgsl_simulation &sim, double t){
+    fmu_parameters *p = get_p(sim);
+    p->stateEvent = false;
+    // fmu_function() only gets indicators past t_ok
+    p->t_ok = t;
+
+    cgsl_step_to(&sim, sim.t, t - sim.t);
+}
+
+/** locateEvent()
+ *  To be run with the simulation restored to before the step that crossed an event.
+ *  Leaves the simulation immediately after the first event in [sim.t, p->timeLoop.t_crossed]
+ *
+ *  @param sim The simulation
+ *  @return false if there turned out to be no event at p->timeLoop.t_crossed
+ */
+bool ModelExchangeStepper::locateEvent(cgsl_simulation &sim){
+    fmu_parameters *p = get_p(sim);
+    double ta, tb;
+    fmigo::EventLocator::evaluator f = [p](double t, const double *x, double *dxdt, std::vector<double>& g){
+        evaluate(p, t, x, dxdt, true);
+        getIndicators(p, g);
+    };
+
+    // both ends of the step, by integrating across it once
+    p->locator.start(f, sim.model->n_variables, sim.t, sim.model->x);
+    integrateTo(sim, p->timeLoop.t_crossed);
+
+    if(!p->locator.locate(f, p->timeLoop.t_crossed, sim.model->x, 1e-9, ta, tb)){
+        // only some stage inside the step saw the event
+        p->stateEvent = false;
+        return false;
     }
+
+    // integrate once more, to just past the event, and leave the FMUs there
+    p->fm.resize(sim.model->n_variables);
+    restoreStates(sim);
+    integrateTo(sim, tb);
+    evaluate(p, tb, sim.model->x, p->fm.data(), true);
+
+    p->stateEvent = true;
+    p->timeLoop.t_safe = ta;
+    p->timeLoop.t_crossed = tb;
+    return true;
 }
 
 /** newDiscreteStates()
  *  Should be used where a new discrete state ends and another begins.
  *  Store the current state of the simulation
  */
-void ModelExchangeStepper::newDiscreteStates(){
-    fmu_parameters* p = get_p(m_sim);
-    // start at a new state
-    p->FMIGO_ME_ENTER_EVENT_MODE(me_clients);
-    // todo loop until newDiscreteStatesNeeded == false
-    bool newDiscreteStatesNeeded = true;
-
-    while(newDiscreteStatesNeeded){
-        newDiscreteStatesNeeded = false;
-        p->FMIGO_ME_NEW_DISCRETE_STATES(me_clients);
-        for(auto client: me_clients){
-            if (client->m_event_info.newDiscreteStatesNeeded) {
-                newDiscreteStatesNeeded = true;
-            }
-            if(client->m_event_info.terminateSimulation){
-                debug("modelExchange.cpp: client %d terminated simulation\n",client->m_id);
-                exit(1);
-            }
+void ModelExchangeStepper::newDiscreteStates(cgsl_simulation &sim){
+    fmu_parameters* p = get_p(sim);
+    // start at a new state. the servers iterate newDiscreteStates() themselves and
+    // reply with the states, nominals and event indicators they end up with
+    for(auto client: p->clients)
+        p->FMIGO_ME_HANDLE_EVENT(client);
+    p->FMIGO_ME_WAIT();
+
+    for(auto client: p->clients){
+        if(client->m_event_info.terminateSimulation){
+            debug("modelExchange.cpp: client %d terminated simulation\n",client->m_id);
+            exit(1);
         }
     }
 
-    p->FMIGO_ME_ENTER_CONTINUOUS_TIME_MODE(me_clients);
-
-    for(auto client: me_clients)
-        p->FMIGO_ME_GET_EVENT_INDICATORS(client);
-
-    wait();
-
     // store the current state of all running FMUs
-    storeStates(m_sim);
+    storeStates(sim, false);
 }
 
 /** getSafeAndCrossed()
  *  Extracts safe and crossed time found by fmu_function
  */
-void ModelExchangeStepper::getSafeAndCrossed(){
-    fmu_parameters *p = get_p(m_sim);
-    timeLoop.t_safe    = p->t_ok;//max( timeLoop.t_safe,    t_ok);
-    timeLoop.t_crossed = p->t_past;//min( timeLoop.t_crossed, t_past);
+void ModelExchangeStepper::getSafeAndCrossed(cgsl_simulation &sim){
+    fmu_parameters *p = get_p(sim);
+    p->timeLoop.t_safe    = p->t_ok;//max( timeLoop.t_safe,    t_ok);
+    p->timeLoop.t_crossed = p->t_past;//min( timeLoop.t_crossed, t_past);
 }
 
 /** safeTimeStep()
@@ -448,12 +687,16 @@ void ModelExchangeStepper::getSafeAndCrossed(){
  *  @param sim The simulation
  */
 void ModelExchangeStepper::safeTimeStep(cgsl_simulation &sim){
+    fmu_parameters *p = get_p(sim);
     // if sims has a state event do not step to far
     if(hasStateEvent(sim)){
-        double absmin = get_storage().absmin(STORAGE::indicators);
-        timeLoop.dt_new = sim.h * (absmin > 0 ? absmin:0.00001);
+        double absmin = INFINITY;
+        for(auto client: p->clients)
+            if(client->getNumEventIndicators())
+                absmin = min(absmin, get_storage().absmin(STORAGE::indicators, client->m_id));
+        p->timeLoop.dt_new = sim.h * (absmin > 0 && absmin < INFINITY ? absmin:0.00001);
     }else
-        timeLoop.dt_new = timeLoop.t_end - sim.t;
+        p->timeLoop.dt_new = p->timeLoop.t_end - sim.t;
 }
 
 /** getSafeTime()
@@ -468,54 +711,105 @@ void ModelExchangeStepper::getSafeTime(const std::vector<FMIClient*> clients, do
             dt = min(dt, client->m_event_info.nextEventTime - t);
 }
 
-/** solveME()
+/** meWait()
+ *  Rendezvous of the group threads. The last group to get here does the wait()
+ */
+void ModelExchangeStepper::meWait() {
+    if(!m_threaded){
+        wait();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_waitMutex);
+    unsigned round = m_round;
+    if(++m_waiting == m_running){
+        wait();
+        m_waiting = 0;
+        m_round++;
+        m_waitCond.notify_all();
+    } else
+        m_waitCond.wait(lock, [this, round]{ return m_round != round; });
+}
+
+/** groupDone()
+ *  Takes a finished group out of the rendezvous, doing the wait() for the rest if they are all waiting on it
+ */
+void ModelExchangeStepper::groupDone() {
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    if(--m_running > 0 && m_waiting == m_running){
+        wait();
+        m_waiting = 0;
+        m_round++;
+        m_waitCond.notify_all();
+    }
+}
+
+/** solveGroup()
+ *  @param sim The simulation of the group
  *  @param t The current time
  *  @param dt The timestep to be taken
  */
-void ModelExchangeStepper::solveME(double t, double dt) {
-    if (me_clients.size() == 0)
-        return;
+void ModelExchangeStepper::solveGroup(cgsl_simulation &sim, double t, double dt) {
+    fmu_parameters *p = get_p(sim);
+    TimeLoop &timeLoop = p->timeLoop;
 
     timeLoop.t_safe = t;
     timeLoop.t_end = t + dt;
     timeLoop.dt_new = dt;
-    getSafeTime(me_clients, t, timeLoop.dt_new);
-    get_p(m_sim)->sim_started = true;
-    newDiscreteStates();
-    int iter = 2;
+    getSafeTime(p->clients, t, timeLoop.dt_new);
+    p->sim_started = true;
+    newDiscreteStates(sim);
     while( timeLoop.t_safe < timeLoop.t_end ){
-        step(m_sim);
-        if (hasStateEvent(m_sim)){
-            getSafeAndCrossed();
-
-            // restore and step to before the event
-            restoreStates(m_sim);
-            timeLoop.dt_new = timeLoop.t_safe - m_sim.t;
-            step(m_sim);
-
-            // store and step to the event
-            if(!hasStateEvent(m_sim)) storeStates(m_sim);
-            timeLoop.dt_new = timeLoop.t_crossed - m_sim.t;
-            step(m_sim);
-
-            // step closer to the event location
-            if(hasStateEvent(m_sim))
-                {
-                    debug("stepToEvent\n");
-                stepToEvent(m_sim);
-                    debug("stepToEvent done\n");
-                }
+        step(sim);
+        if (hasStateEvent(sim)){
+            getSafeAndCrossed(sim);
 
+            // restore and find the event
+            restoreStates(sim);
+            if(!locateEvent(sim)){
+                timeLoop.t_safe = sim.t;
+                timeLoop.t_crossed = timeLoop.t_end;
+            }
         }
         else {
-            timeLoop.t_safe = m_sim.t;
+            timeLoop.t_safe = sim.t;
             timeLoop.t_crossed = timeLoop.t_end;
         }
 
-        safeTimeStep(m_sim);
-        if(hasStateEvent(m_sim))
-            newDiscreteStates();
-        storeStates(m_sim);
+        safeTimeStep(sim);
+        if(hasStateEvent(sim))
+            newDiscreteStates(sim);
+        storeStates(sim);
     }
 }
+
+/** solveME()
+ *  Each group takes its own steps and handles its own events,
+ *  they only meet at t+dt
+ *
+ *  @param t The current time
+ *  @param dt The timestep to be taken
+ */
+void ModelExchangeStepper::solveME(double t, double dt) {
+    if (m_groups.size() == 0)
+        return;
+
+    if (!m_concurrent) {
+        for (size_t g = 0; g < m_sims.size(); g++)
+            solveGroup(m_sims[g], t, dt);
+        return;
+    }
+
+    m_running = m_sims.size();
+    m_waiting = 0;
+    m_threaded = true;
+
+    // group 0 runs on this thread
+    m_groupThreads.run([this, t, dt](size_t g){
+        solveGroup(m_sims[g], t, dt);
+        groupDone();
+    });
+
+    m_threaded = false;
+}
 #endif
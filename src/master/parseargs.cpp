@@ -449,7 +449,10 @@ void fmitcp_master::parseArguments( int argc,
                     fmigo_csv_fmu *csv_fmu,
                     int* maxSamples,
                     double *relaxation,
-                    bool *writeSolverFields
+                    bool *writeSolverFields,
+                    kinematicsolver *kinematicSolver,
+                    std::map<int,int> *meIntegrators,
+                    int *meIntegrator
  ) {
     int index, c;
     opterr = 0;
@@ -472,7 +475,7 @@ void fmitcp_master::parseArguments( int argc,
 
     vector<char*> argv2 = make_char_vector(argvstore);
 
-    while ((c = getopt (argv2.size(), argv2.data(), "rl:ht:c:d:o:p:f:m:g:w:C:5:F:NM:a:z:ZLHV:DeS:G:RE")) != -1){
+    while ((c = getopt (argv2.size(), argv2.data(), "rl:ht:c:d:o:p:f:m:g:w:C:5:F:NM:a:z:ZLHV:DeS:G:REK:j:Y:P:I:i:")) != -1){
         int n, skip, l, cont, i, numScanned, stop, vis;
         deque<string> parts;
         if (optarg) parts = escapeSplit(optarg, ':');
@@ -776,6 +779,13 @@ void fmitcp_master::parseArguments( int argc,
             alwaysComputeNumericalDirectionalDerivatives = true;
             break;
 
+        case 'P':
+            numPerturbationClones = atoi(optarg);
+            if (numPerturbationClones < 0) {
+                fatal("-P: number of clones must be non-negative (got %s)\n", optarg);
+            }
+            break;
+
         case 'e':
 #ifdef USE_MPI
             printf("USE_MPI=1\n");
@@ -798,6 +808,68 @@ void fmitcp_master::parseArguments( int argc,
             *writeSolverFields = true;
             break;
 
+        case 'K':
+            if (parts.size() < 1 || parts.size() > 3) {
+                fatal("-K must have one to three parts (got %s which has %li parts)\n", optarg, parts.size());
+            }
+            if (parts[0] != "direct" && parts[0] != "pcg" && parts[0] != "gs") {
+                fatal("Unknown kinematic solver \"%s\", expected direct, pcg or gs\n", parts[0].c_str());
+            }
+            kinematicSolver->method = parts[0];
+            if (parts.size() > 1) {
+                kinematicSolver->tolerance = atof(parts[1].c_str());
+            }
+            if (parts.size() > 2) {
+                kinematicSolver->maxIterations = atoi(parts[2].c_str());
+            }
+            break;
+
+        case 'Y':
+            for (auto it = parts.begin(); it != parts.end(); it++) {
+                deque<string> values = escapeSplit(*it, ',');
+                if (values.size() < 2 || values.size() > 3) {
+                    fatal("-Y expects FMU,PERIOD[,TOLERANCE] (got %s)\n", it->c_str());
+                }
+                mobilitycaching mc;
+                mc.period = atoi(values[1].c_str());
+                mc.tolerance = values.size() > 2 ? atof(values[2].c_str()) : 0;
+                if (mc.period < 1) {
+                    fatal("-Y: PERIOD must be at least 1 (got %s)\n", it->c_str());
+                }
+                kinematicSolver->mobilityCaching[atoi(values[0].c_str())] = mc;
+            }
+            break;
+
+        case 'I':
+            for (auto it = parts.begin(); it != parts.end(); it++) {
+                deque<string> values = escapeSplit(*it, ',');
+                if (values.size() < 1 || values.size() > 2) {
+                    fatal("-I expects FMU[,INTEGRATOR] (got %s)\n", it->c_str());
+                }
+                //rk8pd by default, same as the ME wrapper
+                int integrator = values.size() > 1 ? atoi(values[1].c_str()) : 4;
+                //the implicit integrators need a Jacobian, which the server doesn't provide
+                if (integrator < 0 || (integrator > 4 && integrator != 9)) {
+                    fatal("-I: INTEGRATOR must be 0-4 or 9 (got %s)\n", it->c_str());
+                }
+                (*meIntegrators)[atoi(values[0].c_str())] = integrator;
+            }
+            break;
+
+        case 'i':
+            *meIntegrator = atoi(optarg);
+            if (*meIntegrator < 0 || *meIntegrator > 10) {
+                fatal("-i: INTEGRATOR must be 0-10 (got %s)\n", optarg);
+            }
+            break;
+
+        case 'j':
+            kinematicSolver->threads = atoi(optarg);
+            if (kinematicSolver->threads < 1) {
+                fatal("-j must be at least 1 (got %s)\n", optarg);
+            }
+            break;
+
         default:
             fatal("abort %c...\n",c);
         }
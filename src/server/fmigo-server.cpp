@@ -16,6 +16,7 @@ using namespace fmitcp;
 
 jm_log_level_enu_t fmigo_loglevel = jm_log_level_warning;
 bool alwaysComputeNumericalDirectionalDerivatives = false;
+int numPerturbationClones = 0;
 
 static void handleMessage(zmq::socket_t& socket, FMIServer& server, int port) {
   zmq::message_t msg;
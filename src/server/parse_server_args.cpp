@@ -8,6 +8,11 @@ OPTIONS\n\
 \n\
 %s    -5 hdf5_filename\n\
         Dump outputs into HDF5 with given filename\n\
+    -D\n\
+        Always compute numerical directional derivatives, regardless of providesDirectionalDerivatives\n\
+    -P clones\n\
+        Compute numerical directional derivatives in parallel on this many extra instances of the FMU.\n\
+        Requires canBeInstantiatedOnlyOncePerProcess=\"false\" and canSerializeFMUstate=\"true\"\n\
     --help\n\
         You're looking at it.\n\
 \n\
@@ -56,6 +61,12 @@ static void parse_server_args(int argc, char **argv, string *fmuPath,
     } else if (arg == "-D") {
       info("Always computing numerical directional derivatives, regardless of providesDirectionalDerivatives\n");
       alwaysComputeNumericalDirectionalDerivatives = true;
+    } else if (arg == "-P" && !last) {
+      numPerturbationClones = atoi(argv[++j]);
+      if (numPerturbationClones < 0) {
+        fprintf(stderr,"Invalid number of clones.\n");
+        exit(EXIT_FAILURE);
+      }
     } else {
       *fmuPath = argv[j];
     }
@@ -0,0 +1,127 @@
+/*
+ * Micro-benchmarks for fmigo_storage::FmigoStorage, following the access
+ * pattern of ModelExchangeStepper. No FMUs involved. Results are printed as CSV on STDOUT.
+ */
+#include "common/fmigo_storage.h"
+#include "common/common.h"
+#include <vector>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+jm_log_level_enu_t fmigo_loglevel = jm_log_level_warning;
+
+using namespace fmigo_storage;
+
+void printHelp(char * command){
+    printf("\nUsage:\n\
+\t%s [OPTIONS]\
+\n\
+\n\
+[OPTIONS]\n\
+\n\
+\t--maxClients <integer>\tLargest number of FMUs. Default 256.\n\
+\t--states     <integer>\tContinuous states per FMU. Default 8.\n\
+\t--indicators <integer>\tEvent indicators per FMU. Default 2.\n\
+\t--reps       <integer>\tNumber of repetitions to time per size. Default 10000.\n\
+\t--help,-h            \tPrint help and quit.\n\
+\n\
+Prints CSV: clients,rhs_ns,store_ns,restore_ns,cycle_ns\n\
+rhs_ns is one RHS evaluation as done by fmu_function(): push_to() of derivatives and\n\
+indicators, get_current_derivatives() and past_event() for every FMU.\n\
+store_ns is storeStates(): push_to() and get_current_states() for every FMU, then sync().\n\
+restore_ns is restore() and get_current_states() for every FMU. cycle_ns is one cycle().\n\
+Clients are 1, 2, 4 ... --maxClients.\n\n",command);
+}
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double ns(Clock::time_point a, Clock::time_point b, int reps){
+    return std::chrono::duration<double, std::nano>(b - a).count() / reps;
+}
+
+static void bench(size_t clients, size_t nx, size_t nz, int reps){
+    FmigoStorage storage(std::vector<size_t>(clients, nx), std::vector<size_t>(clients, nz));
+    std::vector<double> x(clients * nx), dxdt(clients * nx);
+    Data dx(nx, 1), z(nz, 1);
+    double sink = 0;
+
+    Clock::time_point t0 = Clock::now();
+    for (int r = 0; r < reps; r++) {
+        for (size_t id = 0; id < clients; id++) {
+            dx[0] = r;
+            storage.push_to(id, STORAGE::derivatives, dx);
+            storage.push_to(id, STORAGE::indicators, z);
+        }
+        for (size_t id = 0; id < clients; id++) {
+            storage.get_current_derivatives(dxdt.data(), id);
+            sink += storage.past_event(id);
+        }
+    }
+    Clock::time_point t1 = Clock::now();
+    for (int r = 0; r < reps; r++) {
+        for (size_t id = 0; id < clients; id++) {
+            storage.push_to(id, STORAGE::states, dx.data());
+            storage.get_current_states(x.data(), id);
+        }
+        storage.sync();
+    }
+    Clock::time_point t2 = Clock::now();
+    for (int r = 0; r < reps; r++) {
+        storage.restore();
+        for (size_t id = 0; id < clients; id++) {
+            storage.get_current_states(x.data(), id);
+        }
+    }
+    Clock::time_point t3 = Clock::now();
+    for (int r = 0; r < reps; r++) {
+        storage.cycle();
+    }
+    Clock::time_point t4 = Clock::now();
+
+    sink += dxdt[0] + x[0] + storage.get_current_states()[0];
+    printf("%zu,%f,%f,%f,%f\n", clients, ns(t0, t1, reps), ns(t1, t2, reps),
+           ns(t2, t3, reps), ns(t3, t4, reps));
+
+    //keeps the loops from being optimized away
+    if (sink == -1) {
+        fprintf(stderr, "%f\n", sink);
+    }
+}
+
+int main(int argc, char ** argv){
+    int maxClients = 256,
+        states = 8,
+        indicators = 2,
+        reps = 10000;
+
+    for (int i = 0; i < argc; ++i){
+        char * a = argv[i];
+        int last = (i == argc-1);
+
+        if(!last){
+            if(!strcmp(a,"--maxClients")) maxClients = atoi(argv[i+1]);
+            if(!strcmp(a,"--states"))     states = atoi(argv[i+1]);
+            if(!strcmp(a,"--indicators")) indicators = atoi(argv[i+1]);
+            if(!strcmp(a,"--reps"))       reps = atoi(argv[i+1]);
+        }
+
+        if(strcmp(argv[i],"--help")==0 || strcmp(argv[i],"-h")==0){
+            printHelp(argv[0]);
+            return 0;
+        }
+    }
+
+    if (maxClients < 1 || states < 1 || indicators < 0 || reps < 1) {
+        fprintf(stderr, "--maxClients, --states and --reps must be positive\n");
+        return 1;
+    }
+
+    printf("clients,rhs_ns,store_ns,restore_ns,cycle_ns\n");
+    for (int n = 1; n <= maxClients; n *= 2) {
+        bench(n, states, indicators, reps);
+    }
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+set -e
+
+pushd ../../..
+source boilerplate.sh
+popd
+
+# The kinematic truck, with every server computing numerical directional derivatives (-D)
+# on $1 extra instances of its FMU (-P). Output goes to $2
+run() {
+  URIS=
+  PORT=3100
+  for f in engine gearbox2 body
+  do
+    fmigo-server -p $PORT -D -P $1 ${FMUS_DIR}/kinematictruck/$f/$f.fmu &
+    URIS="$URIS tcp://localhost:$PORT"
+    PORT=$((PORT + 1))
+  done
+
+  fmigo-master -t 1 -d 0.01 -p 0,8,20 -C shaft,0,1,0,1,2,3,0,1,2,3 -C shaft,1,2,6,7,8,9,0,1,2,3 -c 2,1,0,6 $URIS > $2
+  wait
+}
+
+# Perturbing the clones must give the same results as perturbing the FMU itself
+run 0 serial.csv
+run 2 clones.csv
+python3 $COMPARE_CSV serial.csv clones.csv
+rm serial.csv clones.csv
+echo Clones ok
@@ -13,9 +13,26 @@ ${MPIEXEC} -np 3 fmigo-mpi -t 12 -p r,1,11,1 -c 0,x0,1,x_in ${FMUS_DIR}/me/sprin
 python3 $COMPARE_CSV result tests/springs.txt
 echo Springs ok
 
+# msbdf, so the Jacobian is colored from ModelStructure/Derivatives and the connection between the FMUs
+${MPIEXEC} -np 3 fmigo-mpi -i 10 -t 12 -p r,1,11,1 -c 0,x0,1,x_in ${FMUS_DIR}/me/springs/springs.fmu ${FMUS_DIR}/me/springs/springs.fmu > result
+python3 $COMPARE_CSV result tests/springs.txt
+echo Springs -i 10 ok
+
 ${MPIEXEC} -np 2 fmigo-mpi -p 0,v1,10:0,k_internal,1:0,k1,1 ${FMUS_DIR}/me/springs2/springs2.fmu > result
 python3 $COMPARE_CSV result tests/springs2.csv
 echo Springs2 ok
 
+# Same again, integrated on the server with its default integrator (rk8pd) and with msadams
+for I in 0 0,9
+do
+  ${MPIEXEC} -np 2 fmigo-mpi -I $I -t 1.5 ${FMUS_DIR}/me/bouncingBall/bouncingBall.fmu > result
+  python3 $COMPARE_CSV result tests/bouncingBall.csv
+  echo Bouncing Ball -I $I ok
+
+  ${MPIEXEC} -np 2 fmigo-mpi -I $I -p 0,v1,10:0,k_internal,1:0,k1,1 ${FMUS_DIR}/me/springs2/springs2.fmu > result
+  python3 $COMPARE_CSV result tests/springs2.csv
+  echo Springs2 -I $I ok
+done
+
 echo ModelExchange ok
 rm result
@@ -12,6 +12,54 @@ static int sine(double t, const double y[], double dydt[], void * params) {
     return GSL_SUCCESS;
 }
 
+//same as sine() for every member, with member m oscillating at omega[m]
+static int sines(int members, int n, const double t[], const double y[], double dydt[], const char active[], void * params) {
+    const double *omega = (const double*)params;
+    int m;
+
+    for (m = 0; m < members; m++) {
+        dydt[m]           = y[members + m];
+        dydt[members + m] = -omega[m]*omega[m]*y[m];
+    }
+
+    return GSL_SUCCESS;
+}
+
+//integrates an ensemble of oscillators to t = 2 pi and checks it against the exact solution
+static int ensemble(enum cgsl_ensemble_modes mode) {
+    enum { N = 16 };
+    double x0[2*N], omega[N], err = 0;
+    int m;
+
+    for (m = 0; m < N; m++) {
+        omega[m] = 1 + m / (double)N;
+        x0[m]     = 1;
+        x0[N + m] = 0;
+    }
+
+    cgsl_ensemble *e = cgsl_ensemble_alloc(N, 2, x0, omega, sines, mode, rkck, 1e-3, 1e-8, 1e-8);
+
+    double t = 0;
+    double dt = M_PI/10;
+    int evaluations = 0;
+    for (; t < 2*M_PI; t += dt) {
+        cgsl_ensemble_step_to(e, t, dt);
+        evaluations += e->iterations;
+    }
+
+    for (m = 0; m < N; m++) {
+        double x[2];
+        cgsl_ensemble_get_member(e, m, x);
+        err = fmax(err, fabs(x[0] - cos(omega[m]*t)));
+    }
+
+    cgsl_ensemble_free(e);
+
+    printf("ensemble %s: %d batched evaluations, max error %g\n",
+           mode == CGSL_ENSEMBLE_LOCKSTEP ? "lock-step" : "per-member", evaluations, err);
+    return err > 1e-5;
+}
+
 int main(void) {
     double x0[2] = {1, 0};
 
@@ -29,5 +77,5 @@ int main(void) {
 
     cgsl_free_simulation(sim);
 
-    return 0;
+    return ensemble(CGSL_ENSEMBLE_LOCKSTEP) | ensemble(CGSL_ENSEMBLE_PER_MEMBER);
 }
@@ -225,6 +225,94 @@ void cgsl_simulation_set_variable_step( cgsl_simulation * s );
 void cgsl_simulation_get( cgsl_simulation *s );
 void cgsl_simulation_set( cgsl_simulation *s );
 
+/*****************************
+ * Ensembles
+ *****************************
+ */
+
+/**
+ * Right hand side of a whole ensemble of same-shaped systems, evaluated in one call.
+ * members: Number of members N
+ *       n: Variables per member
+ *       t: Time of each member. All equal in lock-step mode
+ *    y, dydt: N*n values laid out SoA: variable i of member m is at [i*members + m]
+ *  active: Non-zero for the members that need dydt, or NULL if all of them do.
+ *          dydt of inactive members is ignored and may be left as is
+ *  params: Opaque pointer
+ */
+typedef int (* ode_ensemble_function_ptr ) (int members, int n, const double t[], const double y[],
+                                            double dydt[], const char active[], void * params);
+
+enum cgsl_ensemble_modes{
+  CGSL_ENSEMBLE_LOCKSTEP,       /* one gsl integrator over all members, shared error norm and step */
+  CGSL_ENSEMBLE_PER_MEMBER      /* Cash-Karp with error norm, step size and time kept per member */
+};
+
+/**
+ * N instances of the same system driven by one integrator, for fleet and
+ * Monte-Carlo studies. Every right hand side evaluation covers all members
+ * that need one, so the user can dispatch it as a single batched request.
+ *
+ * In lock-step mode the ensemble is handed to gsl as one system of size N*n,
+ * so any explicit cgsl_integrator_ids can be used. Implicit ones need a
+ * Jacobian, which ensembles don't provide.
+ *
+ * In per-member mode each member takes its own steps. Stages of members at
+ * different times still share each evaluation, with t[] telling them apart.
+ */
+typedef struct cgsl_ensemble{
+  int members;
+  int n_variables;              /** per member */
+  enum cgsl_ensemble_modes mode;
+  double *x;                    /** state variables, SoA */
+  double *x_backup;             /** for get/set FMU state */
+  void * parameters;
+  ode_ensemble_function_ptr function;
+
+  double *t;                    /** current time of each member */
+  double *h;                    /** current step size of each member */
+  double t1;                    /** stop time */
+  double reltol, abstol;
+  int iterations;               /** Number of batched evaluations done by last call to cgsl_ensemble_step_to() */
+
+  /* lock-step */
+  cgsl_integrator i;
+
+  /* per-member scratch. ts is also used by lock-step */
+  double *k[6], *ytmp, *ts, *hs, *rmax;
+  char *active, *stale;
+} cgsl_ensemble;
+
+/**
+ * Allocates an ensemble of members instances of an n_variables system.
+ * x0 holds the initial values SoA, or NULL for all zeroes.
+ * integrator is only used in lock-step mode.
+ */
+cgsl_ensemble * cgsl_ensemble_alloc(
+        int members,
+        int n_variables,
+        const double *x0,
+        void *parameters,
+        ode_ensemble_function_ptr function,
+        enum cgsl_ensemble_modes mode,
+        enum cgsl_integrator_ids integrator,
+        double h,                    /** Initial time-step, used by all members */
+        double reltol, double abstol
+  );
+
+void cgsl_ensemble_free( cgsl_ensemble * e );
+
+/**  Step all members from comm_point to comm_point + comm_step. */
+int cgsl_ensemble_step_to( cgsl_ensemble * e, double comm_point, double comm_step );
+
+/** Gather/scatter the n_variables states of one member */
+void cgsl_ensemble_get_member( const cgsl_ensemble * e, int member, double *x );
+void cgsl_ensemble_set_member( cgsl_ensemble * e, int member, const double *x );
+
+/** Get/set FMU state */
+void cgsl_ensemble_get( cgsl_ensemble * e );
+void cgsl_ensemble_set( cgsl_ensemble * e );
+
 #ifdef __cplusplus
 }
 #endif
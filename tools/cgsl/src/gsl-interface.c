@@ -1,5 +1,6 @@
 #include "gsl-interface.h"
 #include <string.h>
+#include <math.h>
 
 #ifdef WIN32
 //This fixes linking on MSVC14
@@ -346,3 +347,318 @@ void cgsl_simulation_set( cgsl_simulation *s ) {
     cgsl_model_default_set_state(s->model);
   }
 }
+
+
+/*****************************
+ * Ensembles
+ *****************************
+ */
+
+/** Hands a lock-step ensemble to gsl as one system of size members * n_variables */
+static int cgsl_ensemble_lockstep_function(double t, const double y[], double dydt[], void * params) {
+
+  cgsl_ensemble * e = ( cgsl_ensemble * ) params;
+  int m;
+
+  for ( m = 0; m < e->members; ++m ){
+    e->ts[ m ] = t;
+  }
+  e->iterations++;
+
+  return e->function(e->members, e->n_variables, e->ts, y, dydt, NULL, e->parameters);
+}
+
+cgsl_ensemble * cgsl_ensemble_alloc(int members, int n_variables, const double *x0, void *parameters,
+        ode_ensemble_function_ptr function, enum cgsl_ensemble_modes mode,
+        enum cgsl_integrator_ids integrator, double h, double reltol, double abstol) {
+
+  cgsl_ensemble * e = ( cgsl_ensemble * ) calloc( 1, sizeof(cgsl_ensemble) );
+  int N = members * n_variables;
+  int m, j;
+
+  e->members     = members;
+  e->n_variables = n_variables;
+  e->mode        = mode;
+  e->x           = ( double * ) calloc( N, sizeof(double) );
+  e->x_backup    = ( double * ) calloc( N, sizeof(double) );
+  e->parameters  = parameters;
+  e->function    = function;
+  e->t           = ( double * ) calloc( members, sizeof(double) );
+  e->h           = ( double * ) calloc( members, sizeof(double) );
+  e->ts          = ( double * ) calloc( members, sizeof(double) );
+  e->reltol      = reltol;
+  e->abstol      = abstol;
+
+  if (x0) {
+    memcpy(e->x, x0, N * sizeof(double));
+  }
+
+  for ( m = 0; m < members; ++m ){
+    e->h[ m ] = h;
+  }
+
+  if ( mode == CGSL_ENSEMBLE_LOCKSTEP ) {
+    if ( integrator > rk8pd ) {
+      fprintf(stderr, "Ensembles need an explicit integrator, not %i.  Defaulting to RKF45.\n", integrator);
+      integrator = rkf45;
+    }
+    e->i.step_type        = cgsl_get_integrator( integrator );
+    e->i.control          = gsl_odeiv2_control_y_new( abstol, reltol );
+    e->i.system.function  = cgsl_ensemble_lockstep_function;
+    e->i.system.jacobian  = NULL;
+    e->i.system.dimension = N;
+    e->i.system.params    = ( void * ) e;
+    e->i.evolution        = gsl_odeiv2_evolve_alloc( N );
+    e->i.step             = gsl_odeiv2_step_alloc( e->i.step_type, N );
+  } else {
+    for ( j = 0; j < 6; ++j ){
+      e->k[ j ] = ( double * ) calloc( N, sizeof(double) );
+    }
+    e->ytmp   = ( double * ) calloc( N, sizeof(double) );
+    e->hs     = ( double * ) calloc( members, sizeof(double) );
+    e->rmax   = ( double * ) calloc( members, sizeof(double) );
+    e->active = ( char * ) calloc( members, 1 );
+    e->stale  = ( char * ) malloc( members );
+    memset(e->stale, 1, members);
+  }
+
+  return e;
+
+}
+
+void cgsl_ensemble_free( cgsl_ensemble * e ) {
+
+  int j;
+
+  if ( e->mode == CGSL_ENSEMBLE_LOCKSTEP ) {
+    gsl_odeiv2_step_free    (e->i.step);
+    gsl_odeiv2_evolve_free  (e->i.evolution);
+    gsl_odeiv2_control_free (e->i.control);
+  } else {
+    for ( j = 0; j < 6; ++j ){
+      free(e->k[ j ]);
+    }
+    free(e->ytmp);
+    free(e->hs);
+    free(e->rmax);
+    free(e->active);
+    free(e->stale);
+  }
+
+  free(e->x);
+  free(e->x_backup);
+  free(e->t);
+  free(e->h);
+  free(e->ts);
+  free(e);
+
+}
+
+static int cgsl_ensemble_step_lockstep( cgsl_ensemble * e ) {
+
+  double t = e->t[ 0 ];
+  double h = e->h[ 0 ];
+  int m;
+
+  while ( t < e->t1 ) {
+    int status = gsl_odeiv2_evolve_apply(e->i.evolution, e->i.control, e->i.step, &e->i.system, &t, e->t1, &h, e->x);
+    if (status != GSL_SUCCESS ){
+      fprintf(stderr, "GSL integrator: bad status: %d \n", status);
+      exit(-1);
+    }
+  }
+
+  for ( m = 0; m < e->members; ++m ){
+    e->t[ m ] = t;
+    e->h[ m ] = h;
+  }
+
+  return 0;
+
+}
+
+/* Cash-Karp tableau, same as gsl_odeiv2_step_rkck */
+static const double ck_c[6] = { 0, 1.0/5, 3.0/10, 3.0/5, 1, 7.0/8 };
+static const double ck_a[6][5] = {
+  { 0 },
+  { 1.0/5 },
+  { 3.0/40, 9.0/40 },
+  { 3.0/10, -9.0/10, 6.0/5 },
+  { -11.0/54, 5.0/2, -70.0/27, 35.0/27 },
+  { 1631.0/55296, 175.0/512, 575.0/13824, 44275.0/110592, 253.0/4096 }
+};
+static const double ck_b[6] = { 37.0/378, 0, 250.0/621, 125.0/594, 0, 512.0/1771 };
+static const double ck_e[6] = {
+  37.0/378 - 2825.0/27648, 0, 250.0/621 - 18575.0/48384,
+  125.0/594 - 13525.0/55296, -277.0/14336, 512.0/1771 - 1.0/4
+};
+
+static int cgsl_ensemble_eval( cgsl_ensemble * e, const double y[], double dydt[], const char active[] ) {
+
+  int status = e->function(e->members, e->n_variables, e->ts, y, dydt, active, e->parameters);
+  e->iterations++;
+
+  if (status != GSL_SUCCESS ){
+    fprintf(stderr, "cgsl ensemble: bad status: %d \n", status);
+    exit(-1);
+  }
+  return status;
+
+}
+
+/**
+ * One Cash-Karp attempt for every member that hasn't reached t1, each with
+ * its own step. Returns the number of members that were still active.
+ * Error control is that of gsl_odeiv2_control_y with the ensemble tolerances.
+ */
+static int cgsl_ensemble_step_per_member( cgsl_ensemble * e ) {
+
+  int M = e->members, n = e->n_variables;
+  int i, j, m, s, stale = 0, active = 0;
+
+  for ( m = 0; m < M; ++m ){
+    double left = e->t1 - e->t[ m ];
+    e->active[ m ] = left > 0;
+    /* the step actually attempted, clipped to t1 */
+    e->hs[ m ]     = e->active[ m ] ? (e->h[ m ] < left ? e->h[ m ] : left) : 0;
+    e->stale[ m ]  = e->stale[ m ] && e->active[ m ];
+    e->ts[ m ]     = e->t[ m ];
+    e->rmax[ m ]   = 0;
+    active += e->active[ m ];
+    stale  += e->stale[ m ];
+  }
+  if ( !active ) {
+    return 0;
+  }
+
+  /* k0 only changes when a step is accepted */
+  if ( stale ) {
+    cgsl_ensemble_eval(e, e->x, e->k[ 0 ], e->stale);
+    memset(e->stale, 0, M);
+  }
+
+  /* inactive members have hs = 0, so the loops can run over everyone */
+  for ( s = 1; s < 6; ++s ){
+    for ( m = 0; m < M; ++m ){
+      e->ts[ m ] = e->t[ m ] + ck_c[ s ] * e->hs[ m ];
+    }
+    for ( i = 0; i < n; ++i ){
+      for ( m = 0; m < M; ++m ){
+        double sum = 0;
+        for ( j = 0; j < s; ++j ){
+          sum += ck_a[ s ][ j ] * e->k[ j ][ i*M + m ];
+        }
+        e->ytmp[ i*M + m ] = e->x[ i*M + m ] + e->hs[ m ] * sum;
+      }
+    }
+    cgsl_ensemble_eval(e, e->ytmp, e->k[ s ], e->active);
+  }
+
+  /* fifth order solution into ytmp, worst error ratio of each member into rmax */
+  for ( i = 0; i < n; ++i ){
+    for ( m = 0; m < M; ++m ){
+      double y = 0, err = 0, r;
+      for ( j = 0; j < 6; ++j ){
+        y   += ck_b[ j ] * e->k[ j ][ i*M + m ];
+        err += ck_e[ j ] * e->k[ j ][ i*M + m ];
+      }
+      y = e->x[ i*M + m ] + e->hs[ m ] * y;
+      r = fabs(e->hs[ m ] * err) / (e->abstol + e->reltol * fabs(y));
+      e->ytmp[ i*M + m ] = y;
+      if ( r > e->rmax[ m ] ) {
+        e->rmax[ m ] = r;
+      }
+    }
+  }
+
+  for ( m = 0; m < M; ++m ){
+    if ( !e->active[ m ] ) {
+      continue;
+    }
+    if ( e->rmax[ m ] > 1.1 ) {
+      /* reject, retry with a smaller step */
+      double r = 0.9 / pow(e->rmax[ m ], 1.0/5);
+      e->h[ m ] = e->hs[ m ] * (r > 0.2 ? r : 0.2);
+      e->active[ m ] = 0;
+      if ( e->t[ m ] + e->h[ m ] == e->t[ m ] ) {
+        fprintf(stderr, "cgsl ensemble: step size underflow for member %i at t = %g\n", m, e->t[ m ]);
+        exit(-1);
+      }
+    } else {
+      /* don't let a step clipped by t1 shrink the step size */
+      if ( e->rmax[ m ] < 0.5 && e->hs[ m ] >= e->h[ m ] ) {
+        double r = 0.9 / pow(e->rmax[ m ], 1.0/6);
+        e->h[ m ] = e->hs[ m ] * (r < 1 ? 1 : (r > 5 ? 5 : r));
+      }
+      e->t[ m ] = e->hs[ m ] == e->t1 - e->t[ m ] ? e->t1 : e->t[ m ] + e->hs[ m ];
+      e->stale[ m ] = 1;
+    }
+  }
+
+  for ( i = 0; i < n; ++i ){
+    for ( m = 0; m < M; ++m ){
+      if ( e->active[ m ] ) {
+        e->x[ i*M + m ] = e->ytmp[ i*M + m ];
+      }
+    }
+  }
+
+  return active;
+
+}
+
+int cgsl_ensemble_step_to( cgsl_ensemble * e, double comm_point, double comm_step ) {
+
+  int m;
+
+  e->t1 = comm_point + comm_step;
+  e->iterations = 0;
+  for ( m = 0; m < e->members; ++m ){
+    e->t[ m ] = comm_point;
+  }
+
+  if ( e->mode == CGSL_ENSEMBLE_LOCKSTEP ) {
+    return cgsl_ensemble_step_lockstep( e );
+  }
+
+  /* comm_point may not be where the last call left off */
+  memset(e->stale, 1, e->members);
+
+  while ( cgsl_ensemble_step_per_member( e ) );
+
+  return 0;
+
+}
+
+void cgsl_ensemble_get_member( const cgsl_ensemble * e, int member, double *x ) {
+  int i;
+  for ( i = 0; i < e->n_variables; ++i ){
+    x[ i ] = e->x[ i * e->members + member ];
+  }
+}
+
+static void cgsl_ensemble_reset( cgsl_ensemble * e ) {
+  if ( e->mode == CGSL_ENSEMBLE_LOCKSTEP ) {
+    gsl_odeiv2_evolve_reset( e->i.evolution );
+    gsl_odeiv2_step_reset( e->i.step );
+  } else {
+    memset(e->stale, 1, e->members);
+  }
+}
+
+void cgsl_ensemble_set_member( cgsl_ensemble * e, int member, const double *x ) {
+  int i;
+  for ( i = 0; i < e->n_variables; ++i ){
+    e->x[ i * e->members + member ] = x[ i ];
+  }
+  cgsl_ensemble_reset( e );
+}
+
+void cgsl_ensemble_get( cgsl_ensemble * e ) {
+  memcpy(e->x_backup, e->x, e->members * e->n_variables * sizeof(e->x[0]));
+}
+
+void cgsl_ensemble_set( cgsl_ensemble * e ) {
+  memcpy(e->x, e->x_backup, e->members * e->n_variables * sizeof(e->x[0]));
+  cgsl_ensemble_reset( e );
+}
@@ -551,7 +551,13 @@ fmi2Status fmi2SetString (fmi2Component c, const fmi2ValueReference vr[], size_t
 fmi2Status fmi2GetFMUstate (fmi2Component c, fmi2FMUstate* FMUstate) {
 #if CAN_GET_SET_FMU_STATE
     ModelInstance *comp = (ModelInstance *)c;
-    *FMUstate = comp->functions->allocateMemory(1, sizeof(comp->s));
+    //FMI 2.0: if *FMUstate is a previously returned state then it is overwritten in place
+    if (*FMUstate == NULL) {
+        *FMUstate = comp->functions->allocateMemory(1, sizeof(comp->s));
+        if (*FMUstate == NULL) {
+            return fmi2Error;
+        }
+    }
 
 #ifdef SIMULATION_TYPE
 #ifndef SIMULATION_GET
@@ -592,23 +598,55 @@ fmi2Status fmi2FreeFMUstate(fmi2Component c, fmi2FMUstate* FMUstate) {
     return fmi2OK;
 }
 
+//serialization is a plain copy of the state, so serialized states are only good within the same process
+//GSL based FMUs keep pointers to per-instance buffers in their simulation struct, so they can't be serialized
+#if CAN_GET_SET_FMU_STATE && !defined(SIMULATION_TYPE)
+#define CAN_SERIALIZE_FMU_STATE 1
+#else
+#define CAN_SERIALIZE_FMU_STATE 0
+#endif
+
 fmi2Status fmi2SerializedFMUstateSize(fmi2Component c, fmi2FMUstate FMUstate, size_t *size) {
-    return fmi2Error; //disabled for now
-    //ModelInstance *comp = (ModelInstance *)c;
-    //*size = sizeof(comp->s);
-    //return fmi2OK;
+#if CAN_SERIALIZE_FMU_STATE
+    ModelInstance *comp = (ModelInstance *)c;
+    *size = sizeof(comp->s);
+    return fmi2OK;
+#else
+    return fmi2Error;
+#endif
 }
 
 fmi2Status fmi2SerializeFMUstate (fmi2Component c, fmi2FMUstate FMUstate, fmi2Byte serializedState[], size_t size) {
-    return fmi2Error; //disabled for now
-    //memcpy(serializedState, FMUstate, size);
-    //return fmi2OK;
+#if CAN_SERIALIZE_FMU_STATE
+    ModelInstance *comp = (ModelInstance *)c;
+    if (size != sizeof(comp->s)) {
+        return fmi2Error;
+    }
+    memcpy(serializedState, FMUstate, size);
+    return fmi2OK;
+#else
+    return fmi2Error;
+#endif
 }
 
 fmi2Status fmi2DeSerializeFMUstate (fmi2Component c, const fmi2Byte serializedState[], size_t size, fmi2FMUstate* FMUstate) {
-    return fmi2Error; //disabled for now
-    //memcpy(*FMUstate, serializedState, size);
-    //return fmi2OK;
+#if CAN_SERIALIZE_FMU_STATE
+    ModelInstance *comp = (ModelInstance *)c;
+    if (size != sizeof(comp->s)) {
+        return fmi2Error;
+    }
+    //like fmi2GetFMUstate(), a previously returned state is overwritten in place
+    if (*FMUstate == NULL) {
+        *FMUstate = comp->functions->allocateMemory(1, size);
+        if (*FMUstate == NULL) {
+            return fmi2Error;
+        }
+    }
+    memcpy(*FMUstate, serializedState, size);
+    return fmi2OK;
+#else
+    return fmi2Error;
+#endif
 }
 
 fmi2Status fmi2GetDirectionalDerivative(fmi2Component c, const fmi2ValueReference vUnknown_ref[], size_t nUnknown,
@@ -618,6 +656,10 @@ fmi2Status fmi2GetDirectionalDerivative(fmi2Component c, const fmi2ValueReferenc
 #endif
 #if HAVE_DIRECTIONAL_DERIVATIVE
     ModelInstance *comp = (ModelInstance *)c;
+#ifdef SIMULATION_DIRECTIONAL_DERIVATIVE
+    //the simulation wants the whole seed vector at once
+    return SIMULATION_DIRECTIONAL_DERIVATIVE(comp, vUnknown_ref, nUnknown, vKnown_ref, nKnown, dvKnown, dvUnknown);
+#else
     size_t x, y;
 
     /**
@@ -640,6 +682,7 @@ fmi2Status fmi2GetDirectionalDerivative(fmi2Component c, const fmi2ValueReferenc
     }
 
     return fmi2OK;
+#endif
 #else
     return fmi2Error;
 #endif
@@ -4,9 +4,14 @@
 #include "sc/Slave.h"
 #include "sc/Constraint.h"
 #include "sc/Connector.h"
+#include "sc/ThreadPool.h"
 #include <vector>
 #include <map>
 #include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
 extern "C" {
 #include "umfpack.h"
 }
@@ -15,6 +20,16 @@ extern "C" {
 
 namespace sc {
 
+/// Method used for systems that are not trees and are too large for the 1x1, 2x2 and dense paths
+enum SolverMethod {
+    /// Sparse LU factorization with UMFPACK
+    SOLVER_DIRECT,
+    /// Jacobi preconditioned conjugate gradient
+    SOLVER_PCG,
+    /// Gauss-Seidel sweeps over the equations
+    SOLVER_GS,
+};
+
 /// Holds all slaves and constraints in the system, and solves for constraint forces.
 class Solver {
 
@@ -23,20 +38,76 @@ private:
     std::vector<Constraint*> m_constraints;
     std::vector<Connector*> m_connectors;
     mutable std::vector<Equation*> eqs;
-    std::vector<double> rhs;
-    std::vector<double> g;
-    std::vector<double> gv;
-    std::vector<int> Ap;
-    std::vector<int> Ai;
-    std::vector<double> lambda;
-    std::vector<double> Ax;
+    std::vector<double> rhs;        //by row of S
+    std::vector<double> g;          //by equation index
+    std::vector<double> gv;         //by equation index
+    std::vector<double> lambda;     //by row of S
     bool equations_dirty;
     int nchangingentries, numsystemrows;
     std::vector<int> Srow;
     std::vector<int> Scol;
     std::vector<double> Sval;
-    void *Symbolic, *Numeric;
-    double Info [UMFPACK_INFO], Control [UMFPACK_CONTROL];
+
+    //equations in the order of the rows of S. equations of the same island are consecutive,
+    //as are the equations of each constraint. see constructIslands()
+    std::vector<Equation*> m_rows;
+
+    //row of each equation, by Equation::m_index
+    std::vector<int> m_eqRow;
+
+    /// One term G_i(conn) * mobility(conn,j) in element (i,j) of S
+    struct STerm {
+        const JacobianElement *G;
+        int mobility;   //index into m_mobilities
+    };
+
+    //terms making up each triplet, precomputed by constructS()
+    //triplet x is the sum of Sterms[StermStart[x]] .. Sterms[StermStart[x+1]-1]
+    std::vector<STerm> Sterms;
+    std::vector<int> StermStart;
+
+    //triplets of row i are SrowStart[i] .. SrowStart[i+1]-1, Sdiag[i] is the diagonal triplet of row i
+    std::vector<int> SrowStart;
+    std::vector<int> Sdiag;
+
+    /// Equations that share no slaves with the rest of the system. Each island is solved on its own.
+    struct Island {
+        int row, n;             //rows row .. row+n-1 of S
+        int triplet, nz;        //triplets triplet .. triplet+nz-1
+        int nblocks;            //number of constraints
+        int sep, nseps;         //entries sep .. sep+nseps-1 of m_separators, if isTree
+        bool isTree;
+        std::vector<Slave*> slaves;
+
+        //column form of the island's part of S for UMFPACK, made by constructColumnForm() on first use
+        //Smap maps each triplet to its position in Ax, so that the column form can be updated
+        //in place without calling umfpack_di_triplet_to_col() every step
+        std::vector<int> Ap, Ai, Smap;
+        std::vector<double> Ax;
+
+        //Symbolic only depends on the sparsity pattern of S, so it is kept until constructS() is called again
+        void *Symbolic;
+
+        //dense copy of S for solveDense(), rows padded to denseStride doubles.
+        //allocated along with the island, with room to start it on a 32 byte boundary, see denseRows()
+        std::vector<double> dense;
+        int denseStride;
+
+        double *denseRows() {
+            uintptr_t p = (uintptr_t)dense.data();
+            return (double*)((p + 31) & ~(uintptr_t)31);
+        }
+
+        //statistics of the last solveIterative(), -1 iterations if it was not used
+        int iterations;
+        double residual;
+
+        //time spent factorizing in the last solveIsland(), in seconds
+        double factorTime;
+    };
+    std::vector<Island> m_islands;
+
+    double Control [UMFPACK_CONTROL];
 
 
     /// Spook parameter "a"
@@ -51,17 +122,104 @@ private:
     /// Time step
     double m_timeStep;
 
+    //mobility blocks, one per (connector, equation) pair where the connector's slave is part of the equation
+    //laid out equation by equation, see constructMobilities()
+    std::vector<JacobianElement> m_mobilities;
+
+    //slots m_mobilityStart[J] .. m_mobilityStart[J+1]-1 belong to equation J
+    std::vector<int> m_mobilityStart;
+
+    //connector index for each slot in m_mobilities
+    std::vector<int> m_mobilityConnectors;
+
+    //systems with at most this many equations are solved with solveDense()
+    int m_denseThreshold;
+
+    //block structure for solveTree(), one block per constraint in row order, see constructTree()
+    //A separator is a slave shared by a parent block and one or more child blocks. Its matrix holds
+    //the part of S coupling those blocks, with the children first and the parent last.
+    //The root block of each island is the only child of a separator without a parent.
+    struct Separator {
+        int parent;             //-1 for the root
+        int child, nchild;      //children are m_sepChildren[child .. child+nchild-1]
+        int m, mp;              //equations in the children and in the parent
+        int vals;               //offset of the (m+mp)*(m+mp) row major matrix in m_treeVals
+        int slot;               //offset of the children's m rows in m_treeRhs and m_treePivots
+    };
+    bool m_useTree;
+    std::vector<int> m_blockStart;      //first row of each block, plus one past the last
+    std::vector<Separator> m_separators;    //island by island, parents before their children
+    std::vector<int> m_sepChildren;
+    std::vector<int> m_blockSep;        //separator each block is a child of
+    std::vector<int> m_blockSlot;       //offset of the block's rows in m_treeRhs
+    std::vector<int> m_blockDiag;       //offset of S_kk in m_treeVals
+    std::vector<int> m_blockStride;     //row stride of S_kk
+    std::vector<int> m_treeMap;         //maps each triplet to its position in m_treeVals
+    std::vector<double> m_treeVals;
+    std::vector<int> m_treePivots;
+    std::vector<double> m_treeRhs;
+
+    SolverMethod m_method;
+    double m_tolerance;
+    int m_maxIterations;
+
+    //work vectors for solveIterative(), by row
+    std::vector<double> m_r, m_z, m_p, m_q;
+
+    //islands are solved on this pool if there is more than one thread, see setNumThreads()
+    ThreadPool *m_pool;
+
+    //islands in the order they were solved, filled in by the worker threads
+    std::vector<int> m_solvedIslands;
+    std::mutex m_solvedMutex;
+    std::condition_variable m_solvedCond;
+
+    //wall clock time of the two phases of the last solve(), in seconds
+    double m_assemblyTime, m_solveTime;
+
+    //wall clock time of the last constructS(), in seconds
+    double m_constructTime;
+
     //for internal use only
+    void constructIslands();
+    void constructMobilities();
     void constructS();
+    void constructTree();
+    void constructColumnForm(Island& isl);
+    void freeFactorization();
 
-    void solve1x1();
-    void solve2x2();
+    void solveIsland(Island& isl);
+    void solve1x1(const Island& isl);
+    void solve2x2(const Island& isl);
+    void allocateDense(Island& isl);
+    bool solveDense(Island& isl);
+    bool solveTree(Island& isl);
+    bool solveIterative(Island& isl);
+    void solveSparse(Island& isl);
+    double residual(const Island& isl, double *r) const;
+    void multiplyS(const Island& isl, const double *x, double *y) const;
+    void applyForces(const Island& isl);
+    void forRange(int n, const std::function<void(int,int)>& fn);
 
 public:
     const std::vector<Equation*>& getEquations() const;
 
-    //sparse matrix of mobilities
-    std::map<std::pair<int,int>, JacobianElement> m_mobilities;
+    /**
+     * @brief Get the slot of the mobility of a connector with respect to an equation.
+     * Slots are valid until constraints or slaves are added. Call prepare() first.
+     * @param connectorIndex Connector::m_index
+     * @param equationIndex Equation::m_index
+     * @return Index for getMobility(), or -1 if the connector's slave is not part of the equation
+     */
+    int getMobilityIndex(int connectorIndex, int equationIndex) const;
+
+    /// Get mobility block by slot, as returned by getMobilityIndex()
+    JacobianElement& getMobility(int slot) {
+        return m_mobilities[slot];
+    }
+
+    /// Get mobility block of a connector with respect to an equation. Slower than getMobility(int).
+    JacobianElement& getMobility(int connectorIndex, int equationIndex);
 
     Solver();
     virtual ~Solver();
@@ -102,6 +260,88 @@ public:
     void solve(bool holonomic, int printDebugInfo);
     void solve(bool holonomic = true);
 
+    /**
+     * @brief Like solve(), but calls islandSolved(k) as soon as the forces of island k are set.
+     * The callback is always called from the calling thread, so the caller can go on
+     * with the island's slaves while the remaining islands are being solved.
+     */
+    void solve(bool holonomic, int printDebugInfo, const std::function<void(int)>& islandSolved);
+
+    /// Number of islands: groups of equations which share no slaves. Call prepare() first.
+    int getNumIslands() const;
+
+    /// Slaves that take part in the equations of an island
+    const std::vector<Slave*>& getIslandSlaves(int island) const;
+
+    /**
+     * @brief Solve islands on this many threads. The default, 1, solves them on the calling thread.
+     * updateConstraints() and the assembly of S in solve() are split across the same threads.
+     * Results do not depend on the number of threads.
+     */
+    void setNumThreads(int n);
+
+    /// Time spent computing the right hand side and S in the last solve(), in seconds
+    double getAssemblyTime() const;
+
+    /// Time spent solving the islands and setting forces in the last solve(), including any islandSolved callbacks, in seconds
+    double getSolveTime() const;
+
+    /**
+     * @brief Time spent factorizing S in the last solve(), summed over islands, in seconds.
+     * This is part of getSolveTime(). It covers the UMFPACK symbolic and numeric factorizations,
+     * the dense LDL^T and the leaf to root elimination of the tree path. Iterative solves and
+     * 1x1 and 2x2 islands have no factorization.
+     */
+    double getFactorizationTime() const;
+
+    /// Time spent in the last analysis of the structure of S, done by prepare() or by solve() after constraints were added, in seconds
+    double getConstructTime() const;
+
+    /**
+     * @brief Set the largest system solved with the dense LDL^T path instead of UMFPACK.
+     * Systems which turn out not to be symmetric positive definite fall back to UMFPACK.
+     * @param n Number of equations. Zero disables the dense path.
+     */
+    void setDenseThreshold(int n);
+
+    /**
+     * @brief Enable or disable solveTree(), on by default.
+     * When slaves and constraints form a tree, meaning no loops when each constraint is joined to
+     * the slaves it acts on, the system is solved by block elimination from the leaves.
+     * A slave can be shared by any number of constraints, like the hub of a driveline.
+     * The cost is linear in the number of constraints, and cubic in the number of equations
+     * acting on each shared slave.
+     */
+    void setTreeSolver(bool enable);
+
+    /// True if every island can be solved with the tree solver. Call prepare() first.
+    bool isTree() const;
+
+    /**
+     * @brief Select how systems larger than the dense threshold are solved.
+     * The iterative methods start from the previous step's solution and stop when
+     * |rhs - S*lambda| <= tolerance*|rhs|. If that does not happen within maxIterations
+     * the system is solved with UMFPACK instead.
+     * @param method
+     * @param tolerance Relative residual
+     * @param maxIterations
+     */
+    void setMethod(SolverMethod method, double tolerance = 1e-10, int maxIterations = 100);
+
+    /// Most iterations spent by the iterative method on an island in the last solve(), -1 if it was not used
+    int getIterations() const;
+
+    /// Largest relative residual |rhs - S*lambda| / |rhs| of an island in the last solve() with an iterative method
+    double getResidual() const;
+
+    /**
+     * @brief Constraint velocity G*v at the end of the step, as predicted by the last solve().
+     * Comparing this with Equation::getVelocity() at the start of the next step tells how well
+     * the mobilities used in the solve describe the connected systems.
+     * @param equationIndex Equation::m_index
+     */
+    double getPredictedVelocity(int equationIndex) const;
+
     /**
      * Set spook parameters for all equations at once.
      * @param relaxation
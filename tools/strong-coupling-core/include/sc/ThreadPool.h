@@ -0,0 +1,51 @@
+#ifndef SCTHREADPOOL_H
+#define SCTHREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace sc {
+
+/// Fixed set of worker threads that run indexed tasks, fn(0) .. fn(n-1).
+class ThreadPool {
+
+private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+
+    std::function<void(int)> m_fn;
+    int m_n, m_next, m_finished;
+    bool m_quit;
+
+    void work();
+
+public:
+    /**
+     * @brief Start worker threads.
+     * @param numThreads Number of workers
+     */
+    ThreadPool(int numThreads);
+    virtual ~ThreadPool();
+
+    int getNumThreads() const;
+
+    /**
+     * @brief Call fn(i) for i = 0 .. n-1 on the worker threads, and return without waiting.
+     * The calls may happen in any order. fn must not touch anything the other calls touch.
+     */
+    void start(int n, std::function<void(int)> fn);
+
+    /// Wait until all calls from the last start() have returned
+    void wait();
+
+    /// start() followed by wait()
+    void parallelFor(int n, std::function<void(int)> fn);
+};
+
+}
+
+#endif
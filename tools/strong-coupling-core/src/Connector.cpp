@@ -4,6 +4,7 @@ using namespace sc;
 
 Connector::Connector(){
     m_index = 0;
+    m_shaftAngle = 0;
 }
 
 Connector::~Connector(){}
@@ -8,6 +8,8 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <chrono>
 
 using namespace sc;
 using namespace std;
@@ -15,15 +17,23 @@ using namespace std;
 Solver::Solver(){
     m_connectorIndexCounter = 0;
     equations_dirty = true;
-
-    Symbolic = NULL;
-    Numeric = NULL;
+    m_denseThreshold = 64;
+    m_useTree = true;
+    m_method = SOLVER_DIRECT;
+    m_tolerance = 1e-10;
+    m_maxIterations = 100;
+    m_pool = NULL;
+    m_assemblyTime = 0;
+    m_solveTime = 0;
+    m_constructTime = 0;
 
     // Default control
     umfpack_di_defaults (Control) ;
 }
 
 Solver::~Solver() {
+    freeFactorization();
+    delete m_pool;
     for (Constraint *c : m_constraints) {
         delete c;
     }
@@ -82,6 +92,104 @@ const std::vector<Equation*>& Solver::getEquations() const{
     return eqs;
 }
 
+void Solver::setDenseThreshold(int n){
+    m_denseThreshold = n;
+}
+
+void Solver::setTreeSolver(bool enable){
+    m_useTree = enable;
+}
+
+bool Solver::isTree() const {
+    for (const Island& isl : m_islands) {
+        if (!isl.isTree) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Solver::setMethod(SolverMethod method, double tolerance, int maxIterations){
+    m_method = method;
+    m_tolerance = tolerance;
+    m_maxIterations = maxIterations;
+}
+
+int Solver::getIterations() const {
+    int it = -1;
+    for (const Island& isl : m_islands) {
+        it = std::max(it, isl.iterations);
+    }
+    return it;
+}
+
+double Solver::getResidual() const {
+    double res = 0;
+    for (const Island& isl : m_islands) {
+        if (isl.iterations >= 0) {
+            res = std::max(res, isl.residual);
+        }
+    }
+    return res;
+}
+
+double Solver::getPredictedVelocity(int equationIndex) const {
+    int i = m_eqRow[equationIndex];
+    //S*lambda = rhs, with S = G*M^-1*G^T + epsilon
+    return m_rows[i]->getFutureVelocity() + rhs[i] - m_epsilon * lambda[i];
+}
+
+int Solver::getNumIslands() const {
+    return m_islands.size();
+}
+
+const std::vector<Slave*>& Solver::getIslandSlaves(int island) const {
+    return m_islands[island].slaves;
+}
+
+void Solver::setNumThreads(int n){
+    delete m_pool;
+    m_pool = n > 1 ? new ThreadPool(n) : NULL;
+}
+
+double Solver::getAssemblyTime() const {
+    return m_assemblyTime;
+}
+
+double Solver::getSolveTime() const {
+    return m_solveTime;
+}
+
+double Solver::getFactorizationTime() const {
+    double t = 0;
+    for (const Island& isl : m_islands) {
+        t += isl.factorTime;
+    }
+    return t;
+}
+
+double Solver::getConstructTime() const {
+    return m_constructTime;
+}
+
+// Calls fn(begin, end) on consecutive ranges covering 0 .. n-1, spread over the thread pool.
+// Each range is handled by exactly one call, and the split does not affect what is computed
+// for each index, so results are the same for any number of threads.
+void Solver::forRange(int n, const std::function<void(int,int)>& fn){
+    //not worth waking the workers for less
+    const int grain = 256;
+
+    if (!m_pool || n < 2*grain) {
+        fn(0, n);
+        return;
+    }
+
+    int chunks = std::min(4 * m_pool->getNumThreads(), n / grain);
+    m_pool->parallelFor(chunks, [n, chunks, &fn](int c) {
+        fn((int)((long long)n * c / chunks), (int)((long long)n * (c+1) / chunks));
+    });
+}
+
 void Solver::setSpookParams(double relaxation, double compliance, double timeStep){
   
   m_b =  1./(1. + 4. * relaxation );
@@ -99,58 +207,513 @@ void Solver::resetConstraintForces(){
 }
 
 void Solver::updateConstraints(){
-    for(int i=0; i<m_constraints.size(); i++){
-        m_constraints[i]->update();
+    //each constraint only writes to its own equations
+    forRange(m_constraints.size(), [this](int begin, int end) {
+        for(int i=begin; i<end; i++){
+            m_constraints[i]->update();
+        }
+    });
+}
+
+void Solver::freeFactorization() {
+    for (Island& isl : m_islands) {
+        if (isl.Symbolic) {
+            umfpack_di_free_symbolic(&isl.Symbolic);
+        }
     }
 }
 
-void Solver::constructS() {
-    Srow.clear();
-    Scol.clear();
-    Sval.clear();
+// union-find root with path halving
+static int findRoot(std::vector<int>& uf, int a) {
+    while (uf[a] != a) {
+        uf[a] = uf[uf[a]];
+        a = uf[a];
+    }
+    return a;
+}
+
+void Solver::constructIslands() {
+    int nc = m_constraints.size(),
+        neq = eqs.size();
+
+    // Constraints sharing a slave are in the same island. Union-find over the slaves
+    std::unordered_map<Slave*, int> slaveIndex;
+    std::vector<Slave*> slaves;
+    std::vector<int> uf;
+    std::vector<int> constraintSlave(nc, -1);   //some slave of each constraint
+
+    for (Slave *slave : m_slaves) {
+        slaveIndex[slave] = slaves.size();
+        slaves.push_back(slave);
+        uf.push_back(uf.size());
+    }
+
+    for (int c = 0; c < nc; c++) {
+        for (int j = 0; j < m_constraints[c]->getNumEquations(); j++) {
+            for (Connector *conn : m_constraints[c]->getEquation(j)->m_connectors) {
+                auto it = slaveIndex.find(conn->m_slave);
+                int s;
+                if (it == slaveIndex.end()) {
+                    // slave was never added to the solver
+                    s = slaveIndex[conn->m_slave] = slaves.size();
+                    slaves.push_back(conn->m_slave);
+                    uf.push_back(s);
+                } else {
+                    s = it->second;
+                }
+
+                if (constraintSlave[c] < 0) {
+                    constraintSlave[c] = s;
+                } else {
+                    int a = findRoot(uf, constraintSlave[c]), b = findRoot(uf, s);
+                    if (a != b) {
+                        uf[a] = b;
+                    }
+                }
+            }
+        }
+    }
+
+    // Number islands in the order their first constraint was added.
+    // Constraints without equations don't end up in S, and need no island
+    std::vector<int> rootIsland(slaves.size(), -1);
+    std::vector<int> constraintIsland(nc, -1);
+    int nislands = 0;
+    for (int c = 0; c < nc; c++) {
+        if (m_constraints[c]->getNumEquations() == 0) {
+            continue;
+        }
+        if (constraintSlave[c] < 0) {
+            constraintIsland[c] = nislands++;
+        } else {
+            int r = findRoot(uf, constraintSlave[c]);
+            if (rootIsland[r] < 0) {
+                rootIsland[r] = nislands++;
+            }
+            constraintIsland[c] = rootIsland[r];
+        }
+    }
+
+    freeFactorization();
+    m_islands.assign(nislands, Island());
+
+    // Lay out rows island by island, keeping the order of the constraints within each island
+    std::vector<std::vector<int> > islandConstraints(nislands);
+    for (int c = 0; c < nc; c++) {
+        if (constraintIsland[c] >= 0) {
+            islandConstraints[constraintIsland[c]].push_back(c);
+        }
+    }
+
+    m_rows.clear();
+    m_blockStart.clear();
+    m_eqRow.resize(neq);
+    for (int k = 0; k < nislands; k++) {
+        Island& isl = m_islands[k];
+        isl.row = m_rows.size();
+        isl.nblocks = islandConstraints[k].size();
+        isl.isTree = false;
+        isl.Symbolic = NULL;
+        isl.denseStride = 0;
+        isl.dense.clear();
+        isl.iterations = -1;
+        isl.factorTime = 0;
+        isl.residual = 0;
+
+        for (int c : islandConstraints[k]) {
+            m_blockStart.push_back(m_rows.size());
+            for (int j = 0; j < m_constraints[c]->getNumEquations(); j++) {
+                Equation *eq = m_constraints[c]->getEquation(j);
+                m_eqRow[eq->m_index] = m_rows.size();
+                m_rows.push_back(eq);
+            }
+        }
+        isl.n = m_rows.size() - isl.row;
+        if (isl.n > 2 && isl.n <= m_denseThreshold) {
+            allocateDense(isl);
+        }
+    }
+    m_blockStart.push_back(m_rows.size());
+
+    for (size_t s = 0; s < slaves.size(); s++) {
+        int r = findRoot(uf, s);
+        if (rootIsland[r] >= 0) {
+            m_islands[rootIsland[r]].slaves.push_back(slaves[s]);
+        }
+    }
+}
+
+void Solver::constructMobilities() {
+    int neq = eqs.size();
+
+    m_mobilityStart.resize(neq+1);
+    m_mobilityConnectors.clear();
+
+    // Equation J gets one slot for each connector on each slave that is part of J.
+    // The order is the same as when looping over eq->m_connectors and the connectors of their slaves.
+    std::vector<Slave*> seen;
+    for (int j = 0; j < neq; ++j){
+        m_mobilityStart[j] = m_mobilityConnectors.size();
+        seen.clear();
+
+        for (Connector *conn : eqs[j]->m_connectors) {
+            Slave *slave = conn->m_slave;
+            if (std::find(seen.begin(), seen.end(), slave) != seen.end()) {
+                continue;
+            }
+            seen.push_back(slave);
+
+            for (int x = 0; x < slave->numConnectors(); x++) {
+                m_mobilityConnectors.push_back(slave->getConnector(x)->m_index);
+            }
+        }
+    }
+    m_mobilityStart[neq] = m_mobilityConnectors.size();
+
+    m_mobilities.assign(m_mobilityConnectors.size(), JacobianElement());
+}
+
+int Solver::getMobilityIndex(int connectorIndex, int equationIndex) const {
+    if (equationIndex < 0 || equationIndex + 1 >= (int)m_mobilityStart.size()) {
+        return -1;
+    }
+
+    for (int x = m_mobilityStart[equationIndex]; x < m_mobilityStart[equationIndex+1]; x++) {
+        if (m_mobilityConnectors[x] == connectorIndex) {
+            return x;
+        }
+    }
+    return -1;
+}
 
+JacobianElement& Solver::getMobility(int connectorIndex, int equationIndex) {
+    int slot = getMobilityIndex(connectorIndex, equationIndex);
+    if (slot < 0) {
+        fprintf(stderr, "Solver::getMobility(): connector %i is not part of equation %i, or prepare() was not called\n", connectorIndex, equationIndex);
+        exit(1);
+    }
+    return m_mobilities[slot];
+}
+
+void Solver::constructS() {
+    auto t0 = std::chrono::steady_clock::now();
     int neq = eqs.size();
+
+    constructIslands();
+    constructMobilities();
+
+    // Incidence structure: which rows touch each slave (FMU).
+    // Only equations sharing a slave give non-zeros in S, so we only need to visit those pairs.
+    std::unordered_map<Slave*, std::vector<int> > slaveRows;
+    for (int i = 0; i < neq; ++i){
+        for (Connector *conn : m_rows[i]->m_connectors) {
+            std::vector<int>& v = slaveRows[conn->m_slave];
+            // Several connectors in the same equation may belong to the same slave
+            if (v.size() == 0 || v.back() != i) {
+                v.push_back(i);
+            }
+        }
+    }
+
+    // stamp[j] == i means that element (i,j) has already been visited for row i
+    std::vector<int> stamp(neq, -1);
+    std::vector<int> rowcols;
+
+    // First pass: count non-zeros so the triplet arrays can be allocated once
+    int nz = 0;
     for (int i = 0; i < neq; ++i){
-        for (int j = 0; j < neq; ++j){
+        for (Connector *conn : m_rows[i]->m_connectors) {
+            for (int j : slaveRows[conn->m_slave]) {
+                if (stamp[j] != i) {
+                    stamp[j] = i;
+                    nz++;
+                }
+            }
+        }
+    }
+
+    Srow.resize(nz);
+    Scol.resize(nz);
+    Sval.assign(nz, 0); //dummy values, filled in by solve()
+    StermStart.resize(nz+1);
+    Sterms.clear();
+
+    // Second pass: write triplets, sorted by row then column
+    std::fill(stamp.begin(), stamp.end(), -1);
+    int x = 0;
+    for (int i = 0; i < neq; ++i){
+        Equation * ei = m_rows[i];
+
+        rowcols.clear();
+        for (Connector *conn : ei->m_connectors) {
+            for (int j : slaveRows[conn->m_slave]) {
+                if (stamp[j] != i) {
+                    stamp[j] = i;
+                    rowcols.push_back(j);
+                }
+            }
+        }
+        std::sort(rowcols.begin(), rowcols.end());
+
+        for (int j : rowcols) {
             // We are at element i,j in S
-            Equation * ei = eqs[i];
-            Equation * ej = eqs[j];
-
-            //check for overlap in connector FMUs, not the connectors themselves
-            if (ei->haveOverlappingFMUs(ej)) {
-                Srow.push_back(i);
-                Scol.push_back(j);
-                Sval.push_back(0);  //dummy value
+            Equation * ej = m_rows[j];
+            Srow[x] = i;
+            Scol[x] = j;
+            StermStart[x] = Sterms.size();
+
+            //each S_ij = G_i*J_i^T
+            //only connectors whose slave is part of ej can have a non-zero mobility
+            for (Connector *conn : ei->m_connectors) {
+                for (Connector *connj : ej->m_connectors) {
+                    if (conn->m_slave == connj->m_slave) {
+                        STerm term;
+                        term.G = &ei->jacobianElementForConnector(conn);
+                        term.mobility = getMobilityIndex(conn->m_index, ej->m_index);
+                        Sterms.push_back(term);
+                        break;
+                    }
+                }
             }
+            x++;
         }
     }
+    StermStart[nz] = Sterms.size();
 
     //remember how many entries we have that change every time step
+    //every equation overlaps itself, so all diagonal entries (which get m_epsilon) are in here
     nchangingentries = Srow.size();
 
-    // Add regularization to diagonal entries
-    for (int i = 0; i < eqs.size(); ++i){
-        if(m_epsilon > 0){
+    //row pointers and diagonal positions for the iterative methods
+    SrowStart.assign(neq+1, 0);
+    Sdiag.assign(neq, -1);
+    for (int x = 0; x < nz; x++) {
+        SrowStart[Srow[x]+1]++;
+        if (Srow[x] == Scol[x]) {
+            Sdiag[Srow[x]] = x;
+        }
+    }
+    for (int i = 0; i < neq; ++i){
+        SrowStart[i+1] += SrowStart[i];
+    }
+
+    //old solution does not fit the new system, so don't warm start from it
+    lambda.assign(neq, 0);
+    m_r.resize(neq);
+    m_z.resize(neq);
+    m_p.resize(neq);
+    m_q.resize(neq);
+
+    // No equation couples two islands, so each island's triplets are contiguous
+    for (Island& isl : m_islands) {
+        isl.triplet = SrowStart[isl.row];
+        isl.nz = SrowStart[isl.row + isl.n] - isl.triplet;
+    }
+
+    constructTree();
+    m_constructTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void Solver::constructColumnForm(Island& isl) {
+    // Compute the column form pattern of the island once, along with the triplet -> Ax map.
+    // Values are filled in by solveSparse() every step using Smap.
+    int n = isl.n;
+    std::vector<int> lrow(isl.nz), lcol(isl.nz);
+    for (int x = 0; x < isl.nz; x++) {
+        lrow[x] = Srow[isl.triplet + x] - isl.row;
+        lcol[x] = Scol[isl.triplet + x] - isl.row;
+    }
+
+    isl.Ap.resize(n+1);
+    isl.Ai.resize(isl.nz);
+    isl.Ax.resize(isl.nz);
+    isl.Smap.resize(isl.nz);
+
+    int status = umfpack_di_triplet_to_col (n, n, isl.nz, lrow.data(), lcol.data(), NULL, isl.Ap.data(), isl.Ai.data(), NULL, isl.Smap.data()) ;
+    if (status < 0){
+        umfpack_di_report_status (Control, status) ;
+        fprintf(stderr, "umfpack_di_triplet_to_col failed\n") ;
+        exit(1);
+    }
+}
 
-            int found = 0;
+void Solver::constructTree() {
+    int neq = eqs.size(),
+        nb = m_blockStart.size() - 1,
+        nz = nchangingentries;
 
-            // Find the corresponding triplet
-            for(int j = 0; j < Srow.size(); ++j){
-                if(Srow[j] == i && Scol[j] == i){
-                    Sval[j] += m_epsilon;
-                    found = 1;
-                    break;
+    //one block per constraint, see constructIslands(). blocks are numbered island by island
+    std::vector<int> rowBlock(neq), blockIsland(nb);
+    for (int k = 0; k < nb; k++) {
+        for (int i = m_blockStart[k]; i < m_blockStart[k+1]; i++) {
+            rowBlock[i] = k;
+        }
+    }
+    for (size_t k = 0, b = 0; k < m_islands.size(); k++) {
+        for (int j = 0; j < m_islands[k].nblocks; j++) {
+            blockIsland[b++] = k;
+        }
+    }
+
+    //the slaves each block acts on, and the blocks acting on each slave, in CSR form
+    std::unordered_map<Slave*, int> slaveIndex;
+    std::vector<int> blockSlaveStart(nb+1, 0), blockSlaves;
+    for (int k = 0; k < nb; k++) {
+        for (int i = m_blockStart[k]; i < m_blockStart[k+1]; i++) {
+            for (Connector *conn : m_rows[i]->m_connectors) {
+                int s = slaveIndex.insert(std::make_pair(conn->m_slave, (int)slaveIndex.size())).first->second;
+                if (std::find(blockSlaves.begin() + blockSlaveStart[k], blockSlaves.end(), s) == blockSlaves.end()) {
+                    blockSlaves.push_back(s);
                 }
             }
+        }
+        blockSlaveStart[k+1] = blockSlaves.size();
+    }
+
+    int ns = slaveIndex.size();
+    std::vector<int> slaveBlockStart(ns+1, 0), slaveBlocks(blockSlaves.size());
+    for (int s : blockSlaves) {
+        slaveBlockStart[s+1]++;
+    }
+    for (int s = 0; s < ns; s++) {
+        slaveBlockStart[s+1] += slaveBlockStart[s];
+    }
+    std::vector<int> fill(slaveBlockStart.begin(), slaveBlockStart.end()-1);
+    for (int k = 0; k < nb; k++) {
+        for (int a = blockSlaveStart[k]; a < blockSlaveStart[k+1]; a++) {
+            slaveBlocks[fill[blockSlaves[a]]++] = k;
+        }
+    }
+
+    //an island is a tree if the graph joining each block to its slaves has no loops.
+    //any edge joining two already connected nodes closes one. slaves are nodes nb .. nb+ns-1
+    for (Island& isl : m_islands) {
+        isl.isTree = true;
+        isl.sep = isl.nseps = 0;
+    }
+    std::vector<int> uf(nb + ns);
+    for (int k = 0; k < nb + ns; k++) {
+        uf[k] = k;
+    }
+    for (int k = 0; k < nb; k++) {
+        for (int a = blockSlaveStart[k]; a < blockSlaveStart[k+1]; a++) {
+            int r = findRoot(uf, k), q = findRoot(uf, nb + blockSlaves[a]);
+            if (r == q) {
+                m_islands[blockIsland[k]].isTree = false;
+            } else {
+                uf[r] = q;
+            }
+        }
+    }
 
-            // Could not find triplet. Add it.
-            if(!found){
-                Sval.push_back(m_epsilon);
-                Srow.push_back(i);
-                Scol.push_back(i);
+    //breadth first from the first block of each tree island. every slave reached from block k
+    //that is shared with other blocks becomes a separator with parent k and those blocks as children
+    m_separators.clear();
+    m_sepChildren.clear();
+    m_blockSep.assign(nb, -1);
+    m_blockSlot.assign(nb, -1);
+    m_blockDiag.assign(nb, -1);
+    m_blockStride.assign(nb, 0);
+    std::vector<char> slaveSeen(ns, 0);
+    int nvals = 0, nslots = 0;
+    for (size_t k = 0, r = 0; k < m_islands.size(); r += m_islands[k].nblocks, k++) {
+        Island& isl = m_islands[k];
+        if (!isl.isTree) {
+            continue;
+        }
+        isl.sep = m_separators.size();
+
+        Separator root;
+        root.parent = -1;
+        root.child = m_sepChildren.size();
+        root.nchild = 1;
+        m_sepChildren.push_back(r);
+        m_blockSep[r] = m_separators.size();
+        m_separators.push_back(root);
+
+        for (size_t q = isl.sep; q < m_separators.size(); q++) {
+            for (int c = m_separators[q].child; c < m_separators[q].child + m_separators[q].nchild; c++) {
+                int b = m_sepChildren[c];
+                for (int a = blockSlaveStart[b]; a < blockSlaveStart[b+1]; a++) {
+                    int s = blockSlaves[a];
+                    if (slaveSeen[s] || slaveBlockStart[s+1] - slaveBlockStart[s] < 2) {
+                        continue;
+                    }
+                    slaveSeen[s] = 1;
+
+                    Separator sep;
+                    sep.parent = b;
+                    sep.child = m_sepChildren.size();
+                    for (int x = slaveBlockStart[s]; x < slaveBlockStart[s+1]; x++) {
+                        if (slaveBlocks[x] != b) {
+                            m_blockSep[slaveBlocks[x]] = m_separators.size();
+                            m_sepChildren.push_back(slaveBlocks[x]);
+                        }
+                    }
+                    sep.nchild = m_sepChildren.size() - sep.child;
+                    m_separators.push_back(sep);
+                }
+            }
+        }
+        isl.nseps = m_separators.size() - isl.sep;
+
+        //lay out each separator's matrix and rows, and find each block's diagonal in its separator
+        for (int q = isl.sep; q < isl.sep + isl.nseps; q++) {
+            Separator& sep = m_separators[q];
+            sep.m = 0;
+            sep.mp = sep.parent < 0 ? 0 : m_blockStart[sep.parent+1] - m_blockStart[sep.parent];
+            for (int c = sep.child; c < sep.child + sep.nchild; c++) {
+                sep.m += m_blockStart[m_sepChildren[c]+1] - m_blockStart[m_sepChildren[c]];
+            }
+            int d = sep.m + sep.mp;
+            sep.vals = nvals;
+            sep.slot = nslots;
+            nvals += d*d;
+            nslots += sep.m;
+
+            for (int c = sep.child, pos = 0; c < sep.child + sep.nchild; c++) {
+                int b = m_sepChildren[c];
+                m_blockSlot[b] = sep.slot + pos;
+                m_blockDiag[b] = sep.vals + pos*d + pos;
+                m_blockStride[b] = d;
+                pos += m_blockStart[b+1] - m_blockStart[b];
             }
         }
     }
+
+    //blocks sharing a slave are both in that slave's separator. in a tree they share no other slave,
+    //so each triplet has exactly one place. triplets of islands with loops are not used
+    m_treeMap.resize(nz);
+    for (int x = 0; x < nz; x++) {
+        int i = Srow[x], j = Scol[x],
+            bi = rowBlock[i], bj = rowBlock[j],
+            ri = i - m_blockStart[bi],
+            cj = j - m_blockStart[bj];
+
+        m_treeMap[x] = -1;
+        if (!m_islands[blockIsland[bi]].isTree) {
+            continue;
+        }
+
+        int si = m_blockSep[bi], sj = m_blockSep[bj];
+        if (bi == bj) {
+            m_treeMap[x] = m_blockDiag[bi] + ri*m_blockStride[bi] + cj;
+        } else if (si == sj) {
+            //siblings
+            m_treeMap[x] = m_blockDiag[bi] + ri*m_blockStride[bi] + (m_blockSlot[bj] - m_blockSlot[bi]) + cj;
+        } else if (m_separators[sj].parent == bi) {
+            //bi is the parent of bj's separator, and comes after its children
+            const Separator& sep = m_separators[sj];
+            m_treeMap[x] = sep.vals + (sep.m + ri)*(sep.m + sep.mp) + (m_blockSlot[bj] - sep.slot) + cj;
+        } else if (m_separators[si].parent == bj) {
+            const Separator& sep = m_separators[si];
+            m_treeMap[x] = m_blockDiag[bi] + ri*m_blockStride[bi] + (sep.m - (m_blockSlot[bi] - sep.slot)) + cj;
+        }
+    }
+
+    m_treeVals.resize(nvals);
+    m_treePivots.resize(nslots);
+    m_treeRhs.resize(nslots);
 }
 
 void Solver::prepare() {
@@ -165,6 +728,10 @@ void Solver::solve(bool holonomic){
 }
 
 void Solver::solve(bool holonomic, int printDebugInfo){
+    solve(holonomic, printDebugInfo, std::function<void(int)>());
+}
+
+void Solver::solve(bool holonomic, int printDebugInfo, const std::function<void(int)>& islandSolved){
     int i, j, k, l;
     if (equations_dirty) {
       getEquations();
@@ -172,59 +739,59 @@ void Solver::solve(bool holonomic, int printDebugInfo){
     int numRows = getSystemMatrixRows(),
         neq = eqs.size();
 
-    // Compute RHS
+    // Compute matrix S = G * inv(M) * G' = G * z
+    // Should be easy, since we already got the entries from the user
+    //TODO: figure out if these vary, reset each time
+    if (equations_dirty) {
+        //NOTE: this will be slow
+        constructS();
+        //alright, we have the structure of the matrix - don't redo all this work unless we have to
+        equations_dirty = false;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+
+    // Compute RHS, in row order
+    // Rows and triplets are independent, and connectors are only read here, so both loops are split
+    // across threads. Each value is computed the same way no matter which thread does it.
     rhs.resize(numRows);
     g.resize(numRows);
     gv.resize(numRows);
-    for(i=0; i<neq; ++i){
-        Equation * eq = eqs[i];
+    forRange(neq, [this, holonomic](int begin, int end) {
+    for(int i=begin; i<end; ++i){
+        Equation * eq = m_rows[i];
+        int e = eq->m_index;
         double  Z = eq->getFutureVelocity(); 
         double  GW = eq->getVelocity();
 
-        gv[i] = GW;
+        gv[e] = GW;
         
-        g[i] = eq->getViolation();
+        g[e] = eq->getViolation();
 
         if (holonomic) {
-          rhs[i] =  (  -m_a * g[i] +  m_b*GW -  Z  ); 
+          rhs[i] =  (  -m_a * g[e] +  m_b*GW -  Z  ); 
         } else {
             rhs[i] =           - Z; 
         }
     }
+    });
 
-    // Compute matrix S = G * inv(M) * G' = G * z
-    // Should be easy, since we already got the entries from the user
-    //TODO: figure out if these vary, reset each time
-    if (equations_dirty) {
-        //NOTE: this will be slow
-        constructS();
-        //alright, we have the structure of the matrix - don't redo all this work unless we have to
-        equations_dirty = false;
-    }
-
-    for (size_t x = 0; x < nchangingentries; x++) {
-        int i = Srow[x];
-        int j = Scol[x];
-        // We are at element i,j in S
-        Equation * ei = eqs[i];
-        Equation * ej = eqs[j];
-
-        //each S_ij = G_i*J_i^T
-        //our job is to figure out J_i^T
+    forRange(nchangingentries, [this](int begin, int end) {
+    for (int x = begin; x < end; x++) {
         double val = 0;
-        for (Connector *conn : ei->m_connectors) {
-            std::pair<int,int> key(conn->m_index, ej->m_index);
-            if (m_mobilities.find(key) != m_mobilities.end()) {
-                val += ei->jacobianElementForConnector(conn).multiply(m_mobilities[key]);
-            }
+        for (int k = StermStart[x]; k < StermStart[x+1]; k++) {
+            val += Sterms[k].G->multiply(m_mobilities[Sterms[k].mobility]);
         }
 
-        if (i == j) {
+        if (Srow[x] == Scol[x]) {
             val += m_epsilon;
         }
 
         Sval[x] = val;
     }
+    });
+
+    auto t1 = std::chrono::steady_clock::now();
 
     // Print matrices
     if(printDebugInfo){
@@ -271,75 +838,50 @@ void Solver::solve(bool holonomic, int printDebugInfo){
         }
     }
 
-    // convert to column form
     int nz = Sval.size(),       // Non-zeros
-        n = eqs.size(),         // Number of equations
-        nz1 = std::max(nz,1) ;  // ensure arrays are not of size zero.
-    Ap.resize(n+1);
-    Ai.resize(nz1);
+        n = eqs.size();         // Number of equations
     lambda.resize(n);
-    Ax.resize(nz1);
 
     if(printDebugInfo)
-        fprintf(stderr, "n=%d, nz=%d\n",n, nz);
-
-    if (n == 1) {
-      solve1x1();
-    } else if (n == 2) {
-      solve2x2();
+        fprintf(stderr, "n=%d, nz=%d, islands=%d\n",n, nz, (int)m_islands.size());
+
+    int nislands = m_islands.size();
+    if (m_pool && nislands > 1) {
+        // Islands share no rows, triplets or connectors, so they can be solved in any order
+        m_solvedIslands.clear();
+        m_pool->start(nislands, [this](int k) {
+            solveIsland(m_islands[k]);
+            std::lock_guard<std::mutex> lock(m_solvedMutex);
+            m_solvedIslands.push_back(k);
+            m_solvedCond.notify_one();
+        });
+
+        // Hand islands to the caller as they are finished
+        for (int x = 0; x < nislands; x++) {
+            int k;
+            {
+                std::unique_lock<std::mutex> lock(m_solvedMutex);
+                m_solvedCond.wait(lock, [this, x]{ return (int)m_solvedIslands.size() > x; });
+                k = m_solvedIslands[x];
+            }
+            if (islandSolved) {
+                islandSolved(k);
+            }
+        }
+        m_pool->wait();
     } else {
-    // Triplet form to column form
-    int status = umfpack_di_triplet_to_col (n, n, nz, Srow.data(), Scol.data(), Sval.data(), Ap.data(), Ai.data(), Ax.data(), (int *) NULL) ;
-    if (status < 0){
-        umfpack_di_report_status (Control, status) ;
-        fprintf(stderr, "umfpack_di_triplet_to_col failed\n") ;
-        exit(1);
-    }
-
-    // symbolic factorization
-    status = umfpack_di_symbolic (n, n, Ap.data(), Ai.data(), Ax.data(), &Symbolic, Control, Info) ;
-    if (status < 0){
-        umfpack_di_report_info (Control, Info) ;
-        umfpack_di_report_status (Control, status) ;
-        fprintf(stderr,"umfpack_di_symbolic failed\n") ;
-        exit(1);
-    }
-
-    // numeric factorization
-    status = umfpack_di_numeric (Ap.data(), Ai.data(), Ax.data(), Symbolic, &Numeric, Control, Info) ;
-    if (status < 0){
-        umfpack_di_report_info (Control, Info) ;
-        umfpack_di_report_status (Control, status) ;
-        fprintf(stderr,"umfpack_di_numeric failed\n") ;
-        exit(1);
-    }
-
-    // solve S*lambda = B
-    status = umfpack_di_solve (UMFPACK_A, Ap.data(), Ai.data(), Ax.data(), lambda.data(), rhs.data(), Numeric, Control, Info) ;
-    umfpack_di_report_info (Control, Info) ;
-    umfpack_di_report_status (Control, status) ;
-    if (status < 0){
-        fprintf(stderr,"umfpack_di_solve failed\n") ;
-        exit(1);
-    }
-    }
-
-    // Store results
-    // Remember that we need to divide lambda by the timestep size
-    // f = G'*lambda
-    for (int i = 0; i<eqs.size(); ++i){
-        Equation * eq = eqs[i];
-        double l = lambda[i] / m_timeStep;
-
-        for (Connector *conn : eq->m_connectors) {
-            JacobianElement G = eq->jacobianElementForConnector(conn);
-            Vec3 f = G.m_spatial    * l;
-            Vec3 t = G.m_rotational * l;
-            conn->m_force  += f;
-            conn->m_torque += t;
+        for (int k = 0; k < nislands; k++) {
+            solveIsland(m_islands[k]);
+            if (islandSolved) {
+                islandSolved(k);
+            }
         }
     }
 
+    auto t2 = std::chrono::steady_clock::now();
+    m_assemblyTime = std::chrono::duration<double>(t1 - t0).count();
+    m_solveTime    = std::chrono::duration<double>(t2 - t1).count();
+
 #if 0
     // Print matrices
     if(printDebugInfo){
@@ -377,25 +919,112 @@ void Solver::solve(bool holonomic, int printDebugInfo){
         printf("]\n");
     }
 #endif
+}
 
-    if (n > 2) {
-    umfpack_di_free_symbolic(&Symbolic);
-    umfpack_di_free_numeric(&Numeric);
+void Solver::solveIsland(Island& isl) {
+  isl.iterations = -1;
+  isl.factorTime = 0;
+
+  if (isl.n == 1) {
+    solve1x1(isl);
+  } else if (isl.n == 2) {
+    solve2x2(isl);
+  } else if (m_useTree && isl.isTree && solveTree(isl)) {
+    // solved
+  } else if (isl.n <= m_denseThreshold && solveDense(isl)) {
+    // solved
+  } else if (m_method != SOLVER_DIRECT && solveIterative(isl)) {
+    // solved
+  } else {
+    solveSparse(isl);
+  }
+
+  applyForces(isl);
+}
+
+void Solver::applyForces(const Island& isl) {
+    // Store results
+    // Remember that we need to divide lambda by the timestep size
+    // f = G'*lambda
+    for (int i = isl.row; i < isl.row + isl.n; ++i){
+        Equation * eq = m_rows[i];
+        double l = lambda[i] / m_timeStep;
+
+        for (Connector *conn : eq->m_connectors) {
+            JacobianElement G = eq->jacobianElementForConnector(conn);
+            Vec3 f = G.m_spatial    * l;
+            Vec3 t = G.m_rotational * l;
+            conn->m_force  += f;
+            conn->m_torque += t;
+        }
+    }
+}
+
+void Solver::solveSparse(Island& isl) {
+    int n = isl.n;
+    double Info [UMFPACK_INFO];
+    void *Numeric = NULL;
+
+    // Islands solved by the other paths never need the column form, so it is made on first use
+    if (isl.Ap.empty()) {
+        constructColumnForm(isl);
+    }
+
+    // Triplet form to column form, using the map computed in constructColumnForm()
+    // Duplicate triplets are summed, same as umfpack_di_triplet_to_col() does
+    std::fill(isl.Ax.begin(), isl.Ax.end(), 0.0);
+    for (int x = 0; x < isl.nz; x++) {
+        isl.Ax[isl.Smap[x]] += Sval[isl.triplet + x];
+    }
+
+    int status;
+    auto t0 = std::chrono::steady_clock::now();
+
+    // symbolic factorization, only redone when the pattern of S changes
+    if (!isl.Symbolic) {
+        status = umfpack_di_symbolic (n, n, isl.Ap.data(), isl.Ai.data(), isl.Ax.data(), &isl.Symbolic, Control, Info) ;
+        if (status < 0){
+            umfpack_di_report_info (Control, Info) ;
+            umfpack_di_report_status (Control, status) ;
+            fprintf(stderr,"umfpack_di_symbolic failed\n") ;
+            exit(1);
+        }
+    }
+
+    // numeric factorization
+    status = umfpack_di_numeric (isl.Ap.data(), isl.Ai.data(), isl.Ax.data(), isl.Symbolic, &Numeric, Control, Info) ;
+    if (status < 0){
+        umfpack_di_report_info (Control, Info) ;
+        umfpack_di_report_status (Control, status) ;
+        fprintf(stderr,"umfpack_di_numeric failed\n") ;
+        exit(1);
+    }
+    isl.factorTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // solve S*lambda = B
+    status = umfpack_di_solve (UMFPACK_A, isl.Ap.data(), isl.Ai.data(), isl.Ax.data(), &lambda[isl.row], &rhs[isl.row], Numeric, Control, Info) ;
+    umfpack_di_report_info (Control, Info) ;
+    umfpack_di_report_status (Control, status) ;
+    if (status < 0){
+        fprintf(stderr,"umfpack_di_solve failed\n") ;
+        exit(1);
     }
+    umfpack_di_free_numeric(&Numeric);
 }
 
-void Solver::solve1x1() {
+void Solver::solve1x1(const Island& isl) {
   //S*lambda = rhs
-  lambda[0] = rhs[0] / Sval[0];
+  lambda[isl.row] = rhs[isl.row] / Sval[isl.triplet];
 }
 
-void Solver::solve2x2() {
+void Solver::solve2x2(const Island& isl) {
   //S*lambda = rhs
   double S[2][2] = {{0,0},{0,0}};
   double Sinv[2][2];
+  const double *b = &rhs[isl.row];
 
-  for (size_t x = 0; x < Srow.size(); x++) {
-    S[Srow[x]][Scol[x]] = Sval[x];
+  for (int x = isl.triplet; x < isl.triplet + isl.nz; x++) {
+    S[Srow[x] - isl.row][Scol[x] - isl.row] = Sval[x];
   }
 
   //ad - bc
@@ -406,8 +1035,365 @@ void Solver::solve2x2() {
   Sinv[1][0] = -S[1][0] / det;
   Sinv[0][1] = -S[0][1] / det;
 
-  lambda[0] = Sinv[0][0] * rhs[0] + Sinv[0][1] * rhs[1];
-  lambda[1] = Sinv[1][0] * rhs[0] + Sinv[1][1] * rhs[1];
+  lambda[isl.row]   = Sinv[0][0] * b[0] + Sinv[0][1] * b[1];
+  lambda[isl.row+1] = Sinv[1][0] * b[0] + Sinv[1][1] * b[1];
+}
+
+// y += a*x. Kept as a plain unit stride loop so that the compiler turns it into SIMD code
+static inline void axpy(double *y, const double *x, double a, int n) {
+  for (int j = 0; j < n; j++) {
+    y[j] += a * x[j];
+  }
+}
+
+void Solver::allocateDense(Island& isl) {
+  //rows padded to a multiple of four doubles, so that with the first row on a 32 byte boundary every row is.
+  //the three extra doubles leave room for moving the start there
+  isl.denseStride = (isl.n + 3) & ~3;
+  isl.dense.resize(isl.n * isl.denseStride + 3);
+}
+
+bool Solver::solveDense(Island& isl) {
+  //S*lambda = rhs, S symmetric positive definite
+  //S = L*D*L^T is computed in place in the upper triangle, which then holds D on the diagonal and L^T above it
+  int n = isl.n;
+  auto t0 = std::chrono::steady_clock::now();
+
+  //the threshold may have been raised since the island was made
+  if (isl.dense.empty()) {
+    allocateDense(isl);
+  }
+  double *A = isl.denseRows();
+  int ld = isl.denseStride;
+  std::fill(A, A + n * ld, 0.0);
+  double *x = &lambda[isl.row];
+  const double *b = &rhs[isl.row];
+
+  for (int t = isl.triplet; t < isl.triplet + isl.nz; t++) {
+    A[(Srow[t] - isl.row)*ld + Scol[t] - isl.row] += Sval[t];
+  }
+
+  //S comes from numerical directional derivatives, so it is only symmetric up to noise.
+  //Use the symmetric part if the difference is small enough, else let UMFPACK deal with it.
+  //Entries which should be zero are compared against the size of the diagonal instead.
+  const double tol = 1e-6;
+  double dmax = 0;
+  for (int i = 0; i < n; i++) {
+    dmax = std::max(dmax, fabs(A[i*ld + i]));
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = i+1; j < n; j++) {
+      double a = A[i*ld + j], c = A[j*ld + i];
+      if (fabs(a - c) > tol * (fabs(a) + fabs(c) + 1e-6 * dmax)) {
+        return false;
+      }
+      A[i*ld + j] = 0.5 * (a + c);
+    }
+  }
+
+  //right-looking factorization. row k of the upper triangle is column k of the lower
+  for (int k = 0; k < n; k++) {
+    double *Ak = &A[k*ld];
+    double d = Ak[k];
+    if (!(d > 0)) {
+      //not positive definite (or NaN)
+      return false;
+    }
+    double dinv = 1.0 / d;
+
+    for (int i = k+1; i < n; i++) {
+      //A[i][i..n-1] -= l_ik * d * A[k][i..n-1], where l_ik * d = A[k][i]
+      axpy(&A[i*ld + i], &Ak[i], -Ak[i] * dinv, n - i);
+    }
+
+    //scale row k into L^T
+    for (int i = k+1; i < n; i++) {
+      Ak[i] *= dinv;
+    }
+  }
+  isl.factorTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  //forward substitution L*y = rhs, column oriented
+  for (int i = 0; i < n; i++) {
+    x[i] = b[i];
+  }
+  for (int k = 0; k < n; k++) {
+    axpy(&x[k+1], &A[k*ld + k+1], -x[k], n - k - 1);
+  }
+
+  //diagonal
+  for (int k = 0; k < n; k++) {
+    x[k] /= A[k*ld + k];
+  }
+
+  //backward substitution L^T*lambda = z
+  for (int k = n-1; k >= 0; k--) {
+    const double *Ak = &A[k*ld];
+    double sum = 0;
+    for (int i = k+1; i < n; i++) {
+      sum += Ak[i] * x[i];
+    }
+    x[k] -= sum;
+  }
+
+  return true;
+}
+
+// In place LU factorization with partial pivoting of the m*m row major matrix A with row stride lda.
+// Returns false if A is singular.
+static bool luFactor(double *A, int lda, int *piv, int m) {
+  for (int k = 0; k < m; k++) {
+    int p = k;
+    for (int i = k+1; i < m; i++) {
+      if (fabs(A[i*lda + k]) > fabs(A[p*lda + k])) {
+        p = i;
+      }
+    }
+    piv[k] = p;
+    if (!(A[p*lda + k] != 0) || !std::isfinite(A[p*lda + k])) {
+      return false;
+    }
+    if (p != k) {
+      for (int j = 0; j < m; j++) {
+        std::swap(A[k*lda + j], A[p*lda + j]);
+      }
+    }
+    double dinv = 1.0 / A[k*lda + k];
+    for (int i = k+1; i < m; i++) {
+      double l = A[i*lda + k] *= dinv;
+      for (int j = k+1; j < m; j++) {
+        A[i*lda + j] -= l * A[k*lda + j];
+      }
+    }
+  }
+  return true;
+}
+
+// Solves A*x = b using the factorization from luFactor(). b has stride inc, and is overwritten by x
+static void luSolve(const double *A, int lda, const int *piv, int m, double *b, int inc) {
+  for (int k = 0; k < m; k++) {
+    if (piv[k] != k) {
+      std::swap(b[k*inc], b[piv[k]*inc]);
+    }
+  }
+  for (int i = 1; i < m; i++) {
+    for (int j = 0; j < i; j++) {
+      b[i*inc] -= A[i*lda + j] * b[j*inc];
+    }
+  }
+  for (int i = m-1; i >= 0; i--) {
+    for (int j = i+1; j < m; j++) {
+      b[i*inc] -= A[i*lda + j] * b[j*inc];
+    }
+    b[i*inc] /= A[i*lda + i];
+  }
+}
+
+bool Solver::solveTree(Island& isl) {
+  //S*lambda = rhs where slaves and constraints form a tree. Each separator (shared slave) couples
+  //its child blocks C to its parent block p and nothing else, so eliminating C from the leaves up
+  //causes no fill-in outside the parent's diagonal block:
+  //  S_pp -= S_pC * inv(S_CC) * S_Cp
+  //  b_p  -= S_pC * inv(S_CC) * b_C
+  //For a chain of slaves this is the block Thomas algorithm
+  double *vals = m_treeVals.data();
+  auto t0 = std::chrono::steady_clock::now();
+
+  //the island's separators own disjoint parts of m_treeVals and m_treeRhs, so islands can do this at the same time
+  const Separator& first = m_separators[isl.sep],
+                 & last  = m_separators[isl.sep + isl.nseps - 1];
+  std::fill(vals + first.vals, vals + last.vals + (last.m + last.mp) * (last.m + last.mp), 0.0);
+  for (int x = isl.triplet; x < isl.triplet + isl.nz; x++) {
+    vals[m_treeMap[x]] += Sval[x];
+  }
+  for (int q = isl.sep; q < isl.sep + isl.nseps; q++) {
+    const Separator& sep = m_separators[q];
+    for (int c = sep.child; c < sep.child + sep.nchild; c++) {
+      int b = m_sepChildren[c];
+      std::copy(rhs.begin() + m_blockStart[b], rhs.begin() + m_blockStart[b+1], m_treeRhs.begin() + m_blockSlot[b]);
+    }
+  }
+
+  for (int q = isl.sep + isl.nseps - 1; q >= isl.sep; q--) {
+    const Separator& sep = m_separators[q];
+    int m = sep.m, mp = sep.mp, d = m + mp;
+    double *A = &vals[sep.vals],
+           *b = &m_treeRhs[sep.slot];
+    int *piv = &m_treePivots[sep.slot];
+
+    if (!luFactor(A, d, piv, m)) {
+      return false;
+    }
+
+    //b_C := inv(S_CC) * b_C
+    luSolve(A, d, piv, m, b, 1);
+
+    if (sep.parent < 0) {
+      continue;
+    }
+
+    //S_Cp := inv(S_CC) * S_Cp, which is what the back substitution needs
+    for (int c = 0; c < mp; c++) {
+      luSolve(A, d, piv, m, A + m + c, d);
+    }
+
+    const double *W = A + m;
+    double *Dp = &vals[m_blockDiag[sep.parent]],
+           *bp = &m_treeRhs[m_blockSlot[sep.parent]];
+    int ldp = m_blockStride[sep.parent];
+    for (int i = 0; i < mp; i++) {
+      const double *U = &A[(m + i)*d];
+      for (int j = 0; j < m; j++) {
+        double u = U[j];
+        bp[i] -= u * b[j];
+        axpy(&Dp[i*ldp], &W[j*d], -u, mp);
+      }
+    }
+  }
+
+  isl.factorTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  //back substitution from the root: lambda_C = b_C - W_C * lambda_p
+  for (int q = isl.sep; q < isl.sep + isl.nseps; q++) {
+    const Separator& sep = m_separators[q];
+    int m = sep.m, mp = sep.mp, d = m + mp;
+    double *b = &m_treeRhs[sep.slot];
+
+    if (sep.parent >= 0) {
+      const double *W = &vals[sep.vals] + m,
+                   *xp = &lambda[m_blockStart[sep.parent]];
+      for (int i = 0; i < m; i++) {
+        double sum = 0;
+        for (int c = 0; c < mp; c++) {
+          sum += W[i*d + c] * xp[c];
+        }
+        b[i] -= sum;
+      }
+    }
+
+    for (int c = sep.child; c < sep.child + sep.nchild; c++) {
+      int k = m_sepChildren[c];
+      std::copy(m_treeRhs.begin() + m_blockSlot[k], m_treeRhs.begin() + m_blockSlot[k] + m_blockStart[k+1] - m_blockStart[k],
+                lambda.begin() + m_blockStart[k]);
+    }
+  }
+
+  return true;
+}
+
+// y = S*x for the rows of an island. x and y are indexed by row
+void Solver::multiplyS(const Island& isl, const double *x, double *y) const {
+  for (int i = isl.row; i < isl.row + isl.n; i++) {
+    double sum = 0;
+    for (int k = SrowStart[i]; k < SrowStart[i+1]; k++) {
+      sum += Sval[k] * x[Scol[k]];
+    }
+    y[i] = sum;
+  }
+}
+
+// r = rhs - S*lambda for the rows of an island, returns |r|
+double Solver::residual(const Island& isl, double *r) const {
+  double rr = 0;
+  multiplyS(isl, lambda.data(), r);
+  for (int i = isl.row; i < isl.row + isl.n; i++) {
+    r[i] = rhs[i] - r[i];
+    rr += r[i]*r[i];
+  }
+  return sqrt(rr);
+}
+
+bool Solver::solveIterative(Island& isl) {
+  //S*lambda = rhs, starting from whatever is in lambda from the previous step.
+  //The system changes little between steps, so this is usually a few iterations from the solution.
+  //Work vectors are indexed by row, so islands use disjoint parts of them
+  int i0 = isl.row, i1 = isl.row + isl.n;
+  double *r = m_r.data(), *z = m_z.data(), *p = m_p.data(), *q = m_q.data();
+
+  double bnorm = 0;
+  for (int i = i0; i < i1; i++) {
+    bnorm += rhs[i]*rhs[i];
+  }
+  bnorm = sqrt(bnorm);
+
+  if (bnorm == 0) {
+    std::fill(lambda.begin() + i0, lambda.begin() + i1, 0.0);
+    isl.iterations = 0;
+    isl.residual = 0;
+    return true;
+  }
+
+  for (int i = i0; i < i1; i++) {
+    if (!(Sval[Sdiag[i]] > 0)) {
+      //not positive definite (or NaN)
+      return false;
+    }
+  }
+
+  double tol = m_tolerance * bnorm;
+  double rnorm = residual(isl, r);
+  int it = 0;
+
+  if (m_method == SOLVER_PCG) {
+    //z = D^-1 r
+    double rz = 0;
+    for (int i = i0; i < i1; i++) {
+      z[i] = r[i] / Sval[Sdiag[i]];
+      p[i] = z[i];
+      rz += r[i] * z[i];
+    }
+
+    for (; it < m_maxIterations && rnorm > tol; it++) {
+      multiplyS(isl, p, q);
+
+      double pq = 0;
+      for (int i = i0; i < i1; i++) {
+        pq += p[i] * q[i];
+      }
+      if (!(pq > 0)) {
+        return false;
+      }
+
+      double alpha = rz / pq, rz2 = 0, rr = 0;
+      for (int i = i0; i < i1; i++) {
+        lambda[i] += alpha * p[i];
+        r[i]      -= alpha * q[i];
+        z[i]       = r[i] / Sval[Sdiag[i]];
+        rz2 += r[i] * z[i];
+        rr  += r[i] * r[i];
+      }
+
+      double beta = rz2 / rz;
+      for (int i = i0; i < i1; i++) {
+        p[i] = z[i] + beta * p[i];
+      }
+      rz = rz2;
+      rnorm = sqrt(rr);
+    }
+  } else {
+    //each sweep solves equation i for lambda_i, using the latest values of the others
+    for (; it < m_maxIterations && rnorm > tol; it++) {
+      for (int i = i0; i < i1; i++) {
+        double sum = rhs[i];
+        for (int k = SrowStart[i]; k < SrowStart[i+1]; k++) {
+          sum -= Sval[k] * lambda[Scol[k]];
+        }
+        lambda[i] += sum / Sval[Sdiag[i]];
+      }
+      rnorm = residual(isl, r);
+    }
+  }
+
+  isl.iterations = it;
+  isl.residual = rnorm / bnorm;
+
+  //the recursively updated residual in PCG drifts from the real one, so check the real one
+  //with some slack. if we did not get there, the caller falls back to UMFPACK
+  if (m_method == SOLVER_PCG) {
+    isl.residual = residual(isl, r) / bnorm;
+  }
+
+  return isl.residual <= 2 * m_tolerance;
 }
 
 /// Get a constraint
@@ -0,0 +1,72 @@
+#include "sc/ThreadPool.h"
+
+using namespace sc;
+
+ThreadPool::ThreadPool(int numThreads){
+    m_n = 0;
+    m_next = 0;
+    m_finished = 0;
+    m_quit = false;
+
+    for (int i = 0; i < numThreads; i++) {
+        m_threads.push_back(std::thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+
+    for (std::thread& t : m_threads) {
+        t.join();
+    }
+}
+
+int ThreadPool::getNumThreads() const {
+    return m_threads.size();
+}
+
+void ThreadPool::work(){
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        m_wake.wait(lock, [this]{ return m_quit || m_next < m_n; });
+        if (m_quit) {
+            return;
+        }
+
+        int i = m_next++;
+        lock.unlock();
+        m_fn(i);
+        lock.lock();
+
+        if (++m_finished == m_n) {
+            m_done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::start(int n, std::function<void(int)> fn){
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn = fn;
+        m_n = n;
+        m_next = 0;
+        m_finished = 0;
+    }
+    m_wake.notify_all();
+}
+
+void ThreadPool::wait(){
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_finished == m_n; });
+}
+
+void ThreadPool::parallelFor(int n, std::function<void(int)> fn){
+    start(n, fn);
+    wait();
+}
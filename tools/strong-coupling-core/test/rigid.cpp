@@ -208,6 +208,9 @@ int main(int argc, char ** argv){
     // Set spook parameters on all equations
     solver.setSpookParams(relaxation,compliance,dt);
 
+    // Set up system matrix structure and mobility storage
+    solver.prepare();
+
     // Get system equations
     std::vector<Equation*> eqs = solver.getEquations();
 
@@ -314,7 +317,7 @@ int main(int argc, char ** argv){
                     body->getDirectionalDerivative(ddSpatial,ddRotational,body->m_position,spatSeed,rotSeed, dt);
                     int I = conn->m_index;
                     int J = eq->m_index;
-                    JacobianElement &el = solver.m_mobilities[std::make_pair(I,J)];
+                    JacobianElement &el = solver.getMobility(I,J);
                     el.setSpatial(ddSpatial);
                     el.setRotational(ddRotational);
                 }
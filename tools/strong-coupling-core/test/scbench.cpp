@@ -0,0 +1,541 @@
+/*
+ * Micro-benchmarks for sc::Solver, using the same RigidBody harness as rigid.cpp.
+ * No FMUs involved. Results are printed as CSV on STDOUT.
+ */
+
+#include "RigidBody.h"
+#include "sc/Quat.h"
+#include "sc/Vec3.h"
+#include "sc/Solver.h"
+#include "sc/Slave.h"
+#include "sc/Connector.h"
+#include "sc/Constraint.h"
+#include "sc/LockConstraint.h"
+#include "sc/BallJointConstraint.h"
+#include "sc/HingeConstraint.h"
+#include "sc/ShaftConstraint.h"
+#include "sc/MultiWayConstraint.h"
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+using namespace sc;
+
+void printHelp(char * command){
+    printf("\nUsage:\n\
+\t%s [OPTIONS]\
+\n\
+\n\
+[OPTIONS]\n\
+\n\
+\t--minSize <integer>\tSmallest number of equations per island. Default 1.\n\
+\t--maxSize <integer>\tLargest number of equations per island. Default 128.\n\
+\t--reps    <integer>\tNumber of solves to time per size. Default 100.\n\
+\t--islands <integer>\tNumber of independent chains of each size. Default 1.\n\
+\t--threads <integer>\tNumber of threads to solve islands on. Default 1.\n\
+\t--method  <string> \tCompare iterative method \"pcg\" or \"gs\" against UMFPACK instead.\n\
+\t--tolerance <float>\tRelative residual for --method. Default 1e-10.\n\
+\t--steps   <integer>\tNumber of time steps to simulate with --method. Default 100.\n\
+\t--scaling          \tTime the phases of solve() on large systems instead.\n\
+\t--maxConstraints <integer>\tLargest system for --scaling. Default 32000.\n\
+\t--topology <string>\tTime the phases of solve() on generated graphs instead: \"chain\", \"tree\",\n\
+\t                  \t\"grid\", \"random\" or \"all\".\n\
+\t--maxBodies <integer>\tLargest graph for --topology. Default 4096.\n\
+\t--seed    <integer>\tRandom seed for --topology random. Default 1.\n\
+\t--help,-h         \tPrint help and quit.\n\
+\n\
+Prints CSV: n,dense_us,sparse_us,tree_us,max_force_diff\n\
+dense_us, sparse_us and tree_us are the average time of one Solver::solve() in microseconds.\n\
+max_force_diff is the largest difference of the dense and tree forces from the sparse ones.\n\
+\n\
+With --method: n,direct_us,iterative_us,avg_iterations,max_iterations,max_residual,max_force_diff\n\
+Two copies of the system are stepped side by side, one solved with UMFPACK and one with the\n\
+iterative method warm started from the previous step. Both copies are advanced with the\n\
+UMFPACK forces, so max_force_diff is the iterative solver's error. Times are per step.\n\
+\n\
+With --scaling: constraints,equations,threads,update_us,assembly_us,solve_us\n\
+Chains of 1000, 2000, 4000 ... constraints, split into --islands chains. Times are per step\n\
+for Solver::updateConstraints() and the assembly and solve phases of Solver::solve().\n\
+\n\
+With --topology: topology,bodies,constraints,equations,islands,threads,construct_us,assembly_us,factor_us,solve_us\n\
+Graphs of 8, 16, 32 ... bodies with locks, hinges, ball joints, shafts and multi-way constraints\n\
+taking turns along the edges. construct_us is the analysis of S done once by Solver::prepare().\n\
+The other times are per step. factor_us is the factorization part of the solve phase, and\n\
+solve_us is the rest of it.\n\n",command);
+}
+
+/// A rigid.cpp style system: bodies with one connector each, held together by constraints
+struct System {
+    Solver solver;
+    std::vector<RigidBody*> bodies;
+    std::vector<Slave*> slaves;
+    double dt;
+
+    ~System() {
+        for (RigidBody *b : bodies) {
+            delete b;
+        }
+        for (Slave *s : slaves) {
+            delete s;
+        }
+    }
+
+    Connector * addBody(int i) {
+        Vec3 halfExtents(0.1,0.05,0.05);
+        RigidBody * body = new RigidBody();
+        body->m_position[0] = (double)halfExtents[0]*2*i;
+        body->setLocalInertiaAsBox(i == 0 ? 0 : 1, halfExtents);
+        body->m_gravity.set(0,-9.81,0);
+
+        Slave * slave = new Slave();
+        Connector * conn = new Connector();
+        slave->addConnector(conn);
+        conn->m_userData = (void*)body;
+        solver.addSlave(slave);
+
+        bodies.push_back(body);
+        slaves.push_back(slave);
+        return conn;
+    }
+};
+
+/*
+ * Builds a chain of bodies where the constraints add up to exactly neq equations.
+ * Locks (6), hinges (5), ball joints (3) and shafts (1) are used, largest first.
+ */
+void buildChain(System& sys, int neq){
+    Vec3 halfExtents(0.1,0.05,0.05);
+    Connector * last = sys.addBody(0);
+
+    for (int i = 1; neq > 0; i++) {
+        Connector * conn = sys.addBody(i);
+        Constraint * c;
+        Vec3 a(halfExtents[0],0,0), b(-halfExtents[0],0,0);
+
+        if (neq >= 6 && i % 2 == 0) {
+            c = new LockConstraint(last, conn, a, b, Quat(0,0,0,1), Quat(0,0,0,1));
+        } else if (neq >= 5) {
+            c = new HingeConstraint(last, conn, a, b, Vec3(0,0,1), Vec3(0,0,1));
+        } else if (neq >= 3) {
+            c = new BallJointConstraint(last, conn, a, b);
+        } else {
+            c = new ShaftConstraint(last, conn);
+        }
+        neq -= c->getNumEquations();
+        sys.solver.addConstraint(c);
+        last = conn;
+    }
+}
+
+/*
+ * Body pairs of a chain, a binary tree, a square grid or a random connected graph of n bodies.
+ * The random graph is a random spanning tree plus n/2 extra edges.
+ */
+void buildEdges(const char *topology, int n, std::mt19937& rng, std::vector<std::pair<int,int> >& edges){
+    edges.clear();
+
+    if (!strcmp(topology, "chain")) {
+        for (int i = 1; i < n; i++) {
+            edges.push_back(std::make_pair(i-1, i));
+        }
+    } else if (!strcmp(topology, "tree")) {
+        for (int i = 1; i < n; i++) {
+            edges.push_back(std::make_pair((i-1)/2, i));
+        }
+    } else if (!strcmp(topology, "grid")) {
+        int w = (int)ceil(sqrt((double)n));
+        for (int i = 0; i < n; i++) {
+            if ((i+1) % w != 0 && i+1 < n) {
+                edges.push_back(std::make_pair(i, i+1));
+            }
+            if (i+w < n) {
+                edges.push_back(std::make_pair(i, i+w));
+            }
+        }
+    } else if (!strcmp(topology, "random")) {
+        for (int i = 1; i < n; i++) {
+            edges.push_back(std::make_pair((int)(rng() % i), i));
+        }
+        for (int k = 0; k < n/2; k++) {
+            int a = rng() % n, b = rng() % n;
+            if (a != b) {
+                edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+            }
+        }
+    } else {
+        fprintf(stderr, "Unknown topology %s\n", topology);
+        exit(1);
+    }
+}
+
+/*
+ * Adds n bodies and a constraint for each edge. The constraint types take turns.
+ * Anchors are put halfway between the bodies, so nothing is violated at the start.
+ * If multiWay3 is set then multi-way constraints get a random third body, like a differential,
+ * which means the constraint graph is no longer a tree.
+ */
+void buildGraph(System& sys, int n, const std::vector<std::pair<int,int> >& edges, bool multiWay3, std::mt19937& rng){
+    std::vector<Connector*> conns;
+    for (int i = 0; i < n; i++) {
+        conns.push_back(sys.addBody(i));
+    }
+
+    for (size_t e = 0; e < edges.size(); e++) {
+        int i = edges[e].first, j = edges[e].second;
+        RigidBody *bi = sys.bodies[i], *bj = sys.bodies[j];
+        Vec3 half = (bj->m_position - bi->m_position) * 0.5;
+        Vec3 a = half, b = half * -1;
+        Constraint * c;
+
+        switch (e % 5) {
+        case 0: c = new LockConstraint(conns[i], conns[j], a, b, Quat(0,0,0,1), Quat(0,0,0,1)); break;
+        case 1: c = new HingeConstraint(conns[i], conns[j], a, b, Vec3(0,0,1), Vec3(0,0,1)); break;
+        case 2: c = new BallJointConstraint(conns[i], conns[j], a, b); break;
+        case 3: c = new ShaftConstraint(conns[i], conns[j]); break;
+        default: {
+            std::vector<Connector*> mc = {conns[i], conns[j]};
+            std::vector<double> weights = {1, -1};
+            int k = rng() % n;
+            if (multiWay3 && k != i && k != j) {
+                mc.push_back(conns[k]);
+                weights = {-1, 1, 1};
+            }
+            c = new MultiWayConstraint(mc, weights);
+            break;
+        }
+        }
+        sys.solver.addConstraint(c);
+    }
+}
+
+/*
+ * Sets connector values, future velocities and mobilities, like the time loop in rigid.cpp
+ */
+void setupStep(System& sys){
+    Solver& solver = sys.solver;
+
+    for (size_t j = 0; j < sys.bodies.size(); ++j){
+        RigidBody * body = sys.bodies[j];
+        Connector * conn = sys.slaves[j]->getConnector(0);
+        conn->m_position       .copy(body->m_position);
+        conn->m_quaternion     .copy(body->m_quaternion);
+        conn->m_velocity       .copy(body->m_velocity);
+        conn->m_angularVelocity.copy(body->m_angularVelocity);
+
+        body->saveState();
+        body->integrate(sys.dt);
+        conn->setFutureVelocity(body->m_velocity,body->m_angularVelocity);
+        body->restoreState();
+    }
+
+    solver.updateConstraints();
+
+    for (Equation *eq : solver.getEquations()) {
+        for (Connector *conn : eq->m_connectors) {
+            RigidBody * body = (RigidBody *)conn->m_userData;
+            Vec3 ddSpatial, ddRotational;
+            body->getDirectionalDerivative(ddSpatial, ddRotational, body->m_position,
+                                           eq->jacobianElementForConnector(conn).getSpatial(),
+                                           eq->jacobianElementForConnector(conn).getRotational(), sys.dt);
+            JacobianElement &el = solver.getMobility(conn->m_index, eq->m_index);
+            el.setSpatial(ddSpatial);
+            el.setRotational(ddRotational);
+        }
+    }
+}
+
+/*
+ * Average time of one solve() in microseconds
+ */
+double timeSolve(System& sys, int reps){
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++) {
+        sys.solver.resetConstraintForces();
+        sys.solver.solve(true);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / reps;
+}
+
+/*
+ * Applies the constraint forces of forces, which must have the same layout as sys,
+ * and integrates the bodies of sys one step, like rigid.cpp
+ */
+void integrate(System& sys, System& forces){
+    for (size_t j = 0; j < sys.bodies.size(); ++j){
+        RigidBody * body = sys.bodies[j];
+        Connector * conn = forces.slaves[j]->getConnector(0);
+        body->m_force .copy(conn->m_force);
+        body->m_torque.copy(conn->m_torque);
+        body->integrate(sys.dt);
+    }
+}
+
+void integrate(System& sys){
+    integrate(sys, sys);
+}
+
+void getForces(System& sys, std::vector<double>& out){
+    out.clear();
+    for (Slave *s : sys.slaves) {
+        Connector * conn = s->getConnector(0);
+        for (int k = 0; k < 3; k++) {
+            out.push_back(conn->m_force[k]);
+            out.push_back(conn->m_torque[k]);
+        }
+    }
+}
+
+/*
+ * Steps a direct and an iterative copy of the same system and prints how they compare
+ */
+void compareIterative(int n, int islands, int threads, SolverMethod method, double tolerance, int steps){
+    System direct, iterative;
+    System *both[2] = {&direct, &iterative};
+    double t[2] = {0, 0};
+    int sumIterations = 0, maxIterations = 0;
+    double maxResidual = 0, maxdiff = 0;
+    std::vector<double> fdirect, fiterative;
+
+    for (int k = 0; k < 2; k++) {
+        System& sys = *both[k];
+        sys.dt = 0.01;
+        for (int c = 0; c < islands; c++) {
+            buildChain(sys, n);
+        }
+        sys.solver.setSpookParams(3, 0.001, sys.dt);
+        sys.solver.setNumThreads(threads);
+        sys.solver.setDenseThreshold(0);
+        sys.solver.setTreeSolver(false);
+        sys.solver.prepare();
+    }
+    iterative.solver.setMethod(method, tolerance, 10*n);
+
+    for (int i = 0; i < steps; i++) {
+        for (int k = 0; k < 2; k++) {
+            System& sys = *both[k];
+            setupStep(sys);
+            auto start = std::chrono::steady_clock::now();
+            sys.solver.resetConstraintForces();
+            sys.solver.solve(true);
+            auto end = std::chrono::steady_clock::now();
+            t[k] += std::chrono::duration<double, std::micro>(end - start).count();
+        }
+
+        int it = iterative.solver.getIterations();
+        sumIterations += it;
+        maxIterations = std::max(maxIterations, it);
+        maxResidual = std::max(maxResidual, iterative.solver.getResidual());
+
+        getForces(direct, fdirect);
+        getForces(iterative, fiterative);
+        for (size_t k = 0; k < fdirect.size(); k++) {
+            maxdiff = std::max(maxdiff, fabs(fdirect[k] - fiterative[k]));
+        }
+
+        //both copies follow the direct forces, so each step solves the same S and rhs
+        //and max_force_diff is solver error rather than drift between two trajectories
+        integrate(direct);
+        integrate(iterative, direct);
+    }
+
+    printf("%d,%lf,%lf,%lf,%d,%g,%g\n", n, t[0] / steps, t[1] / steps,
+           (double)sumIterations / steps, maxIterations, maxResidual, maxdiff);
+}
+
+/*
+ * Times updateConstraints(), assembly and solving for large systems
+ */
+void scaling(int maxConstraints, int islands, int threads, int reps){
+    printf("constraints,equations,threads,update_us,assembly_us,solve_us\n");
+
+    for (int nc = 1000; nc <= maxConstraints; nc *= 2) {
+        System sys;
+        sys.dt = 0.01;
+        for (int c = 0; c < islands; c++) {
+            //locks and hinges alternate, 5.5 equations per constraint
+            buildChain(sys, nc * 11 / 2 / islands);
+        }
+        sys.solver.setSpookParams(3, 0.001, sys.dt);
+        sys.solver.setNumThreads(threads);
+        sys.solver.prepare();
+
+        double tupdate = 0, tassembly = 0, tsolve = 0;
+        for (int r = 0; r < reps; r++) {
+            setupStep(sys);
+
+            auto start = std::chrono::steady_clock::now();
+            sys.solver.updateConstraints();
+            auto end = std::chrono::steady_clock::now();
+            tupdate += std::chrono::duration<double, std::micro>(end - start).count();
+
+            sys.solver.resetConstraintForces();
+            sys.solver.solve(true);
+            tassembly += sys.solver.getAssemblyTime() * 1e6;
+            tsolve    += sys.solver.getSolveTime() * 1e6;
+        }
+
+        printf("%d,%d,%d,%lf,%lf,%lf\n", sys.solver.getNumConstraints(), sys.solver.getSystemMatrixRows(),
+               threads, tupdate / reps, tassembly / reps, tsolve / reps);
+    }
+}
+
+/*
+ * Times constructS(), assembly, factorization and the rest of solve() on generated graphs
+ */
+void topologyScaling(const char *topology, int maxBodies, int threads, int reps, int seed){
+    for (int n = 8; n <= maxBodies; n *= 2) {
+        std::mt19937 rng(seed);
+        std::vector<std::pair<int,int> > edges;
+        System sys;
+        sys.dt = 0.01;
+        buildEdges(topology, n, rng, edges);
+        buildGraph(sys, n, edges, !strcmp(topology, "grid") || !strcmp(topology, "random"), rng);
+        sys.solver.setSpookParams(3, 0.001, sys.dt);
+        sys.solver.setNumThreads(threads);
+        sys.solver.prepare();
+
+        double tassembly = 0, tfactor = 0, tsolve = 0;
+        for (int r = 0; r < reps; r++) {
+            setupStep(sys);
+            sys.solver.resetConstraintForces();
+            sys.solver.solve(true);
+            tassembly += sys.solver.getAssemblyTime() * 1e6;
+            tfactor   += sys.solver.getFactorizationTime() * 1e6;
+            tsolve    += (sys.solver.getSolveTime() - sys.solver.getFactorizationTime()) * 1e6;
+        }
+
+        printf("%s,%d,%d,%d,%d,%d,%lf,%lf,%lf,%lf\n", topology, n, sys.solver.getNumConstraints(),
+               sys.solver.getSystemMatrixRows(), sys.solver.getNumIslands(), threads,
+               sys.solver.getConstructTime() * 1e6, tassembly / reps, tfactor / reps, tsolve / reps);
+    }
+}
+
+int main(int argc, char ** argv){
+    int minSize = 1,
+        maxSize = 128,
+        reps = 100,
+        steps = 100,
+        islands = 1,
+        threads = 1,
+        maxConstraints = 32000,
+        maxBodies = 4096,
+        seed = 1,
+        doScaling = 0;
+    double tolerance = 1e-10;
+    const char * method = NULL;
+    const char * topology = NULL;
+
+    for (int i = 0; i < argc; ++i){
+        char * a = argv[i];
+        int last = (i == argc-1);
+
+        if(!last){
+            if(!strcmp(a,"--minSize")) minSize = atoi(argv[i+1]);
+            if(!strcmp(a,"--maxSize")) maxSize = atoi(argv[i+1]);
+            if(!strcmp(a,"--reps"))    reps = atoi(argv[i+1]);
+            if(!strcmp(a,"--steps"))   steps = atoi(argv[i+1]);
+            if(!strcmp(a,"--islands")) islands = atoi(argv[i+1]);
+            if(!strcmp(a,"--threads")) threads = atoi(argv[i+1]);
+            if(!strcmp(a,"--maxConstraints")) maxConstraints = atoi(argv[i+1]);
+            if(!strcmp(a,"--method"))  method = argv[i+1];
+            if(!strcmp(a,"--tolerance")) tolerance = atof(argv[i+1]);
+            if(!strcmp(a,"--topology")) topology = argv[i+1];
+            if(!strcmp(a,"--maxBodies")) maxBodies = atoi(argv[i+1]);
+            if(!strcmp(a,"--seed"))    seed = atoi(argv[i+1]);
+        }
+
+        if(!strcmp(a,"--scaling")) doScaling = 1;
+
+        if(strcmp(argv[i],"--help")==0 || strcmp(argv[i],"-h")==0){
+            printHelp(argv[0]);
+            return 0;
+        }
+    }
+
+    if (topology) {
+        std::vector<const char*> topologies = {"chain", "tree", "grid", "random"};
+        if (strcmp(topology, "all")) {
+            if (std::find_if(topologies.begin(), topologies.end(), [topology](const char *t) { return !strcmp(t, topology); }) == topologies.end()) {
+                fprintf(stderr, "Unknown topology %s\n", topology);
+                return 1;
+            }
+            topologies = {topology};
+        }
+
+        printf("topology,bodies,constraints,equations,islands,threads,construct_us,assembly_us,factor_us,solve_us\n");
+        for (const char *t : topologies) {
+            topologyScaling(t, maxBodies, threads, reps, seed);
+        }
+        return 0;
+    }
+
+    if (doScaling) {
+        scaling(maxConstraints, islands, threads, reps);
+        return 0;
+    }
+
+    if (method) {
+        SolverMethod m;
+        if (!strcmp(method, "pcg")) {
+            m = SOLVER_PCG;
+        } else if (!strcmp(method, "gs")) {
+            m = SOLVER_GS;
+        } else {
+            fprintf(stderr, "Unknown method %s\n", method);
+            return 1;
+        }
+
+        //1x1 and 2x2 systems are always solved directly
+        printf("n,direct_us,iterative_us,avg_iterations,max_iterations,max_residual,max_force_diff\n");
+        for (int n = std::max(minSize, 3); n <= maxSize; n++) {
+            compareIterative(n, islands, threads, m, tolerance, steps);
+        }
+        return 0;
+    }
+
+    printf("n,dense_us,sparse_us,tree_us,max_force_diff\n");
+
+    for (int n = minSize; n <= maxSize; n++) {
+        System sys;
+        sys.dt = 0.01;
+        for (int c = 0; c < islands; c++) {
+            buildChain(sys, n);
+        }
+        sys.solver.setSpookParams(3, 0.001, sys.dt);
+        sys.solver.setNumThreads(threads);
+        sys.solver.prepare();
+        setupStep(sys);
+
+        std::vector<double> fdense, fsparse, ftree;
+
+        sys.solver.setTreeSolver(false);
+        sys.solver.setDenseThreshold(n);
+        double tdense = timeSolve(sys, reps);
+        getForces(sys, fdense);
+
+        sys.solver.setDenseThreshold(0);
+        double tsparse = timeSolve(sys, reps);
+        getForces(sys, fsparse);
+
+        //chains are always trees
+        sys.solver.setTreeSolver(true);
+        double ttree = timeSolve(sys, reps);
+        getForces(sys, ftree);
+
+        double maxdiff = 0;
+        for (size_t k = 0; k < fdense.size(); k++) {
+            maxdiff = std::max(maxdiff, fabs(fdense[k] - fsparse[k]));
+            maxdiff = std::max(maxdiff, fabs(ftree[k] - fsparse[k]));
+        }
+
+        printf("%d,%lf,%lf,%lf,%g\n", n, tdense, tsparse, ttree, maxdiff);
+    }
+
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Checks that systems where slaves are shared by several constraints take the tree path of sc::Solver,
+ * and that it gives the same forces as UMFPACK. Exits with 1 on failure.
+ */
+
+#include "RigidBody.h"
+#include "sc/Quat.h"
+#include "sc/Vec3.h"
+#include "sc/Solver.h"
+#include "sc/Slave.h"
+#include "sc/Connector.h"
+#include "sc/Constraint.h"
+#include "sc/LockConstraint.h"
+#include "sc/BallJointConstraint.h"
+#include "sc/HingeConstraint.h"
+#include "sc/ShaftConstraint.h"
+#include "sc/MultiWayConstraint.h"
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <math.h>
+
+using namespace sc;
+
+/// Bodies with one connector each, like rigid.cpp
+struct System {
+    Solver solver;
+    std::vector<RigidBody*> bodies;
+    std::vector<Slave*> slaves;
+    std::vector<Connector*> conns;
+
+    ~System() {
+        for (RigidBody *b : bodies) {
+            delete b;
+        }
+        for (Slave *s : slaves) {
+            delete s;
+        }
+    }
+
+    void addBody(double x, double y, double invMass) {
+        RigidBody * body = new RigidBody();
+        body->m_position.set(x, y, 0);
+        body->setLocalInertiaAsBox(invMass, Vec3(0.1,0.05,0.05));
+        body->m_gravity.set(0,-9.81,0);
+        body->m_velocity.set(0.1*y, 0.2*x, 0);
+        body->m_angularVelocity.set(0.5*y, 0, 0.3*x);
+
+        Slave * slave = new Slave();
+        Connector * conn = new Connector();
+        slave->addConnector(conn);
+        conn->m_userData = (void*)body;
+        solver.addSlave(slave);
+
+        bodies.push_back(body);
+        slaves.push_back(slave);
+        conns.push_back(conn);
+    }
+
+    /// Joins bodies i and j with constraint type t, anchored halfway between them
+    void join(int i, int j, int t) {
+        Vec3 half = (bodies[j]->m_position - bodies[i]->m_position) * 0.5;
+        Constraint * c;
+        switch (t % 4) {
+        case 0: c = new LockConstraint(conns[i], conns[j], half, half * -1, Quat(0,0,0,1), Quat(0,0,0,1)); break;
+        case 1: c = new HingeConstraint(conns[i], conns[j], half, half * -1, Vec3(0,0,1), Vec3(0,0,1)); break;
+        case 2: c = new BallJointConstraint(conns[i], conns[j], half, half * -1); break;
+        default: c = new ShaftConstraint(conns[i], conns[j]); break;
+        }
+        solver.addConstraint(c);
+    }
+};
+
+/*
+ * Sets up one time step like rigid.cpp, and solves it with the tree solver and with UMFPACK.
+ * Returns the largest difference in the forces.
+ */
+double compare(System& sys, bool& isTree){
+    Solver& solver = sys.solver;
+    double dt = 0.01;
+    std::vector<double> ftree, fsparse;
+
+    solver.setSpookParams(3, 0.001, dt);
+    solver.prepare();
+    isTree = solver.isTree();
+
+    for (size_t j = 0; j < sys.bodies.size(); ++j){
+        RigidBody * body = sys.bodies[j];
+        Connector * conn = sys.conns[j];
+        conn->m_position       .copy(body->m_position);
+        conn->m_quaternion     .copy(body->m_quaternion);
+        conn->m_velocity       .copy(body->m_velocity);
+        conn->m_angularVelocity.copy(body->m_angularVelocity);
+
+        body->saveState();
+        body->integrate(dt);
+        conn->setFutureVelocity(body->m_velocity,body->m_angularVelocity);
+        body->restoreState();
+    }
+
+    solver.updateConstraints();
+
+    for (Equation *eq : solver.getEquations()) {
+        for (Connector *conn : eq->m_connectors) {
+            RigidBody * body = (RigidBody *)conn->m_userData;
+            Vec3 ddSpatial, ddRotational;
+            body->getDirectionalDerivative(ddSpatial, ddRotational, body->m_position,
+                                           eq->jacobianElementForConnector(conn).getSpatial(),
+                                           eq->jacobianElementForConnector(conn).getRotational(), dt);
+            JacobianElement &el = solver.getMobility(conn->m_index, eq->m_index);
+            el.setSpatial(ddSpatial);
+            el.setRotational(ddRotational);
+        }
+    }
+
+    for (int k = 0; k < 2; k++) {
+        std::vector<double>& f = k == 0 ? ftree : fsparse;
+        solver.setTreeSolver(k == 0);
+        solver.setDenseThreshold(0);
+        solver.resetConstraintForces();
+        solver.solve(true);
+        for (Connector *conn : sys.conns) {
+            for (int x = 0; x < 3; x++) {
+                f.push_back(conn->m_force[x]);
+                f.push_back(conn->m_torque[x]);
+            }
+        }
+    }
+
+    double maxdiff = 0, maxf = 0;
+    for (size_t x = 0; x < ftree.size(); x++) {
+        maxdiff = std::max(maxdiff, fabs(ftree[x] - fsparse[x]));
+        maxf = std::max(maxf, fabs(fsparse[x]));
+    }
+    return maxdiff / std::max(maxf, 1.0);
+}
+
+int check(const char *name, System& sys, bool expectTree){
+    bool isTree;
+    double diff = compare(sys, isTree);
+    bool ok = isTree == expectTree && diff < 1e-9;
+    printf("%-12s isTree=%d diff=%g %s\n", name, isTree, diff, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+int main(){
+    int failed = 0;
+
+    //a hub shared by five constraints of every kind, fixed to the world through a sixth
+    {
+        System sys;
+        sys.addBody(0, 0, 0);
+        sys.addBody(0.2, 0, 1);
+        for (int i = 0; i < 5; i++) {
+            sys.addBody(0.4, 0.2*(i-2), 1);
+            sys.join(1, i+2, i);
+        }
+        sys.join(0, 1, 1);
+        failed += check("hub", sys, true);
+    }
+
+    //binary tree of bodies, where every inner body is shared by three constraints
+    {
+        System sys;
+        int n = 31;
+        for (int i = 0; i < n; i++) {
+            int depth = 0;
+            while ((2 << depth) - 1 <= i) {
+                depth++;
+            }
+            sys.addBody(0.2*depth, 0.05*i, i == 0 ? 0 : 1);
+        }
+        for (int i = 1; i < n; i++) {
+            sys.join((i-1)/2, i, i);
+        }
+        failed += check("binary", sys, true);
+    }
+
+    //a differential: one constraint acting on three shafts, each driven by a chain of its own
+    {
+        System sys;
+        for (int i = 0; i < 9; i++) {
+            sys.addBody(0.2*(i/3), 0.2*(i%3), 1);
+        }
+        std::vector<Connector*> mc = {sys.conns[0], sys.conns[1], sys.conns[2]};
+        sys.solver.addConstraint(new MultiWayConstraint(mc, {-1, 0.5, 0.5}));
+        for (int i = 3; i < 9; i++) {
+            sys.join(i-3, i, 3);
+        }
+        failed += check("differential", sys, true);
+    }
+
+    //four bodies in a ring, which is not a tree
+    {
+        System sys;
+        for (int i = 0; i < 4; i++) {
+            sys.addBody(0.2*(i%2), 0.2*(i/2), i == 0 ? 0 : 1);
+        }
+        sys.join(0, 1, 1);
+        sys.join(1, 3, 2);
+        sys.join(3, 2, 1);
+        sys.join(2, 0, 2);
+        failed += check("ring", sys, false);
+    }
+
+    return failed ? 1 : 0;
+}
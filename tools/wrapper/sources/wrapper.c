@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <float.h>
 #include "gsl-interface.h"
 
 #include "modelDescription.h"
@@ -19,9 +20,7 @@
 //having hand-written getters and setters
 #define HAVE_GENERATED_GETTERS_SETTERS  //for letting the template know that we have our own getters and setters
 
-// This check serves two purposes:
-// - protect against senseless zero-real FMUs
-// - avoid compilation problems on Windows (me_simulation::partials becoming [0])
+// protect against senseless zero-real FMUs
 #if NUMBER_OF_REALS == 0
 #error NUMBER_OF_REALS == 0 does not make sense for ModelExchange
 #endif
@@ -42,20 +41,36 @@ typedef struct Backup
     fmi2_real_t x[NUMBER_OF_STATES+NUMBER_OF_REAL_OUTPUTS];
     unsigned long failed_steps;
     fmi2_event_info_t eventInfo;
+    unsigned long generation;   //of the states held, see fmu_parameters. 0 if none
 }Backup;
 
 typedef struct {
     fmi2ValueReference unknown, known, vr;
 } partial_t;
 
+//sparse Jacobian of the real outputs w.r.t. the real inputs, in CSR form
+//the structure comes from the dependencies in <ModelStructure><Outputs>
+typedef struct {
+    size_t nrows, ncols;
+    fmi2_value_reference_t *row_vr, *col_vr;
+    size_t *row_start;      //nrows+1 entries
+    size_t *col;            //column of each non-zero
+    fmi2Real *val;          //value of each non-zero
+    //columns of the same colour share no rows, so they can be perturbed together
+    //columns nothing depends on get colour -1
+    int *colour;
+    int ncolours;
+    fmi2Real *u, *u1, *du, *y0, *y1;
+    bool valid;             //cleared whenever inputs, parameters or states change
+} jacobian_t;
+
 typedef struct {
     cgsl_simulation sim;
 
-    //we're guaranteed never to need more than (number of reals)^2 partials
-    //this could be optimized slightly, using number of real inputs * number of real outputs
-    //doing it this way avoids a bunch of allocations
-    partial_t partials[NUMBER_OF_REALS*NUMBER_OF_REALS];
+    //(unknown, known, vr) triplets from directional.txt, sorted for bsearch()
+    partial_t *partials;
     size_t npartials;
+    jacobian_t jacobian;
 
     fmi2_import_t *FMU;
     char* dir;
@@ -99,6 +114,12 @@ typedef struct fmu_parameters {
 
     fmi2_import_t *FMU;
     Backup m_backup;
+
+    //dirty tracking. generation identifies the current states of sim and the FMU,
+    //and is renewed from generations whenever they change. A Backup with the same
+    //generation already holds them, so storing or restoring it can be skipped.
+    //Lives here rather than in me_simulation so fmi2SetFMUstate() doesn't overwrite it
+    unsigned long generation, generations;
 } fmu_parameters;
 
 //#define signbits(a,b) ((a > 0)? ( (b > 0) ? 1 : 0) : (b<=0)? 1: 0)
@@ -111,6 +132,18 @@ fmu_parameters* get_p(cgsl_model* m){
     return (fmu_parameters*)(m->parameters);
 }
 
+/** touchStates()
+ *  Marks the states as changed, so no existing Backup matches them any more
+ *
+ *  @param sim The simulation. Does nothing before prepare()
+ */
+void touchStates(cgsl_simulation *sim){
+    if (sim->model) {
+        fmu_parameters *p = get_p(sim->model);
+        p->generation = ++p->generations;
+    }
+}
+
 /** getSafeAndCrossed()
  *  Extracts safe and crossed time found by fmu_function
  */
@@ -217,6 +250,7 @@ void init_fmu_model(cgsl_model **m, fmi2_import_t *FMU){
     p->t_past     = 0;
     p->stateEvent = false;
     p->count      = 0;
+    p->generation = p->generations = 1;
 
 #ifdef WRAPPER_USE_FILTER
     *m = cgsl_model_default_alloc(NUMBER_OF_STATES+NUMBER_OF_REAL_OUTPUTS, NULL, p, fmu_function, NULL, NULL, NULL, 0);
@@ -256,6 +290,12 @@ void prepare(cgsl_simulation *sim, fmi2_import_t *FMU, enum cgsl_integrator_ids
  */
 void restoreStates(cgsl_simulation *sim, Backup *backup){
     fmu_parameters* p = get_p(sim->model);
+
+    //nothing has changed since backup was stored
+    if (backup->generation == p->generation) {
+        return;
+    }
+
     //restore previous states
 
 #ifdef WRAPPER_USE_FILTER
@@ -283,6 +323,8 @@ void restoreStates(cgsl_simulation *sim, Backup *backup){
     gsl_odeiv2_evolve_reset(sim->i.evolution);
     gsl_odeiv2_step_reset(sim->i.step);
     gsl_odeiv2_driver_reset(sim->i.driver);
+
+    p->generation = backup->generation;
 }
 
 /** storeStates()
@@ -294,6 +336,11 @@ void restoreStates(cgsl_simulation *sim, Backup *backup){
 void storeStates(cgsl_simulation *sim, Backup *backup){
     fmu_parameters* p = get_p(sim->model);
 
+    //backup already holds the current states
+    if (backup->generation == p->generation) {
+        return;
+    }
+
     fmi2_import_get_continuous_states(p->FMU, sim->model->x,NUMBER_OF_STATES);
     fmi2_import_get_event_indicators (p->FMU, backup->ei_b, NUMBER_OF_EVENT_INDICATORS);
     memcpy(backup->x, sim->model->x, sim->model->n_variables * sizeof(backup->x[0]));
@@ -304,6 +351,8 @@ void storeStates(cgsl_simulation *sim, Backup *backup){
 
     memcpy(backup->dydt, sim->i.evolution->dydt_out,
            sim->model->n_variables * sizeof(backup->dydt[0]));
+
+    backup->generation = p->generation;
 }
 
 /** hasStateEvent()
@@ -349,6 +398,7 @@ void me_step(cgsl_simulation *sim, TimeLoop *timeLoop){
     p->t_past = max(p->t_past, sim->t + timeLoop->dt_new);
     p->t_ok = sim->t;
 
+    touchStates(sim);
     cgsl_step_to(sim, sim->t, timeLoop->dt_new);
 }
 
@@ -422,6 +472,7 @@ void newDiscreteStates(cgsl_simulation *sim, Backup *backup){
     }
 
     fmi2_import_enter_continuous_time_mode(p->FMU);
+    touchStates(sim);
 
     // store the current state of all running FMUs
     storeStates(sim, backup);
@@ -512,6 +563,7 @@ void runIteration(cgsl_simulation *sim, double t, double dt) {
 #define SIMULATION_ENTER_INIT       wrapper_enter_init
 #define SIMULATION_EXIT_INIT        wrapper_exit_init
 #define SIMULATION_FREE             wrapper_free
+#define SIMULATION_DIRECTIONAL_DERIVATIVE wrapper_directional_derivative
 
 #include "strlcpy.h"
 
@@ -551,6 +603,8 @@ static fmi2Status generated_fmi2GetReal(ModelInstance *comp, const modelDescript
 }
 
 static fmi2Status generated_fmi2SetReal(ModelInstance *comp, modelDescription_t *md, const fmi2ValueReference vr[], size_t nvr, const fmi2Real value[]) {
+    comp->s.simulation.jacobian.valid = false;
+    touchStates(&comp->s.simulation.sim);
     if( comp->s.simulation.FMU != NULL)
         return (fmi2Status)fmi2_import_set_real(comp->s.simulation.FMU,vr,nvr,value);
     return fmi2Error;
@@ -572,6 +626,8 @@ static fmi2Status generated_fmi2GetInteger(ModelInstance *comp, const modelDescr
 }
 
 static fmi2Status generated_fmi2SetInteger(ModelInstance *comp, modelDescription_t *md, const fmi2ValueReference vr[], size_t nvr, const fmi2Integer value[]) {
+    comp->s.simulation.jacobian.valid = false;
+    touchStates(&comp->s.simulation.sim);
     if( comp->s.simulation.FMU != NULL) {
         size_t x;
 
@@ -595,6 +651,8 @@ static fmi2Status generated_fmi2GetBoolean(ModelInstance *comp, const modelDescr
 }
 
 static fmi2Status generated_fmi2SetBoolean(ModelInstance *comp, modelDescription_t *md, const fmi2ValueReference vr[], size_t nvr, const fmi2Boolean value[]) {
+    comp->s.simulation.jacobian.valid = false;
+    touchStates(&comp->s.simulation.sim);
     if( comp->s.simulation.FMU != NULL)
         return (fmi2Status)fmi2_import_set_boolean(comp->s.simulation.FMU,vr,nvr,value);
     return fmi2Error;
@@ -605,6 +663,8 @@ static fmi2Status generated_fmi2GetString(ModelInstance *comp, const modelDescri
 }
 
 static fmi2Status generated_fmi2SetString(ModelInstance *comp, modelDescription_t *md, const fmi2ValueReference vr[], size_t nvr, const fmi2String value[]) {
+    comp->s.simulation.jacobian.valid = false;
+    touchStates(&comp->s.simulation.sim);
     if( comp->s.simulation.FMU != NULL) {
         size_t x;
 
@@ -627,36 +687,236 @@ fmi2Status wrapper_get ( me_simulation *sim) {
 }
 
 fmi2Status wrapper_set ( me_simulation *sim) {
+    sim->jacobian.valid = false;
     restoreStates(&sim->sim, &sim->m_backup);
     return fmi2OK;
 }
 
+static int comparePartials(const void *a, const void *b) {
+    const partial_t *pa = (const partial_t*)a, *pb = (const partial_t*)b;
+    if (pa->unknown != pb->unknown) return pa->unknown < pb->unknown ? -1 : 1;
+    if (pa->known   != pb->known)   return pa->known   < pb->known   ? -1 : 1;
+    return 0;
+}
+
+static int findVR(const fmi2_value_reference_t *vrs, size_t n, fmi2ValueReference vr) {
+    size_t x;
+    for (x = 0; x < n; x++) {
+        if (vrs[x] == vr) {
+            return (int)x;
+        }
+    }
+    return -1;
+}
+
+/** colourJacobian()
+ *  Greedy distance-2 colouring of the columns: two columns get different
+ *  colours if any row depends on both of them.
+ */
+static void colourJacobian(jacobian_t *J) {
+    size_t r, j, k, l;
+    char *forbidden = (char*)calloc(J->ncols+1, 1);
+
+    J->ncolours = 0;
+    for (j = 0; j < J->ncols; j++) {
+        J->colour[j] = -1;
+    }
+
+    for (j = 0; j < J->ncols; j++) {
+        bool used = false;
+        int c;
+        memset(forbidden, 0, J->ncols+1);
+
+        for (r = 0; r < J->nrows; r++) {
+            bool inrow = false;
+            for (k = J->row_start[r]; k < J->row_start[r+1]; k++) {
+                inrow = inrow || J->col[k] == j;
+            }
+            if (!inrow) {
+                continue;
+            }
+            used = true;
+            for (l = J->row_start[r]; l < J->row_start[r+1]; l++) {
+                if (J->colour[J->col[l]] >= 0) {
+                    forbidden[J->colour[J->col[l]]] = 1;
+                }
+            }
+        }
+
+        if (used) {
+            for (c = 0; forbidden[c]; c++);
+            J->colour[j] = c;
+            J->ncolours = max(J->ncolours, c+1);
+        }
+    }
+
+    free(forbidden);
+}
+
+/** setupJacobian()
+ *  Builds the sparsity pattern of d(real outputs)/d(real inputs) from the
+ *  output dependencies of the wrapped FMU, and colours its columns
+ */
+static void setupJacobian(me_simulation *me) {
+    jacobian_t *J = &me->jacobian;
+    fmi2_import_variable_list_t *vl = fmi2_import_get_variable_list(me->FMU, 0);
+    fmi2_import_variable_list_t *outputs = fmi2_import_get_outputs_list(me->FMU);
+    size_t nvars = fmi2_import_get_variable_list_size(vl);
+    size_t nout  = fmi2_import_get_variable_list_size(outputs);
+    size_t *startIndex = NULL, *dependency = NULL;
+    char *factorKind = NULL;
+    size_t x, k, r, nnz;
+
+    memset(J, 0, sizeof(*J));
+    J->row_vr = (fmi2_value_reference_t*)calloc(nout+1,  sizeof(fmi2_value_reference_t));
+    J->col_vr = (fmi2_value_reference_t*)calloc(nvars+1, sizeof(fmi2_value_reference_t));
+
+    for (x = 0; x < nvars; x++) {
+        fmi2_import_variable_t *var = fmi2_import_get_variable(vl, x);
+        if (fmi2_import_get_causality(var) == fmi2_causality_enu_input &&
+            fmi2_import_get_variable_base_type(var) == fmi2_base_type_real) {
+            J->col_vr[J->ncols++] = fmi2_import_get_variable_vr(var);
+        }
+    }
+
+    fmi2_import_get_outputs_dependencies(me->FMU, &startIndex, &dependency, &factorKind);
+
+    //no output can depend on more than all of the inputs
+    J->row_start = (size_t*)calloc(nout+1, sizeof(size_t));
+    J->col       = (size_t*)calloc(nout*J->ncols+1, sizeof(size_t));
+
+    for (x = 0; x < nout; x++) {
+        fmi2_import_variable_t *var = fmi2_import_get_variable(outputs, x);
+        bool all = !startIndex;
+        nnz = J->row_start[J->nrows];
+
+        if (fmi2_import_get_variable_base_type(var) != fmi2_base_type_real) {
+            continue;
+        }
+
+        J->row_vr[J->nrows] = fmi2_import_get_variable_vr(var);
+        for (k = startIndex ? startIndex[x] : 0; !all && k < startIndex[x+1]; k++) {
+            if (dependency[k] == 0) {
+                //FMIL's way of saying "depends on everything"
+                all = true;
+            } else if (dependency[k] <= nvars) {
+                fmi2_import_variable_t *dep = fmi2_import_get_variable(vl, dependency[k]-1);
+                int j = findVR(J->col_vr, J->ncols, fmi2_import_get_variable_vr(dep));
+                if (j >= 0 && fmi2_import_get_causality(dep) == fmi2_causality_enu_input) {
+                    J->col[nnz++] = j;
+                }
+            }
+        }
+        if (all) {
+            nnz = J->row_start[J->nrows];
+            for (r = 0; r < J->ncols; r++) {
+                J->col[nnz++] = r;
+            }
+        }
+        J->row_start[++J->nrows] = nnz;
+    }
+
+    nnz = J->row_start[J->nrows];
+    J->val    = (fmi2Real*)calloc(nnz+1, sizeof(fmi2Real));
+    J->colour = (int*)calloc(J->ncols+1, sizeof(int));
+    J->u      = (fmi2Real*)calloc(J->ncols+1, sizeof(fmi2Real));
+    J->u1     = (fmi2Real*)calloc(J->ncols+1, sizeof(fmi2Real));
+    J->du     = (fmi2Real*)calloc(J->ncols+1, sizeof(fmi2Real));
+    J->y0     = (fmi2Real*)calloc(J->nrows+1, sizeof(fmi2Real));
+    J->y1     = (fmi2Real*)calloc(J->nrows+1, sizeof(fmi2Real));
+
+    colourJacobian(J);
+
+    fmi2_import_free_variable_list(outputs);
+    fmi2_import_free_variable_list(vl);
+}
+
+static void freeJacobian(jacobian_t *J) {
+    free(J->row_vr);
+    free(J->col_vr);
+    free(J->row_start);
+    free(J->col);
+    free(J->val);
+    free(J->colour);
+    free(J->u);
+    free(J->u1);
+    free(J->du);
+    free(J->y0);
+    free(J->y1);
+}
+
+/** computeJacobian()
+ *  Forward differences of all real outputs, one perturbation per colour.
+ *  Since the FMU is ME we don't need to doStep() for the outputs to update
+ *  when changing the inputs. Goes straight to the FMU so the outputs aren't filtered.
+ */
+static fmi2Status computeJacobian(me_simulation *me) {
+    jacobian_t *J = &me->jacobian;
+    size_t r, j, k;
+    int c;
+
+    //save state
+    if (wrapper_get(me) != fmi2OK) return fmi2Error;
+
+    if (fmi2_import_get_real(me->FMU, J->col_vr, J->ncols, J->u)  != fmi2_status_ok) return fmi2Error;
+    if (fmi2_import_get_real(me->FMU, J->row_vr, J->nrows, J->y0) != fmi2_status_ok) return fmi2Error;
+
+    for (c = 0; c < J->ncolours; c++) {
+        for (j = 0; j < J->ncols; j++) {
+            J->du[j] = J->colour[j] == c ? sqrt(DBL_EPSILON) * max(fabs(J->u[j]), 1.0) : 0;
+            J->u1[j] = J->u[j] + J->du[j];
+        }
+
+        if (fmi2_import_set_real(me->FMU, J->col_vr, J->ncols, J->u1) != fmi2_status_ok) return fmi2Error;
+        if (fmi2_import_get_real(me->FMU, J->row_vr, J->nrows, J->y1) != fmi2_status_ok) return fmi2Error;
+
+        for (r = 0; r < J->nrows; r++) {
+            for (k = J->row_start[r]; k < J->row_start[r+1]; k++) {
+                if (J->colour[J->col[k]] == c) {
+                    //u1 - u rather than du, since that's the step that was actually taken
+                    J->val[k] = (J->y1[r] - J->y0[r]) / (J->u1[J->col[k]] - J->u[J->col[k]]);
+                }
+            }
+        }
+    }
+
+    //restore state
+    if (fmi2_import_set_real(me->FMU, J->col_vr, J->ncols, J->u) != fmi2_status_ok) return fmi2Error;
+    if (wrapper_set(me) != fmi2OK) return fmi2Error;
+
+    J->valid = true;
+    return fmi2OK;
+}
+
 //#include <stdio.h>
 static fmi2Status getPartial(ModelInstance *comp, fmi2ValueReference vr, fmi2ValueReference wrt, fmi2Real *partial){
-    size_t x;
     state_t *s = &comp->s;
-
-    if ( fmi2_import_get_capability(comp->s.simulation.FMU, fmi2_me_providesDirectionalDerivatives ) ){
-      fmi2_value_reference_t vrp []  = {vr};
-      fmi2_value_reference_t wrtp[]  = {wrt};
-      fmi2_value_reference_t zrefp[] = {0};
-      fmi2Real dv [] = {1.0};
-      // TODO: move this logic to the fmuTemplate_impl.h
-      return (fmi2Status)fmi2_import_get_directional_derivative(
-        comp->s.simulation.FMU,
-        wrtp, 1,  //v_ref aka known ("Value references for the seed vector")
-        vrp, 1,   //z_ref aka unknown ("Value references for the derivatives/outputs to be processed")
-        dv,       //dv
-        partial   //dz
-      );
+    jacobian_t *J = &s->simulation.jacobian;
+    partial_t key, *found;
+    int row, col;
+
+    key.unknown = vr;
+    key.known   = wrt;
+    found = s->simulation.npartials ? (partial_t*)bsearch(&key, s->simulation.partials, s->simulation.npartials,
+                                                          sizeof(partial_t), comparePartials) : NULL;
+    if (found) {
+        return generated_fmi2GetReal(comp, &s->md, &found->vr, 1, partial);
     }
 
-    //could speed this up with binary search or some kind of simple hash map
-    for (x = 0; x < s->simulation.npartials; x++) {
-        if (vr  == s->simulation.partials[x].unknown &&
-            wrt == s->simulation.partials[x].known) {
-            return generated_fmi2GetReal(comp, &s->md, &s->simulation.partials[x].vr, 1, partial);
+    row = findVR(J->row_vr, J->nrows, vr);
+    col = findVR(J->col_vr, J->ncols, wrt);
+    if (row >= 0 && col >= 0) {
+        size_t k;
+
+        if (!J->valid && computeJacobian(&s->simulation) != fmi2OK) return fmi2Error;
+
+        *partial = 0;
+        for (k = J->row_start[row]; k < J->row_start[row+1]; k++) {
+            if (J->col[k] == (size_t)col) {
+                *partial = J->val[k];
+            }
         }
+        return fmi2OK;
     }
 
     //compute d(vr)/d(wrt) = (vr1 - vr0) / (wrt1 - wrt0)
@@ -683,7 +943,8 @@ static fmi2Status getPartial(ModelInstance *comp, fmi2ValueReference vr, fmi2Val
       dwrt = sqrt(hi) * sqrt(lo);
       wrt1 = wrt0 + dwrt;
 
-      if (generated_fmi2SetReal(comp, &s->md, &wrt, 1, &wrt1) != fmi2OK) return fmi2Error;
+      //straight to the FMU, since only an input changes the states stay clean
+      if (fmi2_import_set_real(s->simulation.FMU, &wrt, 1, &wrt1) != fmi2_status_ok) return fmi2Error;
       if (generated_fmi2GetReal(comp, &s->md, &vr,  1, &vr1) != fmi2OK) return fmi2Error;
 
       fmi2Real res = fabs(vr1 - vr0);
@@ -703,6 +964,7 @@ static fmi2Status getPartial(ModelInstance *comp, fmi2ValueReference vr, fmi2Val
     }
 
     //restore state
+    if (fmi2_import_set_real(s->simulation.FMU, &wrt, 1, &wrt0) != fmi2_status_ok) return fmi2Error;
     if (wrapper_set(&s->simulation) != fmi2OK) return fmi2Error;
 
     *partial = (vr1 - vr0) / dwrt;
@@ -710,13 +972,59 @@ static fmi2Status getPartial(ModelInstance *comp, fmi2ValueReference vr, fmi2Val
     return fmi2OK;
 }
 
+/** wrapper_directional_derivative()
+ *  Handles a whole fmi2GetDirectionalDerivative() call, so FMUs that provide
+ *  directional derivatives get one call and the rest share one Jacobian
+ */
+static fmi2Status wrapper_directional_derivative(ModelInstance *comp,
+        const fmi2ValueReference vUnknown_ref[], size_t nUnknown,
+        const fmi2ValueReference vKnown_ref[],   size_t nKnown,
+        const fmi2Real dvKnown[], fmi2Real dvUnknown[]) {
+    size_t x, y;
+
+    if (fmi2_import_get_capability(comp->s.simulation.FMU, fmi2_me_providesDirectionalDerivatives)) {
+        return (fmi2Status)fmi2_import_get_directional_derivative(
+            comp->s.simulation.FMU,
+            vKnown_ref, nKnown,     //v_ref aka known ("Value references for the seed vector")
+            vUnknown_ref, nUnknown, //z_ref aka unknown ("Value references for the derivatives/outputs to be processed")
+            dvKnown,                //dv
+            dvUnknown               //dz
+        );
+    }
+
+    for (x = 0; x < nUnknown; x++) {
+        dvUnknown[x] = 0;
+
+        for (y = 0; y < nKnown; y++) {
+            fmi2Real partial;
+            fmi2Status status;
+
+            if (dvKnown[y] == 0) {
+                continue;
+            }
+
+            status = getPartial(comp, vUnknown_ref[x], vKnown_ref[y], &partial);
+            if (status != fmi2OK) {
+                fprintf(stderr, "Tried to get partial derivative of VR %i w.r.t VR %i, which doesn't exist or isn't defined\n", vUnknown_ref[x], vKnown_ref[y]);
+                return status;
+            }
+
+            dvUnknown[x] += dvKnown[y] * partial;
+        }
+    }
+
+    return fmi2OK;
+}
+
 static void doStep(state_t *s, fmi2Real currentCommunicationPoint, fmi2Real communicationStepSize, fmi2Boolean noSetFMUStatePriorToCurrentPoint) {
+    s->simulation.jacobian.valid = false;
 #ifdef WRAPPER_USE_FILTER
     //clear averages
     int i;
     for (i = 0; i < NUMBER_OF_REAL_OUTPUTS; i++) {
         s->simulation.sim.model->x[NUMBER_OF_STATES+i] = 0;
     }
+    touchStates(&s->simulation.sim);
 #endif
 
     runIteration(&s->simulation.sim, currentCommunicationPoint,communicationStepSize);
@@ -880,23 +1188,23 @@ static fmi2Status wrapper_exit_init(ModelInstance *comp) {
     if (fp) {
         //read partials from directional.txt
         me_simulation *me = &comp->s.simulation;
+        partial_t p;
+        size_t size = 0;
 
-        for (;;) {
-            partial_t *p = &me->partials[me->npartials];
-            int n = fscanf(fp, "%u %u %u", &p->unknown, &p->known, &p->vr);
-
-            if (n < 3) {
-                break;
-            }
-
-            if (++me->npartials >= sizeof(me->partials)/sizeof(me->partials[0])) {
-                break;
+        while (fscanf(fp, "%u %u %u", &p.unknown, &p.known, &p.vr) == 3) {
+            if (me->npartials == size) {
+                size = 2*size + 16;
+                me->partials = (partial_t*)realloc(me->partials, size * sizeof(partial_t));
             }
+            me->partials[me->npartials++] = p;
         }
 
         fclose(fp);
+        qsort(me->partials, me->npartials, sizeof(partial_t), comparePartials);
     }
 
+    setupJacobian(&comp->s.simulation);
+
     return fmi2OK;
 }
 
@@ -909,6 +1217,8 @@ static void wrapper_free(me_simulation me) {
   fmi2_import_free(me.FMU);
   fmi_import_rmdir(&me.m_jmCallbacks, me.dir);
   free(me.dir);
+  free(me.partials);
+  freeJacobian(&me.jacobian);
   cgsl_free_simulation(me.sim);
 }
 